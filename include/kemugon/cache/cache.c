@@ -0,0 +1,42 @@
+/**
+ * @file cache.c
+ * 
+ * @brief Implementation, decoded instruction cache keyed by guest PC
+ */
+
+#include "kemugon/cache/cache.h"
+
+/**
+ * @brief Allocate one empty entry per guest address
+*/
+uint8_t kemuCache_alloc(KemuCache *cache, size_t entryCount){
+	if(NULL_CHECK(cache)){
+		return KEMU_FAIL;
+	}
+	cache->entry = calloc(entryCount, sizeof(KemuCache_entry));
+	cache->heat = calloc(entryCount, sizeof(uint8_t));
+	if(NULL_CHECK(cache->entry) || NULL_CHECK(cache->heat)){
+		kemuCache_free(cache);
+		return KEMU_FAIL;
+	}
+	cache->entryCount = entryCount;
+	return KEMU_SUCCESS;
+}
+
+void kemuCache_free(KemuCache *cache){
+	free(cache->entry);
+	free(cache->heat);
+	cache->entry = NULL;
+	cache->heat = NULL;
+	cache->entryCount = 0;
+}
+
+/**
+ * @brief Drop decoded entries in range, wraps around the address space
+*/
+void kemuCache_invalidate(KemuCache *cache, size_t first, size_t count){
+	for(size_t i=0; i<count; i++){
+		cache->entry[(first + i) % cache->entryCount].handler = NULL;
+		cache->heat[(first + i) % cache->entryCount] = 0;
+	}
+}
@@ -0,0 +1,34 @@
+/**
+ * @file cache.h
+ * 
+ * @brief Header, decoded instruction cache keyed by guest PC
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libkael/debug/kaelMacros.h"
+
+/**
+ * @brief One pre-decoded instruction. handler==NULL means not decoded yet
+*/
+typedef struct{
+	const void *handler; //Threaded code label of the interpreter
+	uint8_t op;
+	uint8_t cycles; //Emulated cycle cost
+	uint16_t arg[2];
+	uint16_t nextPC;
+}KemuCache_entry;
+
+typedef struct{
+	KemuCache_entry *entry; //One entry per VAS address
+	uint8_t *heat; //Executions of each entry counted towards superinstruction fusion
+	size_t entryCount;
+}KemuCache;
+
+uint8_t kemuCache_alloc(KemuCache *cache, size_t entryCount);
+void kemuCache_free(KemuCache *cache);
+
+void kemuCache_invalidate(KemuCache *cache, size_t first, size_t count);
@@ -13,26 +13,29 @@ void rdtsc_sleep(uint64_t sleepTime) {
 	};
 }
 
-void kemuClock_sync(KemuClock *clock) {
-	uint8_t carry = 0;
-
-	// If lag accumulates >=1 emu-cycle, start of next emu-cycle is advanced by 1 host-cycle
-	clock->accumulator += clock->lagCycle;
-	if(clock->accumulator >= clock->emuClockSpeed){
-		clock->accumulator -= clock->emuClockSpeed;
-		carry = 1;
-	}
+/**
+ * @brief Wait until host time catches up with cycles emulated since last sync
+ * Called once per quantum, so fractional host-cycles are carried in accumulator
+*/
+void kemuClock_sync(KemuClock *clock, uint64_t cycles) {
+	// Lag of each emu-cycle accumulates, every whole emu-cycle of lag adds 1 host-cycle to the quantum
+	clock->accumulator += clock->lagCycle * cycles;
+	uint64_t carry = clock->accumulator / clock->emuClockSpeed;
+	clock->accumulator -= carry * clock->emuClockSpeed;
+	uint64_t quantumTime = clock->cycleRatio * cycles + carry;
 
 	uint64_t timeNow = __rdtsc();
 	uint64_t elapsedTime = kaelMath_sub(timeNow, clock->startTime);
-	uint64_t waitTime = clock->cycleRatio - elapsedTime;
+	uint64_t waitTime = quantumTime - elapsedTime;
 	if(!kaelMath_isNegative(waitTime)){
 		rdtsc_sleep((uint64_t)waitTime);
+		clock->startTime += quantumTime;
+	}else{
+		clock->startTime = timeNow; //Don't try to catch up after lagging
 	}
-	clock->startTime = timeNow + clock->cycleRatio + carry;
 
 	#if KAEL_DEBUG
-		if(clock->printDelay==0){
+		if(clock->printDelay<=cycles){
 			if(kaelMath_isNegative(waitTime)){
 					printf("Emulation lagging behind by %ld host-cycles\n", -1*waitTime);
 			}else{
@@ -40,7 +43,7 @@ void kemuClock_sync(KemuClock *clock) {
 			}
 			clock->printDelay = clock->printFreq;
 		}else{
-			clock->printDelay--;
+			clock->printDelay-=cycles;
 		}
 	#endif
 }
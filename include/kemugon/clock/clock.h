@@ -31,6 +31,6 @@ typedef struct {
 
 void rdtsc_sleep(uint64_t sleepTime);
 
-void kemuClock_sync(KemuClock *clock);
+void kemuClock_sync(KemuClock *clock, uint64_t cycles);
 
 void kemuClock_init(KemuClock *clock, uint64_t hostHz, uint64_t emuHz);
\ No newline at end of file
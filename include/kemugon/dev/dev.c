@@ -4,11 +4,348 @@
  * @brief Implementation, banked virtual disk
  */
 
+#define _GNU_SOURCE //memfd_create, fallocate
+
+#include <sys/stat.h>
+
 #include "libkael/debug/kaelMacros.h"
 
 #include "kemugon/sys/sys.h"
 #include "kemugon/dev/dev.h"
 
+//------ Host files ------
+
+/**
+ * @brief Round offset up to a multiple of align, used to start data on a host page
+*/
+uint64_t kemuDev_align( const uint64_t offset, const uint64_t align ) {
+	return (offset + align - 1) / align * align;
+}
+
+/**
+ * @brief pread until done, short files read as zero
+*/
+static uint8_t kemuDev_read(const int fd, void *buf, size_t size, off_t offset){
+	uint8_t *dst = buf;
+	while(size){
+		ssize_t got = pread(fd, dst, size, offset);
+		if(got < 0){
+			return KEMU_FAIL;
+		}
+		if(got == 0){
+			memset(dst, 0, size);
+			break;
+		}
+		dst += got;
+		size -= got;
+		offset += got;
+	}
+	return KEMU_SUCCESS;
+}
+
+/**
+ * @brief pwrite until done. Also writes machine and program images
+*/
+uint8_t kemuDev_write( const int fd, const void *buf, size_t size, off_t offset ) {
+	const uint8_t *src = buf;
+	while(size){
+		ssize_t written = pwrite(fd, src, size, offset);
+		if(written <= 0){
+			return KEMU_FAIL;
+		}
+		src += written;
+		size -= written;
+		offset += written;
+	}
+	return KEMU_SUCCESS;
+}
+
+//------ Overlay ------
+
+/**
+ * @brief Map basePath privately so untouched banks share the host page cache, then read banks held by the delta
+ * Delta layout: bank data at the same offsets as the base, one deltaMap byte per bank after it
+*/
+static uint8_t kemuDev_allocOverlay( KemuDev *disk ) {
+	const size_t totalSize = disk->head.totalSize;
+	const size_t bankBytes = disk->head.bankSize * sizeof(uint16_t);
+	const size_t deltaSize = totalSize + disk->head.bankCount;
+
+	int baseFd = open(disk->basePath, O_RDONLY);
+	if (baseFd < 0) {
+		perror("Failed to open base disk file");
+		return KEMU_FAIL;
+	}
+	disk->ioFd = open(disk->path, O_RDWR | O_CREAT, 0666);
+	if (disk->ioFd < 0) {
+		perror("Failed to open delta disk file");
+		close(baseFd);
+		return KEMU_FAIL;
+	}
+	struct stat st;
+	if (fstat(disk->ioFd, &st) < 0 || (st.st_size != 0 && (size_t)st.st_size != deltaSize)) {
+		printf("Delta %s doesn't match device size\n", disk->path);
+		close(baseFd);
+		close(disk->ioFd);
+		return KEMU_FAIL;
+	}
+	// Holes read as zero, a new delta holds no banks
+	if (ftruncate(disk->ioFd, deltaSize) < 0) {
+		perror("Failed to set delta size");
+		close(baseFd);
+		close(disk->ioFd);
+		return KEMU_FAIL;
+	}
+	disk->deltaMap = calloc(disk->head.bankCount, sizeof(uint8_t));
+	if (NULL_CHECK(disk->deltaMap) || kemuDev_read(disk->ioFd, disk->deltaMap, disk->head.bankCount, totalSize) == KEMU_FAIL) {
+		free(disk->deltaMap);
+		disk->deltaMap = NULL;
+		close(baseFd);
+		close(disk->ioFd);
+		return KEMU_FAIL;
+	}
+
+	uint8_t err = KEMU_SUCCESS;
+	#if KEMU_FLAT_VAS
+		//Window slices need an fd to alias, base is copied into a memfd instead of shared
+		disk->fd = memfd_create("kemuOverlay", 0);
+		if (disk->fd < 0 || ftruncate(disk->fd, totalSize) < 0) {
+			perror("Failed to create device memfd");
+			exit(EXIT_FAILURE);
+		}
+		disk->data = mmap(NULL, totalSize, PROT_READ | PROT_WRITE, MAP_SHARED, disk->fd, 0);
+		if (disk->data != MAP_FAILED) {
+			err = kemuDev_read(baseFd, disk->data, totalSize, 0);
+		}
+	#else
+		struct stat baseSt;
+		disk->fd = -1;
+		disk->data = MAP_FAILED;
+		if (fstat(baseFd, &baseSt) == 0 && (size_t)baseSt.st_size >= totalSize) {
+			disk->data = mmap(NULL, totalSize, PROT_READ | PROT_WRITE, MAP_PRIVATE, baseFd, 0);
+		} else {
+			printf("Base %s is smaller than the device\n", disk->basePath);
+		}
+	#endif
+	close(baseFd);
+	if (disk->data == MAP_FAILED) {
+		perror("Failed to mmap base disk file");
+		exit(EXIT_FAILURE);
+	}
+
+	for(size_t i=0; err==KEMU_SUCCESS && i<disk->head.bankCount; i++){
+		if(disk->deltaMap[i]){
+			err = kemuDev_read(disk->ioFd, (uint8_t *)disk->data + i * bankBytes, bankBytes, i * bankBytes);
+		}
+	}
+	if(err == KEMU_FAIL){
+		perror("Failed to read delta disk file");
+		munmap(disk->data, totalSize);
+		if (disk->fd >= 0) {
+			close(disk->fd);
+		}
+		close(disk->ioFd);
+		free(disk->deltaMap);
+		disk->deltaMap = NULL;
+		return KEMU_FAIL;
+	}
+	disk->store = OVERLAY_STORE;
+	return KEMU_SUCCESS;
+}
+
+/**
+ * @brief Copy up whole bank to the delta, then mark it held. Its chunks no longer need flushing
+*/
+static uint8_t kemuDev_copyUp( KemuDev *disk, const size_t bank ) {
+	const size_t bankBytes = disk->head.bankSize * sizeof(uint16_t);
+	if(disk->dirty){
+		size_t firstChunk = bank * disk->head.bankSize >> KEMU_PAGE_SHIFT;
+		size_t lastChunk = (bank + 1) * disk->head.bankSize >> KEMU_PAGE_SHIFT;
+		for(size_t c=firstChunk; c<lastChunk; c++){
+			__atomic_fetch_and(&disk->dirty[c], (uint8_t)~FLUSH_DIRTY, __ATOMIC_ACQ_REL);
+		}
+	}
+	if(kemuDev_write(disk->ioFd, disk->bank[bank], bankBytes, bank * bankBytes) == KEMU_FAIL){
+		return KEMU_FAIL;
+	}
+	disk->deltaMap[bank] = 1;
+	return kemuDev_write(disk->ioFd, &disk->deltaMap[bank], 1, disk->head.totalSize + bank);
+}
+
+/**
+ * @brief Write FLUSH_DIRTY chunks to the delta, banks not yet held are copied up whole
+ * written is set if anything reached the delta
+*/
+static uint8_t kemuDev_writeOverlay( KemuDev *disk, uint8_t *written ) {
+	uint8_t err = KEMU_SUCCESS;
+	const size_t chunkBytes = KEMU_PAGE_SIZE * sizeof(uint16_t);
+	const size_t chunkCount = disk->dirty ? disk->head.totalSize / chunkBytes : 0;
+	const size_t bankChunks = disk->head.bankSize >> KEMU_PAGE_SHIFT;
+
+	//Untracked devices copy up everything
+	for(size_t i=0; disk->dirty==NULL && i<disk->head.bankCount; i++){
+		err |= kemuDev_copyUp(disk, i);
+		*written = 1;
+	}
+	for(size_t c=0; c<chunkCount; c++){
+		if(!(__atomic_load_n(&disk->dirty[c], __ATOMIC_RELAXED) & FLUSH_DIRTY)){
+			continue;
+		}
+		size_t bank = c / bankChunks;
+		*written = 1;
+		if(!disk->deltaMap[bank]){
+			err |= kemuDev_copyUp(disk, bank);
+			c = (bank + 1) * bankChunks - 1;
+		}else if(__atomic_fetch_and(&disk->dirty[c], (uint8_t)~FLUSH_DIRTY, __ATOMIC_ACQ_REL) & FLUSH_DIRTY){
+			err |= kemuDev_write(disk->ioFd, (uint8_t *)disk->data + c * chunkBytes, chunkBytes, c * chunkBytes);
+		}
+	}
+	return err ? KEMU_FAIL : KEMU_SUCCESS;
+}
+
+//------ Stream ------
+
+/**
+ * @brief Open path for pread/pwrite and reserve slotCount banks, no bank is resident yet
+*/
+static uint8_t kemuDev_allocStream( KemuDev *disk ) {
+	const size_t bankBytes = disk->head.bankSize * sizeof(uint16_t);
+	const size_t cacheBytes = disk->cache.slotCount * bankBytes;
+
+	disk->ioFd = open(disk->path, O_RDWR | O_CREAT, 0666);
+	if (disk->ioFd < 0) {
+		perror("Failed to open disk file");
+		return KEMU_FAIL;
+	}
+	// Sparse if new
+	if (ftruncate(disk->ioFd, disk->head.totalSize) < 0) {
+		perror("Failed to set disk size");
+		close(disk->ioFd);
+		return KEMU_FAIL;
+	}
+	disk->cache.slot = malloc(disk->cache.slotCount * sizeof(KemuDev_slot));
+	if (NULL_CHECK(disk->cache.slot)) {
+		close(disk->ioFd);
+		return KEMU_FAIL;
+	}
+	for(uint32_t i=0; i<disk->cache.slotCount; i++){
+		disk->cache.slot[i] = (KemuDev_slot){ .bank = KEMU_SLOT_EMPTY, .lastUse = 0 };
+	}
+	disk->cache.clock = 0;
+
+	#if KEMU_FLAT_VAS
+		//Window slices alias slots through the memfd
+		disk->fd = memfd_create("kemuStream", 0);
+		if (disk->fd < 0 || ftruncate(disk->fd, cacheBytes) < 0) {
+			perror("Failed to create device memfd");
+			exit(EXIT_FAILURE);
+		}
+		disk->data = mmap(NULL, cacheBytes, PROT_READ | PROT_WRITE, MAP_SHARED, disk->fd, 0);
+	#else
+		disk->fd = -1;
+		disk->data = mmap(NULL, cacheBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	#endif
+	if (disk->data == MAP_FAILED) {
+		perror("Failed to mmap bank cache");
+		exit(EXIT_FAILURE);
+	}
+	disk->store = STREAM_STORE;
+	return KEMU_SUCCESS;
+}
+
+/**
+ * @brief Write FLUSH_DIRTY chunks of a resident slot to its bank in the image
+*/
+static uint8_t kemuDev_writeSlot( KemuDev *disk, const uint32_t slot, uint8_t *written ) {
+	const size_t bankWords = disk->head.bankSize;
+	const KemuDev_slot *cur = &disk->cache.slot[slot];
+	if(cur->bank == KEMU_SLOT_EMPTY){
+		return KEMU_SUCCESS;
+	}
+	uint16_t *src = disk->data + slot * bankWords;
+	off_t fileOffset = (off_t)cur->bank * bankWords * sizeof(uint16_t);
+	if(disk->dirty == NULL){
+		*written = 1;
+		return kemuDev_write(disk->ioFd, src, bankWords * sizeof(uint16_t), fileOffset);
+	}
+
+	uint8_t err = KEMU_SUCCESS;
+	const size_t chunkBytes = KEMU_PAGE_SIZE * sizeof(uint16_t);
+	const size_t firstChunk = slot * bankWords >> KEMU_PAGE_SHIFT;
+	for(size_t c=0; c < bankWords >> KEMU_PAGE_SHIFT; c++){
+		uint8_t *dirty = &disk->dirty[firstChunk + c];
+		if((__atomic_load_n(dirty, __ATOMIC_RELAXED) & FLUSH_DIRTY) && (__atomic_fetch_and(dirty, (uint8_t)~FLUSH_DIRTY, __ATOMIC_ACQ_REL) & FLUSH_DIRTY)){
+			err |= kemuDev_write(disk->ioFd, (uint8_t *)src + c * chunkBytes, chunkBytes, fileOffset + c * chunkBytes);
+			*written = 1;
+		}
+	}
+	return err ? KEMU_FAIL : KEMU_SUCCESS;
+}
+
+/**
+ * @brief Evict slot and read bank into it. Caller picks an unmapped slot and drops decoded instructions of it
+*/
+uint16_t *kemuDev_fillSlot( KemuDev *disk, const uint32_t slot, const uint32_t bank ) {
+	const size_t bankWords = disk->head.bankSize;
+	KemuDev_slot *cur = &disk->cache.slot[slot];
+	uint16_t *dst = disk->data + slot * bankWords;
+
+	uint8_t written = 0;
+	if(kemuDev_writeSlot(disk, slot, &written) == KEMU_FAIL){
+		perror("Failed to write back bank");
+		return NULL;
+	}
+	if(cur->bank != KEMU_SLOT_EMPTY){
+		disk->bank[cur->bank] = NULL;
+		cur->bank = KEMU_SLOT_EMPTY;
+	}
+	if(kemuDev_read(disk->ioFd, dst, bankWords * sizeof(uint16_t), (off_t)bank * bankWords * sizeof(uint16_t)) == KEMU_FAIL){
+		perror("Failed to read bank");
+		return NULL;
+	}
+	//New contents to every plane but write-back
+	if(disk->dirty){
+		size_t firstChunk = slot * bankWords >> KEMU_PAGE_SHIFT;
+		memset(&disk->dirty[firstChunk], KEMU_DIRTY_ALL & ~FLUSH_DIRTY, bankWords >> KEMU_PAGE_SHIFT);
+	}
+	cur->bank = bank;
+	cur->lastUse = ++disk->cache.clock;
+	disk->bank[bank] = dst;
+	return dst;
+}
+
+/**
+ * @brief Hint host to read banks ahead of use, they are not made resident
+*/
+void kemuDev_readAhead( KemuDev *disk, const size_t firstBank, const size_t count ) {
+	if(disk->store != STREAM_STORE || firstBank >= disk->head.bankCount){
+		return;
+	}
+	size_t bankBytes = disk->head.bankSize * sizeof(uint16_t);
+	size_t lastBank = kaelMath_min(firstBank + count, disk->head.bankCount);
+	posix_fadvise(disk->ioFd, firstBank * bankBytes, (lastBank - firstBank) * bankBytes, POSIX_FADV_WILLNEED);
+}
+
+/**
+ * @brief Words behind dev->data, only the bank cache for STREAM_STORE
+*/
+size_t kemuDev_residentWords( const KemuDev *disk ) {
+	if(disk->store == STREAM_STORE){
+		return disk->cache.slotCount * disk->head.bankSize;
+	}
+	return disk->head.bankSize * disk->head.bankCount;
+}
+
+/**
+ * @brief Words saved by snapshots, rewind and warm images. STREAM_STORE contents live in the image file instead
+*/
+size_t kemuDev_stateWords( const KemuDev *disk ) {
+	if(disk->store == STREAM_STORE){
+		return 0;
+	}
+	return disk->head.bankSize * disk->head.bankCount;
+}
+
 //------ Disk ------
 
 /**
@@ -25,7 +362,35 @@ uint8_t kemuDev_alloc( KemuDev *disk ) {
 		return KEMU_FAIL;
 	};
 
-	if(disk->path!=NULL){ 
+	if(disk->store==IMAGE_STORE){
+		//Backed by warm-boot image, nothing to allocate
+		if(NULL_CHECK(disk->data)){
+			free(disk->bank);
+			disk->bank = NULL;
+			return KEMU_FAIL;
+		}
+		disk->fd = -1;
+
+	}else if(disk->basePath!=NULL && disk->path!=NULL){
+		//Shared base image with per-instance delta
+		if(kemuDev_allocOverlay(disk) == KEMU_FAIL){
+			free(disk->bank);
+			disk->bank = NULL;
+			return KEMU_FAIL;
+		}
+
+	}else if(disk->path!=NULL && disk->cache.slotCount){
+		//Image larger than the resident budget
+		if(disk->cache.slotCount > disk->head.bankCount){
+			disk->cache.slotCount = disk->head.bankCount;
+		}
+		if(kemuDev_allocStream(disk) == KEMU_FAIL){
+			free(disk->bank);
+			disk->bank = NULL;
+			return KEMU_FAIL;
+		}
+
+	}else if(disk->path!=NULL){ 
 		//Stored as image file on host
 		// Open file for read/write, create if not exists
 		disk->fd = open(disk->path, O_RDWR | O_CREAT, 0666);
@@ -41,21 +406,45 @@ uint8_t kemuDev_alloc( KemuDev *disk ) {
 			exit(EXIT_FAILURE);
 		}
 
-		// Map file into memory
-		disk->data = mmap(NULL, disk->head.totalSize, PROT_READ | PROT_WRITE, MAP_SHARED, disk->fd, 0);
+		// Map file into memory, ROM pages stay clean and are shared by every instance
+		int prot = disk->head.isROM ? PROT_READ : PROT_READ | PROT_WRITE;
+		disk->data = mmap(NULL, disk->head.totalSize, prot, MAP_SHARED, disk->fd, 0);
 		if (disk->data == MAP_FAILED) {
 			perror("Failed to mmap disk file");
 			close(disk->fd);
 			exit(EXIT_FAILURE);
 		}
+		disk->store = FILE_STORE;
 
 	}else{
-		//Exists only in host ram
-		disk->data = calloc(disk->head.totalSize, sizeof(uint16_t));
+	#if KEMU_FLAT_VAS
+		//Exists only in host ram, fd lets the flat VAS window alias it
+		disk->fd = memfd_create("kemuDev", 0);
+		if (disk->fd < 0 || ftruncate(disk->fd, disk->head.totalSize) < 0) {
+			perror("Failed to create device memfd");
+			exit(EXIT_FAILURE);
+		}
+		disk->data = mmap(NULL, disk->head.totalSize, PROT_READ | PROT_WRITE, MAP_SHARED, disk->fd, 0);
+		if (disk->data == MAP_FAILED) {
+			perror("Failed to mmap device memfd");
+			close(disk->fd);
+			exit(EXIT_FAILURE);
+		}
+		disk->store = MEMFD_STORE;
+	#else
+		//Exists only in host ram, pages are committed on first write
+		disk->fd = -1;
+		disk->data = mmap(NULL, disk->head.totalSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (disk->data == MAP_FAILED) {
+			perror("Failed to mmap device memory");
+			exit(EXIT_FAILURE);
+		}
+		disk->store = ANON_STORE;
+	#endif
 	}
 
-	// Addresses of the emulated disk bank pointers
-	for(uint64_t i=0; i<disk->head.bankCount; i++){
+	// Addresses of the emulated disk bank pointers, streamed banks are set once resident
+	for(uint64_t i=0; disk->store!=STREAM_STORE && i<disk->head.bankCount; i++){
 		size_t offset = i * disk->head.bankSize *  sizeof(uint16_t);
 		void *diskBankPtr  = (uint8_t *)disk->data + offset;
 		disk->bank[i] = diskBankPtr;
@@ -68,18 +457,186 @@ void kemuDev_free( KemuDev *disk ) {
 	free(disk->bank);
 	disk->bank = NULL;
 
-	if(disk->path!=NULL){ 
-		//Sync image
+	if(disk->store==IMAGE_STORE){
+		//Unmapped with the whole image by kemuSys_free
+	}else{ 
+		//Sync what the flusher has not written back yet
 		if (disk->data && disk->data != MAP_FAILED) {
-			msync(disk->data, disk->head.totalSize, MS_SYNC);
-			munmap(disk->data, disk->head.totalSize);
+			kemuDev_flush(disk);
+			munmap(disk->data, kemuDev_residentWords(disk) * sizeof(uint16_t));
 		}
 		if (disk->fd >= 0) {
 			close(disk->fd);
 		}
 		disk->fd = -1;
-	}else{
-		free(disk->data);
+		if(disk->store==OVERLAY_STORE){
+			close(disk->ioFd);
+			free(disk->deltaMap);
+			disk->deltaMap = NULL;
+		}
+		if(disk->store==STREAM_STORE){
+			close(disk->ioFd);
+			free(disk->cache.slot);
+			disk->cache.slot = NULL;
+		}
 	}
 	disk->data = NULL;
+}
+
+/**
+ * @brief Hand chunks marked FLUSH_DIRTY of FILE_STORE, OVERLAY_STORE and STREAM_STORE devices to their file, without waiting for the disk
+ * syncFd is a duplicate of the file to pass to kemuDev_sync, -1 if nothing was handed over and barrier is 0
+ * A barrier always syncs, the file may hold writes handed over by an earlier call still syncing. Call with devices locked
+*/
+uint8_t kemuDev_writeBack( KemuDev *disk, const uint8_t barrier, int *syncFd ) {
+	*syncFd = -1;
+	uint8_t err = KEMU_SUCCESS;
+	uint8_t written = barrier;
+	int fd = -1;
+	if(disk->store == OVERLAY_STORE && disk->data != NULL){
+		err = kemuDev_writeOverlay(disk, &written);
+		fd = disk->ioFd;
+
+	}else if(disk->store == STREAM_STORE && disk->data != NULL){
+		for(uint32_t i=0; i<disk->cache.slotCount; i++){
+			err |= kemuDev_writeSlot(disk, i, &written);
+		}
+		fd = disk->ioFd;
+
+	}else if(disk->store == FILE_STORE && disk->data != NULL && disk->data != MAP_FAILED){
+		//Shared mapping, stores are already in the page cache and only need their dirty bits cleared
+		const size_t chunkCount = disk->dirty ? disk->head.bankSize * disk->head.bankCount >> KEMU_PAGE_SHIFT : 0;
+		written |= disk->dirty == NULL;
+		for(size_t i=0; i<chunkCount; i++){
+			//Emulation thread only sets dirty bytes, clearing the bit first keeps later writes dirty
+			if(__atomic_load_n(&disk->dirty[i], __ATOMIC_RELAXED) & FLUSH_DIRTY){
+				__atomic_fetch_and(&disk->dirty[i], (uint8_t)~FLUSH_DIRTY, __ATOMIC_ACQ_REL);
+				written = 1;
+			}
+		}
+		fd = disk->fd;
+	}
+	if(written && fd >= 0){
+		*syncFd = dup(fd);
+		if(*syncFd < 0){
+			err = KEMU_FAIL;
+		}
+	}
+	return err ? KEMU_FAIL : KEMU_SUCCESS;
+}
+
+/**
+ * @brief Wait until the file behind syncFd is on disk and close it. Needs no lock, the device may be freed meanwhile
+*/
+uint8_t kemuDev_sync( const int syncFd ) {
+	if(syncFd < 0){
+		return KEMU_SUCCESS;
+	}
+	uint8_t err = fdatasync(syncFd) == 0 ? KEMU_SUCCESS : KEMU_FAIL;
+	close(syncFd);
+	return err;
+}
+
+/**
+ * @brief Write back and sync every FLUSH_DIRTY chunk of the device, returns once they are on disk
+*/
+uint8_t kemuDev_flush( KemuDev *disk ) {
+	int syncFd;
+	uint8_t err = kemuDev_writeBack(disk, 1, &syncFd);
+	if(kemuDev_sync(syncFd) == KEMU_FAIL){
+		err = KEMU_FAIL;
+	}
+	return err;
+}
+
+/**
+ * @brief Zero banks. Whole host pages of ANON_STORE and MEMFD_STORE devices are released to the host
+ * Chunks are marked dirty, decoded instructions are dropped by kemuSys_resetBanks
+*/
+uint8_t kemuDev_resetBanks( KemuDev *disk, const size_t firstBank, const size_t count ) {
+	if(NULL_CHECK(disk) || NULL_CHECK(disk->data) || disk->head.isROM){
+		return KEMU_FAIL;
+	}
+	if(firstBank > disk->head.bankCount || count > disk->head.bankCount - firstBank){
+		return KEMU_FAIL;
+	}
+	const size_t hostPage = sysconf(_SC_PAGESIZE);
+	const size_t bankBytes = disk->head.bankSize * sizeof(uint16_t);
+	if(disk->store == STREAM_STORE){
+		//Resident banks are written back later, the rest are punched out of the image
+		for(size_t i=firstBank; i<firstBank + count; i++){
+			if(disk->bank[i]){
+				memset(disk->bank[i], 0, bankBytes);
+				size_t firstChunk = (disk->bank[i] - disk->data) >> KEMU_PAGE_SHIFT;
+				for(size_t c=0; disk->dirty && c < disk->head.bankSize >> KEMU_PAGE_SHIFT; c++){
+					__atomic_store_n(&disk->dirty[firstChunk + c], KEMU_DIRTY_ALL, __ATOMIC_RELEASE);
+				}
+			}else if(fallocate(disk->ioFd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, i * bankBytes, bankBytes) != 0){
+				return KEMU_FAIL;
+			}
+		}
+		return KEMU_SUCCESS;
+	}
+	uint8_t *start = (uint8_t *)disk->data + firstBank * bankBytes;
+	uint8_t *end = start + count * bankBytes;
+	uint8_t *pageStart = (uint8_t *)(((uintptr_t)start + hostPage - 1) / hostPage * hostPage);
+	uint8_t *pageEnd = (uint8_t *)((uintptr_t)end / hostPage * hostPage);
+
+	//Partial host pages at both ends are cleared in place
+	if(pageStart >= pageEnd){
+		pageStart = pageEnd = end;
+	}
+	memset(start, 0, pageStart - start);
+	memset(pageEnd, 0, end - pageEnd);
+
+	size_t releaseBytes = pageEnd - pageStart;
+	int err = -1;
+	if(releaseBytes){
+		switch(disk->store){
+			case ANON_STORE: //Private anonymous pages read back as zero
+				err = madvise(pageStart, releaseBytes, MADV_DONTNEED);
+				break;
+
+			case MEMFD_STORE:
+				err = fallocate(disk->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, pageStart - (uint8_t *)disk->data, releaseBytes);
+				break;
+
+			default: //Dropping file backed pages would expose the file, not zero
+				break;
+		}
+		if(err != 0){
+			memset(pageStart, 0, releaseBytes);
+		}
+	}
+
+	if(disk->dirty){
+		size_t firstChunk = firstBank * disk->head.bankSize >> KEMU_PAGE_SHIFT;
+		size_t lastChunk = (firstBank + count) * disk->head.bankSize >> KEMU_PAGE_SHIFT;
+		for(size_t c=firstChunk; c<lastChunk; c++){
+			__atomic_store_n(&disk->dirty[c], KEMU_DIRTY_ALL, __ATOMIC_RELEASE);
+		}
+	}
+	return KEMU_SUCCESS;
+}
+
+/**
+ * @brief Program words at offset of an isROM device held in host memory, nothing is written if they already match
+ * ROM images on the host are never written. Dirty planes are not marked, ROM contents are firmware rather than machine state
+ * Caller drops decoded instructions of the range
+*/
+uint8_t kemuDev_flash( KemuDev *disk, const size_t offset, const uint16_t *src, const size_t words ) {
+	if(NULL_CHECK(disk) || NULL_CHECK(disk->data) || NULL_CHECK(src)){
+		return KEMU_FAIL;
+	}
+	if(!disk->head.isROM || (disk->store != ANON_STORE && disk->store != MEMFD_STORE)){
+		return KEMU_FAIL;
+	}
+	if(offset > disk->head.bankSize * disk->head.bankCount || words > disk->head.bankSize * disk->head.bankCount - offset){
+		return KEMU_FAIL;
+	}
+	if(memcmp(&disk->data[offset], src, words * sizeof(uint16_t)) == 0){
+		return KEMU_SUCCESS;
+	}
+	memcpy(&disk->data[offset], src, words * sizeof(uint16_t));
+	return KEMU_SUCCESS;
 }
\ No newline at end of file
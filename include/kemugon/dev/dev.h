@@ -23,8 +23,34 @@ typedef enum{
 	RAM_DEV,	
 	AUDIO_DEV,
 	DATA_DEV,
+	BLOCK_DEV,	//Block controller, see KemuDev_block
+	DMA_DEV,	//Memory copy and fill engine, see KemuDev_dma
+	DEV_TYPE_COUNT,
 } KemuDev_type;
 
+/**
+ * @brief Host storage backing KemuDev.data
+*/
+typedef enum{
+	ANON_STORE,		//Anonymous MAP_NORESERVE mapping, host RAM only. Untouched pages cost no memory
+	FILE_STORE,		//Shared mapping of dev->path image, PROT_READ if head.isROM
+	MEMFD_STORE,	//Shared mapping of anonymous memfd, host RAM only
+	IMAGE_STORE,	//data set by caller, points into a private warm-boot or program image mapping owned by KemuSys
+	OVERLAY_STORE,	//Private mapping of read-only basePath, written banks are copied up to the path delta file
+	STREAM_STORE,	//cache.slotCount banks of path resident at a time, loaded on map and written back on eviction
+} KemuDev_store;
+
+/**
+ * @brief Bit planes of KemuDev.dirty, each consumer clears only its own bit
+*/
+typedef enum{
+	SNAP_DIRTY		= 0b00000001, //Changed since last kemuSys_snapshot or kemuSys_restore
+	REWIND_DIRTY	= 0b00000010, //Changed since last kemuSys_capture
+	FLUSH_DIRTY		= 0b00000100, //Chunk not yet written back to its file, cleared atomically by kemuDev_writeBack
+}KemuDev_dirty;
+
+#define KEMU_DIRTY_ALL 0xFFU
+
 /**
  * @brief Device header is only visible to MBC, optimize size once the structure is decided
 */
@@ -36,24 +62,133 @@ typedef struct{
 	uint8_t type;
 }KemuDev_head;
 
+//Banks past a newly mapped STREAM_STORE row hinted to the host for read-ahead
+#ifndef KEMU_STREAM_READAHEAD
+	#define KEMU_STREAM_READAHEAD 2U
+#endif
+
+#define KEMU_SLOT_EMPTY UINT32_MAX
+
+/**
+ * @brief Resident bank of a STREAM_STORE device
+*/
+typedef struct{
+	uint32_t bank; //Bank held, KEMU_SLOT_EMPTY = free
+	uint64_t lastUse; //KemuDev_cache.clock when last mapped, least recent is evicted first
+}KemuDev_slot;
+
+/**
+ * @brief Bounded bank cache, data holds slotCount banks in slot order
+*/
+typedef struct{
+	uint32_t slotCount; //Resident bank budget of path, 0 = map the whole image
+	uint64_t clock;
+	KemuDev_slot *slot;
+}KemuDev_cache;
+
 typedef struct {
 	uint16_t devID;
 	const char *path;
+	const char *basePath; //Read-only image shared between instances, path is then its sparse per-instance delta
 	int fd;
+	int ioFd; //pread/pwrite target, OVERLAY_STORE delta or STREAM_STORE image
+	uint8_t store; //KemuDev_store
+	uint16_t clockDiv; //Emu-cycles per device tick, 0 = 1
+	uint8_t worker; //Owning KemuWorker id, 0 = main thread
 	KemuDev_head head;
 	uint16_t *data; // Raw memory on host system
 	uint16_t **bank; // Split image to bankSized segments to emulate banks
+	uint8_t *dirty; // KemuDev_dirty flags per page sized chunk of data, NULL = untracked
+	uint8_t *deltaMap; // OVERLAY_STORE banks held by the delta file, stored after its bank data
+	KemuDev_cache cache; // STREAM_STORE resident banks, bank[] is NULL for the rest
 }KemuDev;
 
 //------ Special Devices ------
 
 typedef struct{
-	uint16_t rw[8]; 	//register word
-	uint16_t pc; 		//program counter
-	uint16_t sp; 		//stack pointer
-	uint16_t flags;
+	union{
+		struct{
+			uint16_t rw[8]; 	//register word
+			uint16_t pc; 		//program counter
+			uint16_t sp; 		//stack pointer
+		};
+		uint16_t reg[10]; //Registers indexed by instruction operand R0..SP
+	};
+	uint16_t flags; //KemuDev_flagCPU, stale while flagOp is pending, see kemuDev_flagsCPU
+	uint16_t flagOp; //Last ALU instruction whose flags are not computed yet, NOP = flags are current
+	uint16_t flagDst; //Its destination register before the operation
+	uint16_t flagSrc; //Its operand
 }KemuDev_CPU;
 
+/**
+ * @brief Status register values of command devices
+*/
+typedef enum{
+	IDLE_STATUS,
+	BUSY_STATUS,
+	DONE_STATUS,
+	ERROR_STATUS,
+}KemuDev_status;
+
+/**
+ * @brief Registers shared by command devices, at the start of their first page
+ * The guest maps the device through the MBC, fills the registers and writes command last
+*/
+typedef struct{
+	uint16_t command; //Device specific, cleared once accepted
+	uint16_t status; //KemuDev_status
+	uint16_t irqDev; //Device whose irqAddr word receives the final status, 0 = none
+	uint16_t irqAddr;
+}KemuDev_ioRegs;
+
+typedef enum{
+	NONE_BLOCK,
+	READ_BLOCK,		//Device blocks to VAS
+	WRITE_BLOCK,	//VAS to device blocks
+}KemuDev_blockCommand;
+
+/**
+ * @brief BLOCK_DEV registers, a block is KEMU_PAGE_SIZE words
+*/
+typedef struct{
+	KemuDev_ioRegs io; //command is KemuDev_blockCommand
+	uint16_t devID; //Device transferred to or from
+	uint16_t lbaLo; //First block
+	uint16_t lbaHi;
+	uint16_t count; //Blocks
+	uint16_t vasAddr; //First word of the VAS buffer
+}KemuDev_block;
+
+typedef enum{
+	NONE_DMA,
+	COPY_DMA,	//length words from src to dst, overlapping ranges copy like memmove
+	FILL_DMA,	//length words at dst set to fill
+}KemuDev_dmaCommand;
+
+/**
+ * @brief DMA_DEV registers, addresses are VAS and wrap at the end of it
+*/
+typedef struct{
+	KemuDev_ioRegs io; //command is KemuDev_dmaCommand
+	uint16_t src;
+	uint16_t dst;
+	uint16_t length; //Words, 0 = none
+	uint16_t fill;
+}KemuDev_dma;
+
 // Virtual device mapped to host system NVM or RAM
 uint8_t kemuDev_alloc( KemuDev *dev );
-void kemuDev_free( KemuDev *dev );
\ No newline at end of file
+void kemuDev_free( KemuDev *dev );
+uint8_t kemuDev_writeBack( KemuDev *dev, const uint8_t barrier, int *syncFd );
+uint8_t kemuDev_sync( const int syncFd );
+uint8_t kemuDev_flush( KemuDev *dev );
+size_t kemuDev_residentWords( const KemuDev *dev );
+size_t kemuDev_stateWords( const KemuDev *dev );
+uint16_t *kemuDev_fillSlot( KemuDev *dev, const uint32_t slot, const uint32_t bank );
+void kemuDev_readAhead( KemuDev *dev, const size_t firstBank, const size_t count );
+uint8_t kemuDev_resetBanks( KemuDev *dev, const size_t firstBank, const size_t count );
+uint8_t kemuDev_flash( KemuDev *dev, const size_t offset, const uint16_t *src, const size_t words );
+
+// Host files
+uint64_t kemuDev_align( const uint64_t offset, const uint64_t align );
+uint8_t kemuDev_write( const int fd, const void *buf, size_t size, off_t offset );
\ No newline at end of file
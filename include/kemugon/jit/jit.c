@@ -0,0 +1,417 @@
+/**
+ * @file jit.c
+ * 
+ * @brief Implementation, basic block translation from Kemu ISA to x86-64
+ * 
+ * Blocks run with rbx = KemuDev_CPU*, r12 = remaining cycle budget, r13 = KemuSys*
+ * Guest registers stay in KemuDev_CPU, so exiting to the interpreter at any block boundary is free
+ */
+
+#include "kemugon/jit/jit.h"
+#include "kemugon/sys/sys.h"
+#include "kemugon/sys/sysDev.h"
+
+#include <stddef.h>
+
+typedef int64_t (*KemuJit_enter)(KemuDev_CPU *cpu, int64_t budget, KemuSys *sys, void *block);
+
+//------ Emitter ------
+
+typedef struct{
+	uint8_t *code;
+	size_t pos;
+	size_t size;
+	uint8_t full;
+}KemuJit_emit;
+
+static void kemuJit_put(KemuJit_emit *e, const void *src, size_t n){
+	if(e->pos + n > e->size){
+		e->full = 1;
+		return;
+	}
+	memcpy(e->code + e->pos, src, n);
+	e->pos += n;
+}
+
+#define JIT_BYTES(e, ...) kemuJit_put((e), (const uint8_t[]){__VA_ARGS__}, sizeof((const uint8_t[]){__VA_ARGS__}))
+
+static void kemuJit_put16(KemuJit_emit *e, uint16_t v){ kemuJit_put(e, &v, sizeof(v)); }
+static void kemuJit_put32(KemuJit_emit *e, uint32_t v){ kemuJit_put(e, &v, sizeof(v)); }
+static void kemuJit_put64(KemuJit_emit *e, uint64_t v){ kemuJit_put(e, &v, sizeof(v)); }
+
+//rel32 operand at site jumping to target
+static void kemuJit_patch(uint8_t *site, const uint8_t *target){
+	int32_t rel = (int32_t)(target - (site + 4));
+	memcpy(site, &rel, sizeof(rel));
+}
+
+//rel32 operand towards target, returns its arena offset
+static size_t kemuJit_rel32(KemuJit_emit *e, const uint8_t *target){
+	size_t site = e->pos;
+	kemuJit_put32(e, 0);
+	if(!e->full){
+		kemuJit_patch(e->code + site, target);
+	}
+	return site;
+}
+
+//[rbx+disp8] of guest register
+static uint8_t kemuJit_reg(uint16_t r){
+	return offsetof(KemuDev_CPU, reg) + r * sizeof(uint16_t);
+}
+
+//movzx eax, word [rbx+reg]
+static void kemuJit_loadEAX(KemuJit_emit *e, uint16_t r){ JIT_BYTES(e, 0x0F, 0xB7, 0x43, kemuJit_reg(r)); }
+//mov word [rbx+reg], ax
+static void kemuJit_storeAX(KemuJit_emit *e, uint16_t r){ JIT_BYTES(e, 0x66, 0x89, 0x43, kemuJit_reg(r)); }
+//mov word [rbx+disp], imm16
+static void kemuJit_storeField(KemuJit_emit *e, uint8_t disp, uint16_t imm){
+	JIT_BYTES(e, 0x66, 0xC7, 0x43, disp);
+	kemuJit_put16(e, imm);
+}
+//mov word [rbx+reg], imm16
+static void kemuJit_storeImm(KemuJit_emit *e, uint16_t r, uint16_t imm){
+	kemuJit_storeField(e, kemuJit_reg(r), imm);
+}
+//Record ALU op on eax and imm for lazy flags, see kemuDev_flagsCPU
+static void kemuJit_recordFlags(KemuJit_emit *e, uint16_t op, uint16_t imm){
+	JIT_BYTES(e, 0x66, 0x89, 0x43, offsetof(KemuDev_CPU, flagDst));	//mov word [rbx+flagDst], ax
+	kemuJit_storeField(e, offsetof(KemuDev_CPU, flagSrc), imm);
+	kemuJit_storeField(e, offsetof(KemuDev_CPU, flagOp), op);
+}
+//mov rax, fn; call rax
+static void kemuJit_call(KemuJit_emit *e, uintptr_t fn){
+	JIT_BYTES(e, 0x48, 0xB8);
+	kemuJit_put64(e, fn);
+	JIT_BYTES(e, 0xFF, 0xD0);
+}
+//add qword [r13+insRetired], count; sub r12, cycles
+//sub comes last, the chain jle of kemuJit_emitLink tests its flags
+static void kemuJit_retire(KemuJit_emit *e, uint32_t cycles, uint32_t count){
+	JIT_BYTES(e, 0x49, 0x81, 0x85);
+	kemuJit_put32(e, offsetof(KemuSys, insRetired));
+	kemuJit_put32(e, count);
+	JIT_BYTES(e, 0x49, 0x81, 0xEC);
+	kemuJit_put32(e, cycles);
+}
+//jmp exit stub
+static void kemuJit_exit(KemuJit_emit *e, const KemuJit *jit){
+	JIT_BYTES(e, 0xE9);
+	kemuJit_rel32(e, jit->arena + jit->exitOffset);
+}
+
+//------ Guest helpers called from blocks ------
+
+//cycles of the block up to the store are not subtracted from budget yet
+static uint8_t kemuJit_store(KemuSys *sys, uint16_t addr, uint16_t value, int64_t budget, uint32_t cycles){
+	KemuJit *jit = &sys->jit;
+	sys->cpuCycle = jit->budgetEnd - budget + cycles;
+	kemuSys_storeVAS(sys, addr, value);
+	return jit->flushPending || (sys->cpuEnd && sys->cpuEnd < jit->budgetEnd);
+}
+
+static void kemuJit_branch(KemuDev_CPU *cpu, uint16_t mask, uint16_t target, uint16_t next){
+	cpu->pc = (kemuDev_flagsCPU(cpu) & mask) ? target : next;
+}
+
+static void kemuJit_terminate(KemuSys *sys){
+	printf("Terminate instruction\n");
+	sys->quitFlag=1;
+}
+
+//------ Arena ------
+
+/**
+ * @brief Map executable arena and emit enter/exit trampolines
+ * Called by the first kemuJit_run, on failure arena stays NULL and the interpreter is used
+*/
+uint8_t kemuJit_alloc(KemuJit *jit){
+	memset(jit, 0, sizeof(KemuJit));
+	void *arena = mmap(NULL, KEMU_JIT_ARENA_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(arena == MAP_FAILED){
+		perror("Failed to mmap JIT arena");
+		return KEMU_FAIL;
+	}
+	jit->block = calloc(UINT16_MAX+1, sizeof(void*));
+	jit->blockPC = calloc(UINT16_MAX+1, sizeof(uint16_t));
+	jit->link = calloc(KEMU_JIT_CHAIN_MAX, sizeof(KemuJit_link));
+	if(NULL_CHECK(jit->block) || NULL_CHECK(jit->blockPC) || NULL_CHECK(jit->link)){
+		munmap(arena, KEMU_JIT_ARENA_SIZE);
+		kemuJit_free(jit);
+		return KEMU_FAIL;
+	}
+	jit->arena = arena;
+
+	KemuJit_emit e = { .code = jit->arena, .pos = 0, .size = KEMU_JIT_ARENA_SIZE };
+	//enter(cpu, budget, sys, block): save callee-saved registers and jump to block
+	JIT_BYTES(&e,
+		0x53,					//push rbx
+		0x41, 0x54,			//push r12
+		0x41, 0x55,			//push r13
+		0x48, 0x89, 0xFB,	//mov rbx, rdi
+		0x49, 0x89, 0xF4,	//mov r12, rsi
+		0x49, 0x89, 0xD5,	//mov r13, rdx
+		0xFF, 0xE1,			//jmp rcx
+	);
+	//exit: return remaining budget
+	jit->exitOffset = e.pos;
+	JIT_BYTES(&e,
+		0x4C, 0x89, 0xE0,	//mov rax, r12
+		0x41, 0x5D,			//pop r13
+		0x41, 0x5C,			//pop r12
+		0x5B,					//pop rbx
+		0xC3,					//ret
+	);
+	jit->enterSize = e.pos;
+	jit->used = e.pos;
+	return KEMU_SUCCESS;
+}
+
+void kemuJit_free(KemuJit *jit){
+	if(jit->arena){
+		munmap(jit->arena, KEMU_JIT_ARENA_SIZE);
+	}
+	free(jit->block);
+	free(jit->blockPC);
+	free(jit->link);
+	memset(jit, 0, sizeof(KemuJit));
+}
+
+/**
+ * @brief Drop every block. Blocks are chained so they can't be dropped individually
+*/
+void kemuJit_flush(KemuJit *jit){
+	for(size_t i=0; i<jit->blockCount; i++){
+		jit->block[jit->blockPC[i]] = NULL;
+	}
+	jit->blockCount = 0;
+	jit->linkCount = 0;
+	jit->used = jit->enterSize;
+	jit->flushPending = 0;
+}
+
+//------ Translation ------
+
+/**
+ * @brief Leave block towards a known guest pc, chained to its block if compiled
+ * Returns arena offset of the chain rel32
+*/
+static size_t kemuJit_emitLink(KemuJit_emit *e, const KemuJit *jit, uint16_t target, uint32_t cycles, uint32_t count){
+	#include "kemugon/sys/instr.h"
+	kemuJit_storeImm(e, PC, target);
+	kemuJit_retire(e, cycles, count);
+	JIT_BYTES(e, 0x0F, 0x8E);	//jle exit
+	kemuJit_rel32(e, jit->arena + jit->exitOffset);
+	JIT_BYTES(e, 0xE9);			//jmp target block
+	uint8_t *targetCode = jit->block[target] ? jit->block[target] : jit->arena + jit->exitOffset;
+	return kemuJit_rel32(e, targetCode);
+}
+
+/**
+ * @brief Translate basic block at pc. Returns NULL if the arena is full
+*/
+static void *kemuJit_compile(KemuSys *sys, const uint16_t pc){
+	#include "kemugon/sys/instr.h"
+	KemuJit *jit = &sys->jit;
+	KemuJit_emit e = { .code = jit->arena, .pos = jit->used, .size = KEMU_JIT_ARENA_SIZE };
+	size_t start = e.pos;
+	size_t linkSite = 0;
+	uint16_t linkTarget = 0;
+
+	uint16_t insPC = pc;
+	uint32_t count = 0;
+	uint32_t cycles = 0;
+	uint8_t blockEnd = 0;
+	while(!blockEnd){
+		KemuCache_entry ins;
+		kemuDev_decodeCPU(sys, insPC, &ins);
+		count++;
+		cycles += ins.cycles;
+
+		uint16_t d = ins.arg[0];
+		uint16_t s = ins.arg[1];
+		uint8_t regOp = (ins.op!=JMP && ins.op!=TRM && ins.op!=NOP && ins.op!=JC && ins.op!=JV);
+		uint8_t srcReg = (ins.op==ST || ins.op==AND || ins.op==OR);
+		uint8_t writesPC = regOp && ins.op!=ST && d==PC;
+
+		//Instructions see pc already advanced
+		if(regOp && (d==PC || (srcReg && s==PC))){
+			kemuJit_storeImm(&e, PC, ins.nextPC);
+		}
+
+		switch(ins.op){
+			case LD:
+				kemuJit_storeImm(&e, d, s);
+				break;
+
+			case ADD: case SUB: case MUL: case SHL: case SHR:
+				kemuJit_loadEAX(&e, d);
+				if(ins.op != SHR){
+					kemuJit_recordFlags(&e, ins.op, s);
+				}
+				switch(ins.op){
+					case ADD: JIT_BYTES(&e, 0x05); kemuJit_put32(&e, s); break;			//add eax, imm32
+					case SUB: JIT_BYTES(&e, 0x2D); kemuJit_put32(&e, s); break;			//sub eax, imm32
+					case MUL: JIT_BYTES(&e, 0x69, 0xC0); kemuJit_put32(&e, s); break;	//imul eax, eax, imm32
+					case SHL: JIT_BYTES(&e, 0xC1, 0xE0, s & 0xF); break;						//shl eax, imm8
+					default:  JIT_BYTES(&e, 0xC1, 0xE8, s & 0xF); break;						//shr eax, imm8
+				}
+				kemuJit_storeAX(&e, d);
+				break;
+
+			case DIV: //Division by zero saturates
+				if(s==0){
+					kemuJit_storeImm(&e, d, UINT16_MAX);
+					break;
+				}
+				kemuJit_loadEAX(&e, d);
+				JIT_BYTES(&e, 0x31, 0xD2, 0xB9);	//xor edx, edx; mov ecx, imm32
+				kemuJit_put32(&e, s);
+				JIT_BYTES(&e, 0xF7, 0xF1);			//div ecx
+				kemuJit_storeAX(&e, d);
+				break;
+
+			case AND: case OR:
+				kemuJit_loadEAX(&e, d);
+				JIT_BYTES(&e, 0x0F, 0xB7, 0x4B, kemuJit_reg(s));		//movzx ecx, word [rbx+s]
+				JIT_BYTES(&e, (ins.op==AND ? 0x21 : 0x09), 0xC8);		//and/or eax, ecx
+				kemuJit_storeAX(&e, d);
+				break;
+
+			case ST: //Exit early if the store invalidated translated code or scheduled an event before the budget end
+				JIT_BYTES(&e, 0x4C, 0x89, 0xEF);							//mov rdi, r13
+				JIT_BYTES(&e, 0x0F, 0xB7, 0x73, kemuJit_reg(d));		//movzx esi, word [rbx+d]
+				JIT_BYTES(&e, 0x0F, 0xB7, 0x53, kemuJit_reg(s));		//movzx edx, word [rbx+s]
+				JIT_BYTES(&e, 0x4C, 0x89, 0xE1);							//mov rcx, r12
+				JIT_BYTES(&e, 0x41, 0xB8);									//mov r8d, imm32
+				kemuJit_put32(&e, cycles);
+				kemuJit_call(&e, (uintptr_t)kemuJit_store);
+				JIT_BYTES(&e, 0x84, 0xC0, 0x74, 0);							//test al, al; jz continue
+				size_t skipSite = e.pos;
+				kemuJit_storeImm(&e, PC, ins.nextPC);
+				kemuJit_retire(&e, cycles, count);
+				kemuJit_exit(&e, jit);
+				if(!e.full){
+					e.code[skipSite-1] = e.pos - skipSite;
+				}
+				break;
+
+			case JMP:
+				linkTarget = ins.arg[0];
+				linkSite = kemuJit_emitLink(&e, jit, linkTarget, cycles, count);
+				blockEnd = 1;
+				break;
+
+			case JC: case JV: //Reads flags, target is only known at runtime
+				JIT_BYTES(&e, 0x48, 0x89, 0xDF);		//mov rdi, rbx
+				JIT_BYTES(&e, 0xBE);						//mov esi, imm32
+				kemuJit_put32(&e, ins.op==JC ? CARRY_CPU : OVERFLOW_CPU);
+				JIT_BYTES(&e, 0xBA);						//mov edx, imm32
+				kemuJit_put32(&e, ins.arg[0]);
+				JIT_BYTES(&e, 0xB9);						//mov ecx, imm32
+				kemuJit_put32(&e, ins.nextPC);
+				kemuJit_call(&e, (uintptr_t)kemuJit_branch);
+				kemuJit_retire(&e, cycles, count);
+				kemuJit_exit(&e, jit);
+				blockEnd = 1;
+				break;
+
+			case TRM:
+				kemuJit_storeImm(&e, PC, ins.nextPC);
+				JIT_BYTES(&e, 0x4C, 0x89, 0xEF);	//mov rdi, r13
+				kemuJit_call(&e, (uintptr_t)kemuJit_terminate);
+				kemuJit_retire(&e, cycles, count);
+				kemuJit_exit(&e, jit);
+				blockEnd = 1;
+				break;
+
+			default: //NOP
+		}
+
+		if(writesPC){ //Target is only known at runtime
+			kemuJit_retire(&e, cycles, count);
+			kemuJit_exit(&e, jit);
+			blockEnd = 1;
+		}
+
+		insPC = ins.nextPC;
+		if(!blockEnd && count >= KEMU_JIT_BLOCK_MAX){
+			linkTarget = insPC;
+			linkSite = kemuJit_emitLink(&e, jit, linkTarget, cycles, count);
+			blockEnd = 1;
+		}
+	}
+
+	if(e.full){
+		return NULL;
+	}
+
+	//Queue the link before publishing the block, so a block jumping to itself is patched below
+	if(linkSite && jit->block[linkTarget]==NULL && jit->linkCount < KEMU_JIT_CHAIN_MAX){
+		jit->link[jit->linkCount++] = (KemuJit_link){ .site = linkSite, .target = linkTarget };
+	}
+
+	//Register block and link it
+	jit->used = e.pos;
+	void *code = jit->arena + start;
+	jit->block[pc] = code;
+	jit->blockPC[jit->blockCount++] = pc;
+	for(size_t i=0; i<jit->linkCount; ){
+		if(jit->link[i].target == pc){
+			kemuJit_patch(jit->arena + jit->link[i].site, code);
+			jit->link[i] = jit->link[--jit->linkCount];
+		}else{
+			i++;
+		}
+	}
+
+	return code;
+}
+
+/**
+ * @brief Run translated blocks until cycleBudget is spent or a store schedules an earlier event, last block may overshoot
+ * The arena is allocated on first use, so the engine can be switched at runtime
+ * Falls back to the interpreter if the arena is unavailable or a block can't be translated
+ * Returns the number of spent cycles
+*/
+uint64_t kemuJit_run(KemuSys *sys, KemuDev *dev, const uint64_t cycleBudget){
+	KemuDev_CPU *cpu = (void *)dev->bank[0];
+	KemuJit *jit = &sys->jit;
+	if(jit->arena == NULL && !jit->allocFailed && kemuJit_alloc(jit) == KEMU_FAIL){
+		jit->allocFailed = 1;
+	}
+	if(jit->arena == NULL){
+		return kemuDev_runCPU(sys, dev, cycleBudget);
+	}
+	KemuJit_enter enter = (KemuJit_enter)(uintptr_t)jit->arena;
+	const uint64_t startCycle = sys->cpuCycle;
+	int64_t budget = cycleBudget;
+	jit->budgetEnd = startCycle + cycleBudget;
+
+	while(budget > 0 && !sys->quitFlag){
+		if(jit->flushPending){
+			kemuJit_flush(jit);
+		}
+		void *code = jit->block[cpu->pc];
+		if(code == NULL){
+			code = kemuJit_compile(sys, cpu->pc);
+		}
+		if(code == NULL){ //Arena full, start over
+			kemuJit_flush(jit);
+			code = kemuJit_compile(sys, cpu->pc);
+		}
+		if(code == NULL){
+			sys->cpuCycle = jit->budgetEnd - budget;
+			budget -= kemuDev_runCPU(sys, dev, 1);
+		}else{
+			budget = enter(cpu, budget, sys, code);
+		}
+		//Stop at the event a store scheduled
+		if(sys->cpuEnd && sys->cpuEnd < jit->budgetEnd){
+			budget -= jit->budgetEnd - sys->cpuEnd;
+			jit->budgetEnd = sys->cpuEnd;
+		}
+	}
+
+	return jit->budgetEnd - budget - startCycle;
+}
@@ -0,0 +1,49 @@
+/**
+ * @file jit.h
+ * 
+ * @brief Header, basic block translation from Kemu ISA to x86-64
+ */
+#pragma once
+
+#include <sys/mman.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libkael/debug/kaelMacros.h"
+
+#define KEMU_JIT_ARENA_SIZE	(4U*1024U*1024U)
+#define KEMU_JIT_BLOCK_MAX		64U	//Instructions per block
+#define KEMU_JIT_CHAIN_MAX		4096U	//Unresolved block links
+
+/**
+ * @brief Jump site waiting for its target block to be compiled
+*/
+typedef struct{
+	uint32_t site; //arena offset of the rel32 operand
+	uint16_t target; //guest pc
+}KemuJit_link;
+
+typedef struct{
+	uint8_t *arena; //Executable memory, NULL if JIT is unavailable
+	size_t used;
+	size_t exitOffset; //Trampolines at the start of arena survive flush
+	size_t enterSize;
+
+	void **block; //Native entry per guest pc, NULL if not compiled
+	uint16_t *blockPC; //Compiled pcs, so flush doesn't clear the whole table
+	size_t blockCount;
+
+	KemuJit_link *link;
+	size_t linkCount;
+
+	uint64_t budgetEnd; //emu-cycle the budget register counts down to
+	uint8_t flushPending; //Guest code was written or remapped
+	uint8_t allocFailed; //Arena is not retried, JIT_ENGINE interprets
+}KemuJit;
+
+uint8_t kemuJit_alloc(KemuJit *jit);
+void kemuJit_free(KemuJit *jit);
+
+void kemuJit_flush(KemuJit *jit);
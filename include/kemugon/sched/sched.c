@@ -0,0 +1,88 @@
+/**
+ * @file sched.c
+ * 
+ * @brief Implementation, device event scheduler ordered by emulated cycle timestamp
+ */
+
+#include "kemugon/sched/sched.h"
+
+void kemuSched_init(KemuSched *sched){
+	sched->count = 0;
+}
+
+static void kemuSched_swap(KemuSched *sched, const size_t a, const size_t b){
+	KemuSched_event tmp = sched->event[a];
+	sched->event[a] = sched->event[b];
+	sched->event[b] = tmp;
+}
+
+static void kemuSched_siftUp(KemuSched *sched, size_t i){
+	while(i > 0){
+		size_t parent = (i - 1) / 2;
+		if(sched->event[parent].time <= sched->event[i].time){
+			break;
+		}
+		kemuSched_swap(sched, parent, i);
+		i = parent;
+	}
+}
+
+static void kemuSched_siftDown(KemuSched *sched, size_t i){
+	for(;;){
+		size_t least = i;
+		size_t left = 2*i + 1;
+		size_t right = left + 1;
+		if(left < sched->count && sched->event[left].time < sched->event[least].time){
+			least = left;
+		}
+		if(right < sched->count && sched->event[right].time < sched->event[least].time){
+			least = right;
+		}
+		if(least == i){
+			break;
+		}
+		kemuSched_swap(sched, least, i);
+		i = least;
+	}
+}
+
+/**
+ * @brief Queue event of devID at time
+*/
+uint8_t kemuSched_push(KemuSched *sched, const uint64_t time, const uint8_t devID){
+	if(sched->count >= KEMU_SCHED_MAX){
+		return KEMU_FAIL;
+	}
+	sched->event[sched->count] = (KemuSched_event){ .time = time, .devID = devID };
+	kemuSched_siftUp(sched, sched->count);
+	sched->count++;
+	return KEMU_SUCCESS;
+}
+
+/**
+ * @brief Remove and return earliest event. Caller checks count
+*/
+KemuSched_event kemuSched_pop(KemuSched *sched){
+	KemuSched_event first = sched->event[0];
+	sched->count--;
+	sched->event[0] = sched->event[sched->count];
+	kemuSched_siftDown(sched, 0);
+	return first;
+}
+
+/**
+ * @brief Drop pending events of devID
+*/
+void kemuSched_remove(KemuSched *sched, const uint8_t devID){
+	size_t i = 0;
+	while(i < sched->count){
+		if(sched->event[i].devID != devID){
+			i++;
+			continue;
+		}
+		sched->count--;
+		sched->event[i] = sched->event[sched->count];
+		kemuSched_siftDown(sched, i);
+		kemuSched_siftUp(sched, i);
+	}
+}
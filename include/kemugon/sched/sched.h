@@ -0,0 +1,41 @@
+/**
+ * @file sched.h
+ * 
+ * @brief Header, device event scheduler ordered by emulated cycle timestamp
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libkael/debug/kaelMacros.h"
+
+//At most one pending event per devID
+#define KEMU_SCHED_MAX 256U
+
+typedef struct{
+	uint64_t time; //Emu-cycle timestamp
+	uint8_t devID;
+}KemuSched_event;
+
+/**
+ * @brief Binary min-heap of events, earliest at event[0]
+*/
+typedef struct{
+	KemuSched_event event[KEMU_SCHED_MAX];
+	size_t count;
+}KemuSched;
+
+void kemuSched_init(KemuSched *sched);
+
+uint8_t kemuSched_push(KemuSched *sched, const uint64_t time, const uint8_t devID);
+KemuSched_event kemuSched_pop(KemuSched *sched);
+void kemuSched_remove(KemuSched *sched, const uint8_t devID);
+
+/**
+ * @brief Timestamp of earliest event, UINT64_MAX if none
+*/
+static inline uint64_t kemuSched_nextTime(const KemuSched *sched){
+	return sched->count ? sched->event[0].time : UINT64_MAX;
+}
@@ -1,25 +1,97 @@
 /**
  * @file instructions.c
- * 
+ *
  * @brief header, list of CPU instructions. Avoid declaring in global space
+ *
+ * Instruction word: opcode[15:11] Rd[10:7] ext[6] operand[5:0]
+ * With ext set the operand is the following extension word instead of the 6-bit field
+ * 	TRM, NOP				opcode
+ * 	JMP addr				pc = operand
+ * 	LD Rd, imm			Rd = imm
+ * 	ADD..SHR Rd, imm	Rd = Rd op imm
+ * 	AND, OR Rd, Rs		Rd = Rd op Rs
+ * 	ST Ra, Rs			[Ra] = Rs
+ * 	JC, JV addr			pc = operand if carry or overflow is set
+ * ADD, SUB, MUL and SHL set carry and overflow, other instructions leave them
+ * Unknown opcodes, registers past SP and extension words of register operands execute as a single word NOP
  */
 
-#pragma GCC diagnostic push 
+#ifndef KEMU_INS_TABLE
+	//X(opcode, KemuSys_insForm, cycles spent past fetching the instruction words)
+	//Interpreter, JIT, assembler and disassembler are all driven by this table
+	#define KEMU_INS_TABLE(X) \
+		X(NOP,	NONE_FORM,		0) \
+		X(LD,		REG_IMM_FORM,	0) \
+		X(ST,		REG_REG_FORM,	1) \
+		X(JMP,	IMM_FORM,		1) \
+		X(TRM,	NONE_FORM,		0) \
+		X(ADD,	REG_IMM_FORM,	0) \
+		X(SUB,	REG_IMM_FORM,	0) \
+		X(MUL,	REG_IMM_FORM,	3) \
+		X(DIV,	REG_IMM_FORM,	9) \
+		X(SHL,	REG_IMM_FORM,	0) \
+		X(SHR,	REG_IMM_FORM,	0) \
+		X(AND,	REG_REG_FORM,	0) \
+		X(OR,		REG_REG_FORM,	0) \
+		X(JC,		IMM_FORM,		1) \
+		X(JV,		IMM_FORM,		1)
+
+	//X(superinstruction, first, second, third or NOP for pairs), register constraints are checked by kemuDev_fuseCPU
+	//Longer sequences come first so they win over their own prefix
+	#define KEMU_FUSE_TABLE(X) \
+		X(PACK_ST,	SHL,	OR,	ST) \
+		X(LD_LD_ST,	LD,	LD,	ST) \
+		X(PACK,		SHL,	OR,	NOP) \
+		X(LD_LD,		LD,	LD,	NOP) \
+		X(ADD_ST,	ADD,	ST,	NOP)
+
+	#define KEMU_INS_OP_SHIFT		11
+	#define KEMU_INS_RD_SHIFT		7
+	#define KEMU_INS_RD_MASK		0x000F
+	#define KEMU_INS_EXT				0x0040 //Operand is the extension word
+	#define KEMU_INS_SHORT_MASK	0x003F
+	#define KEMU_INS_WORDS_MAX		2
+
+	//Assemble one instruction word, operand must fit KEMU_INS_SHORT_MASK
+	#define KEMU_ASM(op, rd, operand) \
+		((uint16_t)((op) << KEMU_INS_OP_SHIFT | (rd) << KEMU_INS_RD_SHIFT | ((operand) & KEMU_INS_SHORT_MASK)))
+	//Assemble instruction word and its extension word
+	#define KEMU_ASM_EXT(op, rd, imm) \
+		(uint16_t)(KEMU_ASM(op, rd, 0) | KEMU_INS_EXT), (uint16_t)(imm)
+#endif
+
+#pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wunused-local-typedefs"
 
 typedef enum {
-	R0, R1, R2, R3, R4, R5, R6, R7, //registers 
-	PC, SP, //program counter, stack pointer 
-	LD,ST, //Load, store
-
-	JMP, //jump 
-	TRM, //terminate
+	R0, R1, R2, R3, R4, R5, R6, R7, //registers
+	PC, SP, //program counter, stack pointer
+	REG_COUNT,
+}KemuSys_reg;
 
-	ADD, SUB, MUL, DIV,
+/**
+ * @brief Operands following the opcode
+*/
+typedef enum {
+	NONE_FORM,		//No operands
+	IMM_FORM,		//Immediate
+	REG_IMM_FORM,	//Rd, immediate
+	REG_REG_FORM,	//Rd, Rs
+}KemuSys_insForm;
 
-	SHL, SHR, //shift left right
-	AND, OR,
-	NOP, //No operation
+#define KEMU_INS_ENUM(name, form, cycles) name,
+typedef enum {
+	KEMU_INS_TABLE(KEMU_INS_ENUM)
+	INS_COUNT,
 }KemuSys_ins;
+#undef KEMU_INS_ENUM
+
+#define KEMU_FUSE_ENUM(name, op0, op1, op2) name##_FUSED,
+typedef enum {
+	NONE_FUSED,
+	KEMU_FUSE_TABLE(KEMU_FUSE_ENUM)
+	FUSED_COUNT,
+}KemuSys_fused;
+#undef KEMU_FUSE_ENUM
 
-#pragma GCC diagnostic pop
\ No newline at end of file
+#pragma GCC diagnostic pop
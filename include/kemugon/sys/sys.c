@@ -4,48 +4,461 @@
  * @brief Implementation, u16 emulator virtual hardware
  */
 
+#define _GNU_SOURCE //memfd_create
+
 #include "kemugon/sys/sys.h"
 #include "kemugon/sys/sysDev.h"
+#include "kemugon/sys/sysRewind.h"
+#include "kemugon/sys/sysBlock.h"
+#include "kemugon/sys/sysProg.h"
 
 //------ Virtual Address Space Macro ------
-static uint16_t kemuSys_nullBank[256] = {0}; //Logically disconnected bank
+static uint16_t kemuSys_nullBank[KEMU_PAGE_SIZE] = {0}; //Logically disconnected bank
 
 /**
  * @brief Convert pageTable banks addresses into one 16-bit address
- * 
+ * Checked path of kemuSys_vasPtr
 */
 uint16_t* kemuSys_resolveVAS(const KemuSys *sys, const uint16_t addr) {
-	if(NULL_CHECK(sys)){
+	if(NULL_CHECK(sys) || NULL_CHECK(sys->frameTable)){
 		return &kemuSys_nullBank[0];
 	}
-	uint16_t frameIndex = addr / sys->pageSize;
+	KAEL_ASSERT(sys->pageSize == KEMU_PAGE_SIZE, "pageSize differs from KEMU_PAGE_SIZE");
+	#if KEMU_FLAT_VAS
+		if(!NULL_CHECK(sys->vasBase) && sys->sliceMiss == 0){
+			return &sys->vasBase[addr];
+		}
+	#endif
+	uint16_t frameIndex = addr >> KEMU_PAGE_SHIFT;
 	uint16_t *frame = sys->frameTable[frameIndex];
-	uint16_t subAddr = addr - frameIndex * sys->pageSize;
+	KAEL_ASSERT(frame != NULL, "Unmapped frame");
+	uint16_t subAddr = addr & KEMU_PAGE_MASK;
 	uint16_t *element = &frame[subAddr]; //Pointer directly to dev->rawData element
 	return element;
 }
 
-//Called if sys->pageTable is modified
-void kemuSys_mapFrameTable(const KemuSys *sys) {
+//------ Guest write path ------
+
+/**
+ * @brief Drop decoded instructions of a page, including ones straddling into it
+*/
+void kemuSys_dropCode(KemuSys *sys, const uint16_t page){
+	#include "kemugon/sys/instr.h"
+	size_t first = page * KEMU_PAGE_SIZE + sys->icache.entryCount - (KEMU_INS_WORDS_MAX - 1);
+	kemuCache_invalidate(&sys->icache, first, KEMU_PAGE_SIZE + KEMU_INS_WORDS_MAX - 1);
+	sys->frameAttr[page] &= ~CODE_FRAME;
+	sys->jit.flushPending = 1;
+}
+
+/**
+ * @brief Handle a store to a frame with attributes
+ * A frame can be mapped to multiple pages so every alias is handled
+*/
+void kemuSys_writeTrap(KemuSys *sys, const uint16_t addr, const uint16_t value){
+	uint16_t page = addr >> KEMU_PAGE_SHIFT;
+	//ROM may be mapped read-only, drop the store
+	if(sys->frameAttr[page] & ROM_FRAME){
+		return;
+	}
+	kemuSys_vasWrite(sys, addr, value);
+	if((sys->frameAttr[page] & MBC_FRAME) && addr == MBC_FLAG_ADDR){
+		kemuDev_runMBC(sys);
+	}
+	if(sys->frameAttr[page] & IO_FRAME){
+		kemuDev_ioTrap(sys, addr);
+	}
+	if(sys->frameAttr[page] & CODE_FRAME){
+		uint16_t *frame = sys->frameTable[page];
+		for(uint16_t i=0; i<sys->mapPageCount; i++){
+			if(sys->frameTable[i]==frame && (sys->frameAttr[i] & CODE_FRAME)){
+				kemuSys_dropCode(sys, i);
+			}
+		}
+	}
+}
+
+/**
+ * @brief Set attribute to a page and every page aliasing the same frame
+*/
+void kemuSys_markFrame(KemuSys *sys, const uint16_t page, const uint8_t attr){
+	uint16_t *frame = sys->frameTable[page];
 	for(uint16_t i=0; i<sys->mapPageCount; i++){
-		KemuSys_pageEntry entry = sys->pageTable[i];
-		if(entry.devID==0){ //null terminated
-			break;
+		if(sys->frameTable[i]==frame){
+			sys->frameAttr[i] |= attr;
 		}
-		//Get device
-		KemuDev *curDev = kemuDev_devByID(sys, entry.devID);
-		uint16_t bankCount = (entry.lastBank - entry.firstBank + 1);
-		uint16_t devStart	= curDev->head.bankSize * entry.firstBank;
-		uint16_t devEnd 	= curDev->head.bankSize * bankCount + devStart;
+	}
+}
+
+//------ Bulk VAS access ------
+//Ranges wrap at the end of VAS and are split at page boundaries, one memcpy, fill or memcmp per frame
+
+/**
+ * @brief Store length words of src from addr, stores to frames with attributes take kemuSys_storeVAS
+*/
+void kemuSys_writeVAS(KemuSys *sys, const uint16_t addr, const uint16_t *src, const size_t length){
+	uint16_t cur = addr;
+	for(size_t done=0; done<length;){
+		size_t n = kaelMath_min(length - done, kemuSys_pageLeft(cur));
+		uint16_t *run = kemuSys_storeRun(sys, cur);
+		if(run){
+			memcpy(run, &src[done], n * sizeof(uint16_t));
+			kemuSys_markDirty(sys, cur >> KEMU_PAGE_SHIFT);
+		}else{
+			for(size_t i=0; i<n; i++){
+				kemuSys_storeVAS(sys, cur + i, src[done + i]);
+			}
+		}
+		cur += n;
+		done += n;
+	}
+}
+
+/**
+ * @brief Load length words from addr into dst
+*/
+void kemuSys_readVAS(const KemuSys *sys, const uint16_t addr, uint16_t *dst, const size_t length){
+	uint16_t cur = addr;
+	for(size_t done=0; done<length;){
+		size_t n = kaelMath_min(length - done, kemuSys_pageLeft(cur));
+		memcpy(&dst[done], kemuSys_vasPtr(sys, cur), n * sizeof(uint16_t));
+		cur += n;
+		done += n;
+	}
+}
+
+/**
+ * @brief Store value to length words from addr, stores to frames with attributes take kemuSys_storeVAS
+*/
+void kemuSys_fillVAS(KemuSys *sys, const uint16_t addr, const uint16_t value, const size_t length){
+	uint16_t cur = addr;
+	for(size_t done=0; done<length;){
+		size_t n = kaelMath_min(length - done, kemuSys_pageLeft(cur));
+		uint16_t *run = kemuSys_storeRun(sys, cur);
+		for(size_t i=0; i<n; i++){
+			if(run){
+				run[i] = value;
+			}else{
+				kemuSys_storeVAS(sys, cur + i, value);
+			}
+		}
+		if(run){
+			kemuSys_markDirty(sys, cur >> KEMU_PAGE_SHIFT);
+		}
+		cur += n;
+		done += n;
+	}
+}
+
+/**
+ * @brief memcmp of length words from addr against src, 0 if equal
+*/
+int kemuSys_compareVAS(const KemuSys *sys, const uint16_t addr, const uint16_t *src, const size_t length){
+	uint16_t cur = addr;
+	for(size_t done=0; done<length;){
+		size_t n = kaelMath_min(length - done, kemuSys_pageLeft(cur));
+		int cmp = memcmp(kemuSys_vasPtr(sys, cur), &src[done], n * sizeof(uint16_t));
+		if(cmp){
+			return cmp;
+		}
+		cur += n;
+		done += n;
+	}
+	return 0;
+}
 
-		//Create pointers to rawData in sys->pageSize sized chunks
-		uint16_t entryPageCount = (devEnd - devStart)/sys->pageSize;
-		entryPageCount = kaelMath_min(entryPageCount,sys->mapPageCount);
-		for(uint16_t j=0; j<entryPageCount; j++){
-			size_t offset = j * sys->pageSize *  sizeof(uint16_t);
-			sys->frameTable[entry.pageIndex + j] = curDev->data + offset;
+//------ Flat VAS window ------
+#if KEMU_FLAT_VAS
+
+/**
+ * @brief Reserve host window mirroring the whole VAS, backed by null frames
+ * Window is remapped in slices of host page size
+*/
+static uint8_t kemuSys_allocWindow(KemuSys *sys){
+	size_t hostPage = sysconf(_SC_PAGESIZE);
+	size_t pageBytes = KEMU_PAGE_SIZE * sizeof(uint16_t);
+	if(hostPage % pageBytes != 0 && pageBytes % hostPage != 0){
+		printf("KEMU_PAGE_SIZE incompatible with host page size %zu\n", hostPage);
+		return KEMU_FAIL;
+	}
+	sys->slicePages = kaelMath_max(hostPage / pageBytes, 1);
+	size_t sliceBytes = sys->slicePages * pageBytes;
+	size_t windowBytes = (UINT16_MAX+1) * sizeof(uint16_t);
+
+	sys->nullFd = memfd_create("kemuNull", 0);
+	if(sys->nullFd < 0 || ftruncate(sys->nullFd, sliceBytes) < 0){
+		perror("Failed to create null frame");
+		return KEMU_FAIL;
+	}
+	void *window = mmap(NULL, windowBytes, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(window == MAP_FAILED){
+		perror("Failed to reserve VAS window");
+		return KEMU_FAIL;
+	}
+	for(size_t i=0; i<windowBytes; i+=sliceBytes){
+		if(mmap((uint8_t *)window + i, sliceBytes, PROT_READ | PROT_WRITE, MAP_FIXED | MAP_SHARED, sys->nullFd, 0) == MAP_FAILED){
+			perror("Failed to map VAS window");
+			munmap(window, windowBytes);
+			return KEMU_FAIL;
 		}
 	}
+	sys->vasBase = window;
+	return KEMU_SUCCESS;
+}
+
+static void kemuSys_freeWindow(KemuSys *sys){
+	if(sys->vasBase){
+		munmap(sys->vasBase, (UINT16_MAX+1) * sizeof(uint16_t));
+	}
+	if(sys->nullFd >= 0){
+		close(sys->nullFd);
+	}
+	sys->vasBase = NULL;
+	sys->nullFd = -1;
+}
+
+/**
+ * @brief Set whether a window slice misses its frames, VAS access goes through frameTable while any slice does
+*/
+static void kemuSys_missSlice(KemuSys *sys, const uint16_t slice, const uint8_t missed){
+	if(sys->sliceMissed[slice] == missed){
+		return;
+	}
+	sys->sliceMissed[slice] = missed;
+	if(missed && sys->sliceMiss++ == 0){
+		printf("VAS slice %u can't alias its frames, VAS access goes through frameTable\n", slice);
+	}else if(!missed){
+		sys->sliceMiss--;
+	}
+}
+
+/**
+ * @brief Device behind a resolved frame, NULL if unmapped
+*/
+static KemuDev *kemuSys_frameDev(KemuSys *sys, const uint16_t page){
+	if(sys->pageRow[page] >= KEMU_PAGE_ROWS){
+		return NULL;
+	}
+	return kemuDev_devByID(sys, sys->pageTable[sys->pageRow[page]].devID);
+}
+
+/**
+ * @brief Map one window slice to the device region its frames point to
+ * Frames of a slice must be contiguous in one fd backed device at a host page aligned offset.
+ * Otherwise the slice is null and missed, unless none of its pages is mapped
+*/
+static void kemuSys_mapSlice(KemuSys *sys, const uint16_t slice){
+	uint16_t firstPage = slice * sys->slicePages;
+	size_t pageBytes = KEMU_PAGE_SIZE * sizeof(uint16_t);
+	size_t sliceBytes = sys->slicePages * pageBytes;
+	uint8_t *sliceAddr = (uint8_t *)sys->vasBase + firstPage * pageBytes;
+
+	KemuDev *dev = kemuSys_frameDev(sys, firstPage);
+	uint8_t isMapped = (dev != NULL && dev->fd >= 0);
+	uint8_t isCovered = (dev != NULL);
+	for(uint16_t i=1; i<sys->slicePages; i++){
+		uint16_t page = firstPage + i;
+		KemuDev *pageDev = kemuSys_frameDev(sys, page);
+		isCovered |= (pageDev != NULL);
+		isMapped = isMapped && (pageDev == dev) && (sys->frameTable[page] == sys->frameTable[firstPage] + i * KEMU_PAGE_SIZE);
+	}
+
+	int fd = sys->nullFd;
+	off_t offset = 0;
+	if(isMapped){
+		fd = dev->fd;
+		offset = (sys->frameTable[firstPage] - dev->data) * sizeof(uint16_t);
+		isMapped = (offset % sysconf(_SC_PAGESIZE) == 0);
+	}
+	if(!isMapped){
+		fd = sys->nullFd;
+		offset = 0;
+	}
+	int prot = (isMapped && dev->head.isROM) ? PROT_READ : PROT_READ | PROT_WRITE;
+	uint8_t isAliased = (mmap(sliceAddr, sliceBytes, prot, MAP_FIXED | MAP_SHARED, fd, offset) != MAP_FAILED);
+	if(!isAliased){
+		perror("Failed to remap VAS slice");
+	}
+	kemuSys_missSlice(sys, slice, !isAliased || (isCovered && !isMapped));
+}
+
+#endif
+
+//------ Page table ------
+
+/**
+ * @brief Frame of a page in one page table row, NULL if the row doesn't cover it
+ * Bank pointers computed in kemuDev_alloc are used directly
+*/
+static uint16_t *kemuSys_rowFrame(KemuSys *sys, const KemuSys_pageEntry entry, const uint16_t page, KemuDev **frameDev){
+	if(entry.devID==0 || page < entry.pageIndex){ //empty row
+		return NULL;
+	}
+	KemuDev *curDev = kemuDev_devByID(sys, entry.devID);
+	if(curDev==NULL || entry.firstBank >= curDev->head.bankCount || entry.lastBank < entry.firstBank){
+		return NULL;
+	}
+	size_t bankSize	= curDev->head.bankSize;
+	size_t lastBank	= kaelMath_min(entry.lastBank, curDev->head.bankCount - 1);
+	size_t rowSize		= (lastBank - entry.firstBank + 1) * bankSize;
+	size_t offset		= (size_t)(page - entry.pageIndex) * KEMU_PAGE_SIZE; //from start of firstBank
+	if(offset + KEMU_PAGE_SIZE > rowSize){
+		return NULL;
+	}
+	uint32_t bank = entry.firstBank + offset / bankSize;
+	uint16_t *bankData = curDev->bank[bank];
+	if(curDev->store == STREAM_STORE){
+		bankData = kemuSys_streamBank(sys, curDev, bank);
+	}
+	if(bankData == NULL){
+		return NULL;
+	}
+	*frameDev = curDev;
+	return bankData + offset % bankSize;
+}
+
+/**
+ * @brief Frame of a page from the lowest row at or past firstRow covering it, row is set to KEMU_PAGE_ROWS if none does
+*/
+static uint16_t *kemuSys_resolveRow(KemuSys *sys, const uint16_t page, const uint16_t firstRow, KemuDev **frameDev, uint8_t *row){
+	for(uint16_t i=firstRow; i<KEMU_PAGE_ROWS; i++){
+		uint16_t *frame = kemuSys_rowFrame(sys, sys->pageTable[i], page, frameDev);
+		if(frame){
+			*row = i;
+			return frame;
+		}
+	}
+	*frameDev = NULL;
+	*row = KEMU_PAGE_ROWS;
+	return kemuSys_nullBank;
+}
+
+/**
+ * @brief Frame of a page, taken from the lowest page table row covering it
+ * Empty rows are skipped, so removing a row uncovers the rows past it
+*/
+uint16_t *kemuSys_resolvePage(KemuSys *sys, const uint16_t page, KemuDev **frameDev){
+	KemuDev *dev;
+	uint8_t row;
+	uint16_t *frame = kemuSys_resolveRow(sys, page, 0, &dev, &row);
+	if(frameDev){
+		*frameDev = dev;
+	}
+	return frame;
+}
+
+/**
+ * @brief Re-resolve pages in range owned by firstRow or a later row, pages of earlier rows stay
+ * Only pages whose frame changed are touched
+*/
+static void kemuSys_resolvePages(KemuSys *sys, const size_t first, const size_t count, const uint16_t firstRow){
+	size_t last = kaelMath_min(first + count, sys->mapPageCount);
+	uint8_t pageChanged[sys->mapPageCount];
+	memset(pageChanged, 0, sizeof(pageChanged));
+
+	for(size_t i=first; i<last; i++){
+		if(sys->pageRow[i] < firstRow){
+			continue;
+		}
+		KemuDev *frameDev;
+		uint16_t *newFrame = kemuSys_resolveRow(sys, i, firstRow, &frameDev, &sys->pageRow[i]);
+		if(newFrame == sys->frameTable[i]){
+			continue;
+		}
+		//Decoded instructions point to the old frame
+		if(sys->frameAttr[i] & CODE_FRAME){
+			kemuSys_dropCode(sys, i);
+		}
+		sys->frameTable[i] = newFrame;
+		sys->frameAttr[i] &= ~(ROM_FRAME | IO_FRAME);
+		if(frameDev && frameDev->head.isROM){
+			sys->frameAttr[i] |= ROM_FRAME;
+		}
+		if(frameDev && kemuDev_isCommand(frameDev->head.type)){
+			sys->frameAttr[i] |= IO_FRAME;
+		}
+		sys->frameDirty[i] = &sys->nullDirty;
+		if(frameDev && frameDev->dirty){
+			sys->frameDirty[i] = &frameDev->dirty[(newFrame - frameDev->data) >> KEMU_PAGE_SHIFT];
+		}
+		pageChanged[i] = 1;
+	}
+
+	#if KEMU_FLAT_VAS
+	//Remap only window slices containing changed pages
+	for(size_t i=first; i<last; i++){
+		if(pageChanged[i]){
+			uint16_t slice = i / sys->slicePages;
+			kemuSys_mapSlice(sys, slice);
+			i = (slice + 1) * sys->slicePages - 1;
+		}
+	}
+	#endif
+	(void)pageChanged;
+}
+
+/**
+ * @brief Re-resolve frames of pages in range from the whole page table
+*/
+void kemuSys_remapPages(KemuSys *sys, const size_t first, const size_t count){
+	kemuSys_resolvePages(sys, first, count, 0);
+}
+
+/**
+ * @brief Remap pages entry covers after page table row changed to or from it
+ * Pages an earlier row owns are skipped, the rest resolve from row on. Cost is the pages of entry,
+ * plus a scan of later rows for pages the row stopped covering
+*/
+void kemuSys_remapRow(KemuSys *sys, const uint16_t row, const KemuSys_pageEntry entry){
+	if(entry.devID==0){
+		return;
+	}
+	KemuDev *curDev = kemuDev_devByID(sys, entry.devID);
+	if(curDev==NULL || entry.lastBank < entry.firstBank){
+		return;
+	}
+	size_t rowPages = (entry.lastBank - entry.firstBank + 1) * curDev->head.bankSize / KEMU_PAGE_SIZE;
+	kemuSys_resolvePages(sys, entry.pageIndex, rowPages, row);
+	kemuDev_readAhead(curDev, entry.lastBank + 1, KEMU_STREAM_READAHEAD);
+}
+
+/**
+ * @brief Replace sys->pageTable row, pages of the old and the new row are remapped if they differ
+*/
+void kemuSys_setRow(KemuSys *sys, const uint16_t row, const KemuSys_pageEntry entry){
+	KemuSys_pageEntry oldRow = sys->pageTable[row];
+	if(memcmp(&entry, &oldRow, sizeof(KemuSys_pageEntry)) == 0){
+		return;
+	}
+	sys->pageTable[row] = entry;
+	kemuSys_remapRow(sys, row, oldRow);
+	kemuSys_remapRow(sys, row, entry);
+}
+
+/**
+ * @brief Rebuild the whole frameTable from sys->pageTable
+*/
+void kemuSys_mapFrameTable(KemuSys *sys) {
+	kemuSys_remapPages(sys, 0, sys->mapPageCount);
+}
+
+/**
+ * @brief Page table row in VAS as seen by the guest MBC
+*/
+KemuSys_pageEntry kemuSys_readRow(const KemuSys *sys, const uint16_t row){
+	uint16_t lo = kemuSys_vasRead(sys, PAGE_TABLE_ADDR + row*2);
+	uint16_t hi = kemuSys_vasRead(sys, PAGE_TABLE_ADDR + row*2 + 1);
+	KemuSys_pageEntry entry = {
+		.devID		= lo & 0xFF,
+		.pageIndex	= lo >> 8,
+		.firstBank	= hi & 0xFF,
+		.lastBank	= hi >> 8,
+	};
+	return entry;
+}
+
+void kemuSys_writeRow(const KemuSys *sys, const uint16_t row, const KemuSys_pageEntry entry){
+	kemuSys_vasWrite(sys, PAGE_TABLE_ADDR + row*2,		kemuSys_u8Pack(entry.pageIndex, entry.devID));
+	kemuSys_vasWrite(sys, PAGE_TABLE_ADDR + row*2 + 1,	kemuSys_u8Pack(entry.lastBank, entry.firstBank));
 }
 
 //------ System ------
@@ -59,30 +472,91 @@ uint16_t kemuSys_u8Pack(uint8_t hi, uint8_t lo){
  * @brief Allocate emulated system to host memory
 */
 void kemuSys_alloc(KemuSys *sys){
+	if(sys->pageSize != KEMU_PAGE_SIZE){
+		printf("pageSize %zu not supported, using KEMU_PAGE_SIZE %u\n", sys->pageSize, KEMU_PAGE_SIZE);
+		sys->pageSize = KEMU_PAGE_SIZE;
+	}
 	sys->mapPageCount = ((UINT16_MAX+1)/sys->pageSize);
 	sys->frameTable = calloc(sys->mapPageCount,sizeof(uint16_t*));
-	for (int i = 0; i < 256; ++i) {
+	for (size_t i = 0; i < sys->mapPageCount; ++i) {
 		sys->frameTable[i] = kemuSys_nullBank;
 	}
+	sys->frameAttr = calloc(sys->mapPageCount,sizeof(uint8_t));
+	sys->frameDirty = calloc(sys->mapPageCount,sizeof(uint8_t*));
+	for (size_t i = 0; i < sys->mapPageCount; ++i) {
+		sys->frameDirty[i] = &sys->nullDirty;
+	}
+	sys->pageRow = malloc(sys->mapPageCount);
+	memset(sys->pageRow, KEMU_PAGE_ROWS, sys->mapPageCount);
+	sys->snapBase = NULL;
+	sys->rewind = NULL;
+	sys->imageBase = NULL;
+	sys->imageSize = 0;
+	sys->frameAttr[MBC_FLAG_ADDR >> KEMU_PAGE_SHIFT] |= MBC_FRAME;
+	kemuCache_alloc(&sys->icache, UINT16_MAX+1);
+	memset(&sys->jit, 0, sizeof(KemuJit)); //Arena is allocated by the first kemuJit_run
+
+	sys->vasBase = NULL;
+	sys->nullFd = -1;
+	memset(sys->sliceMissed, 0, sizeof(sys->sliceMissed));
+	sys->sliceMiss = 0;
+	#if KEMU_FLAT_VAS
+		if(kemuSys_allocWindow(sys) == KEMU_FAIL){
+			printf("Flat VAS unavailable\n");
+			exit(EXIT_FAILURE);
+		}
+	#endif
 
 	uint16_t pageCount = (UINT16_MAX+1)/sys->pageSize;
 	sys->pageTable = calloc(pageCount,sizeof(KemuSys_pageEntry));
 	kaelTree_alloc(&sys->dev, sizeof(KemuDev));
+
+	//All IDs but 0 are available
+	memset(&sys->devReg, 0, sizeof(KemuSys_devRegistry));
+	memset(sys->devReg.freeID, 0xFF, sizeof(sys->devReg.freeID));
+	sys->devReg.freeID[0] &= ~1ULL;
+
+	kemuSched_init(&sys->sched);
+	sys->emuCycle = 0;
+	kemuSys_startWorkers(sys);
+	kemuSys_startFlusher(sys);
+	kemuSys_startIO(sys);
 }
 
 /**
  * @brief Free emulated system
 */
 void kemuSys_free(KemuSys *sys){
+	//Remaining dirty chunks are synced as devices are freed
+	kemuSys_stopFlusher(sys);
+	kemuSys_stopIO(sys);
+	kemuSys_stopWorkers(sys);
+
 	//Free devices and pageTable
 	while( !kaelTree_empty(&sys->dev) ){
-		KemuDev *lastDev = (KemuDev*)kaelTree_back(&sys->dev);
-		kemuDev_free(lastDev);
-		kaelTree_pop(&sys->dev);
+		kemuSys_popDev(sys);
 	}
+	kemuSys_freeRewind(sys);
+	if(sys->imageBase){
+		munmap(sys->imageBase, sys->imageSize);
+		sys->imageBase = NULL;
+	}
+	if(sys->progBase){
+		munmap(sys->progBase, sys->progSize);
+		sys->progBase = NULL;
+	}
+	sys->progDevCount = 0;
 
 	free(sys->frameTable);
+	free(sys->frameAttr);
+	free(sys->frameDirty);
+	free(sys->pageRow);
 	free(sys->pageTable);
+	kemuCache_free(&sys->icache);
+	kemuJit_free(&sys->jit);
+	#if KEMU_FLAT_VAS
+		kemuSys_freeWindow(sys);
+	#endif
 	kaelTree_free(&sys->dev);
 }
 
@@ -121,6 +595,10 @@ uint8_t kemuSys_bootload(KemuSys *sys){
 
 	kemuSys_mapFrameTable(sys);
 
+	//Mirror rows to VAS so the guest MBC sees them
+	kemuSys_writeRow(sys, 0, ramEntry);
+	kemuSys_writeRow(sys, 1, romEntry);
+
 	return KEMU_SUCCESS;
 }
 
@@ -143,108 +621,135 @@ uint8_t kemuSys_boot(KemuSys *sys){
 		return KEMU_FAIL;
 	}
 
+	if(sys->program){
+		if(kemuSys_loadProgram(sys, sys->program) == KEMU_FAIL){
+			printf("Failed to load program %s\n", sys->program);
+			return KEMU_FAIL;
+		}
+		return KEMU_SUCCESS;
+	}
+
 	//MBC Test program
-	KemuDev *ramDev = kemuDev_devByType(sys, RAM_DEV, 0);
 	KemuDev *dataDev = kemuDev_devByType(sys, DATA_DEV, 1);
 
-	//reference
-	KemuSys_pageEntry ramEntry = {
-		.devID	= ramDev->devID,
-		.pageIndex	= 0,
-		.firstBank	= 0,
-		.lastBank	= 1,
-	};
-	KemuSys_pageEntry romEntry = {
-		.devID	= dataDev->devID,
-		.pageIndex	= 128,
-		.firstBank	= 0,
-		.lastBank	= 1,
-	};
-
-	//Write the two structs 
-	SYS_VAS(MBC_FLAG_ADDR) = ADD_MBC;
-	SYS_VAS(PAGE_TABLE_ADDR+0x0000) = kemuSys_u8Pack( 0, 	ramDev->devID  	); //ramDev to page 0
-	SYS_VAS(PAGE_TABLE_ADDR+0x0001) = kemuSys_u8Pack( 1, 	0				 		); //Banks 0 to 1
-	SYS_VAS(PAGE_TABLE_ADDR+0x0002) = kemuSys_u8Pack( 128, dataDev->devID	); //dataDev to page 128
-	SYS_VAS(PAGE_TABLE_ADDR+0x0003) = kemuSys_u8Pack( 1, 	0				 		); //Banks 0 to 1
-
 	{
-	//TODO: Implement these CPU instructions and run the program. Verfiy that written values are identical to above. 
-	//
+	//Map dataDev banks 0 to 1 at page 128 through page table row 2
 	#include "kemugon/sys/instr.h"
 		uint16_t loader[] = {
-			//Write MBC Add flag
-			LD, R0, ADD_MBC,
-			ST, R0, MBC_FLAG_ADDR,
-
-			//Pack ram devID and page index 
-			LD, R0, ramDev->devID,
-			LD, R1, 0,
-			LD, R2, PAGE_TABLE_ADDR,
-			ADD, R2, 0,
-
-			//R2 = R0<<8 | R1
-			SHL, R0, 8,
-			OR, R0, R1,
-			ST, R2, R0,
-
-			//Pack ram bank range 
-			LD, R0, 0,
-			LD, R1, 1,
-			LD, R2, PAGE_TABLE_ADDR,
-			ADD, R2, 1,
-
-			//R2 = R0<<8 | R1
-			SHL, R0, 8,
-			OR, R0, R1,
-			ST, R2, R0,
+			//Pack page index and devID
+			KEMU_ASM_EXT(LD, R0, 128),
+			KEMU_ASM_EXT(LD, R1, dataDev->devID),
+			KEMU_ASM(LD, R2, PAGE_TABLE_ADDR),
+			KEMU_ASM(ADD, R2, 4),
+
+			//[R2] = R0<<8 | R1
+			KEMU_ASM(SHL, R0, 8),
+			KEMU_ASM(OR, R0, R1),
+			KEMU_ASM(ST, R2, R0),
+
+			//Pack bank range 
+			KEMU_ASM(LD, R0, 1),
+			KEMU_ASM(LD, R1, 0),
+			KEMU_ASM(ADD, R2, 1),
+
+			//[R2] = R0<<8 | R1
+			KEMU_ASM(SHL, R0, 8),
+			KEMU_ASM(OR, R0, R1),
+			KEMU_ASM(ST, R2, R0),
+
+			//Write MBC Add flag once the row is complete
+			KEMU_ASM(LD, R0, ADD_MBC),
+			KEMU_ASM(LD, R1, MBC_FLAG_ADDR),
+			KEMU_ASM(ST, R1, R0),
 			
-			TRM,
+			KEMU_ASM(TRM, 0, 0),
 		};
 		
-		for(uint16_t i=0; i<sizeof(loader)/sizeof(uint16_t); i++){
-			SYS_VAS(BOOT_ADDR+i) = loader[i];
+		//Flash into the in-memory ROM behind BOOT_ADDR, code decoded from it before is stale
+		KemuDev *bootDev = NULL;
+		uint16_t *bootFrame = kemuSys_resolvePage(sys, BOOT_ADDR >> KEMU_PAGE_SHIFT, &bootDev);
+		size_t bootOffset = bootDev ? bootFrame - bootDev->data + (BOOT_ADDR & KEMU_PAGE_MASK) : 0;
+		size_t loaderWords = sizeof(loader)/sizeof(uint16_t);
+		if(bootDev == NULL || kemuDev_flash(bootDev, bootOffset, loader, loaderWords) == KEMU_FAIL){
+			printf("Failed to flash boot loader\n");
+			return KEMU_FAIL;
+		}
+		kemuSys_dropRange(sys, &bootDev->data[bootOffset], &bootDev->data[bootOffset + loaderWords]);
+		//A loader crossing into another row is only partly in bootDev
+		if(kemuSys_compareVAS(sys, BOOT_ADDR, loader, loaderWords) != 0){
+			printf("Boot loader not visible at BOOT_ADDR\n");
+			return KEMU_FAIL;
 		}
 		
 	}
-/*	
-	int ramCmp = memcmp(&ramEntry, (KemuSys_pageEntry *)&SYS_VAS(PAGE_TABLE_ADDR+0x0000), sizeof(KemuSys_pageEntry) );
-	int romCmp = memcmp(&romEntry, (KemuSys_pageEntry *)&SYS_VAS(PAGE_TABLE_ADDR+0x0002), sizeof(KemuSys_pageEntry) );
-	
-	printf("ramCmp %d\n",ramCmp );
-	printf("romCmp %d\n",romCmp );
+	return KEMU_SUCCESS;
+}
 
-	int i = 1;
-	
-	if (*((char *)&i) == 1) puts("little endian");
-	else puts("big endian");
 
-	printf("Packed value: 0x%04X\n", kemuSys_u8Pack(0x12,0x34));
+/**
+ * @brief Print emulation speed over hostCycles of host time
 */
-	return KEMU_SUCCESS;
+static void kemuSys_report(const KemuSys *sys, const char *label, uint64_t cycles, uint64_t ins, uint64_t hostCycles){
+	double seconds = (double)kaelMath_max(hostCycles,1) / sys->hostClockSpeed;
+	double cycleRate = cycles / seconds;
+	printf("%s: %.3f Mcycles/s, %.3f MIPS, %.2fx of %lu Hz, %lu instructions\n",
+		label, cycleRate/1e6, ins/seconds/1e6, cycleRate/sys->emuClockSpeed, sys->emuClockSpeed, ins
+	);
 }
 
-
 /**
- * @brief Emulate devices synced to system clock
- * 
+ * @brief Emulate devices synced to system clock until TRM or cycleLimit
+ * Devices run a quantum of emu-cycles at a time, clock is synced once per quantum
+ * TURBO_RUN skips syncing and reports speed instead
 */
 void kemuSys_loop(KemuSys *sys){
 	sys->quitFlag = 0;
 	uint64_t cycleCount = 0;
+	if(sys->quantumCycles==0){
+		sys->quantumCycles = kaelMath_max(sys->emuClockSpeed/1000, 1);
+	}
 
 	KemuClock clock;
 	kemuClock_init(&clock, sys->hostClockSpeed, sys->emuClockSpeed);
+
+	uint64_t startTime = __rdtsc();
+	uint64_t startIns = sys->insRetired;
+	uint64_t reportTime = startTime;
+	uint64_t reportCycles = 0;
+	uint64_t reportIns = startIns;
+
+	if(sys->rewindCycles==0){
+		sys->rewindCycles = kaelMath_max(sys->emuClockSpeed/KEMU_REWIND_HZ, 1);
+	}
+	uint64_t captureCycle = sys->emuCycle;
 	
 	while(!sys->quitFlag){
-		kemuDev_run(sys); 
-		kemuClock_sync(&clock);
-		cycleCount++;
+		uint64_t cycles = kemuDev_run(sys, sys->quantumCycles); 
+		cycleCount += cycles;
+
+		if(sys->rewindBudget && sys->emuCycle >= captureCycle){
+			kemuSys_capture(sys);
+			captureCycle = sys->emuCycle + sys->rewindCycles;
+		}
 
-		//debug terminate
-		if (cycleCount >= sys->emuClockSpeed) {
+		if(sys->runMode == TURBO_RUN){
+			uint64_t timeNow = __rdtsc();
+			if(timeNow - reportTime >= sys->hostClockSpeed * KEMU_REPORT_SECONDS){
+				kemuSys_report(sys, "Turbo", cycleCount - reportCycles, sys->insRetired - reportIns, timeNow - reportTime);
+				reportTime = timeNow;
+				reportCycles = cycleCount;
+				reportIns = sys->insRetired;
+			}
+		}else{
+			kemuClock_sync(&clock, cycles);
+		}
+
+		if(sys->cycleLimit && cycleCount >= sys->cycleLimit){
 			sys->quitFlag = 1;
 		}
 	}
-}
 
+	if(sys->runMode == TURBO_RUN){
+		kemuSys_report(sys, "Turbo total", cycleCount, sys->insRetired - startIns, __rdtsc() - startTime);
+	}
+}
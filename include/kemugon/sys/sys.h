@@ -16,9 +16,25 @@
 #include "libkael/math/math.h"
 
 #include "kemugon/clock/clock.h"
+#include "kemugon/cache/cache.h"
+#include "kemugon/jit/jit.h"
+#include "kemugon/sched/sched.h"
+#include "kemugon/worker/worker.h"
 
 #define EMU_CHAR_BIT
 
+//Page size is fixed at compile time so VAS resolution is a shift, a mask and one table load
+#ifndef KEMU_PAGE_SHIFT
+	#define KEMU_PAGE_SHIFT 8U
+#endif
+#define KEMU_PAGE_SIZE (1U << KEMU_PAGE_SHIFT)
+#define KEMU_PAGE_MASK (KEMU_PAGE_SIZE - 1U)
+
+//1 = Devices are memfd/file backed and mirrored into one host window, VAS access is vasBase[addr]
+#ifndef KEMU_FLAT_VAS
+	#define KEMU_FLAT_VAS 0
+#endif
+
 /**
 * @brief System configuration addresses in VAS
 */
@@ -30,8 +46,40 @@ typedef enum {
 	BOOT_ADDR			= 0x4000
 }KemuSys_reservedAddr;
 
+//Page table rows between PAGE_TABLE_ADDR and STACK_ADDR
+//Empty rows (devID 0) are skipped, a page covered by several rows maps from the lowest one
+#define KEMU_PAGE_ROWS ((STACK_ADDR - PAGE_TABLE_ADDR) * sizeof(uint16_t) / sizeof(KemuSys_pageEntry))
+
+/**
+* @brief CPU execution engine, selectable at runtime
+*/
+typedef enum{
+	INTERP_ENGINE,	//Decoded instruction cache interpreter
+	JIT_ENGINE,		//x86-64 basic block translation, falls back to INTERP_ENGINE
+}KemuSys_engine;
+
+/**
+* @brief Host clock pacing of kemuSys_loop
+*/
+typedef enum{
+	SYNC_RUN,	//Synced to emuClockSpeed
+	TURBO_RUN,	//Unthrottled, reports speed every KEMU_REPORT_SECONDS and at exit
+}KemuSys_runMode;
+
+#define KEMU_REPORT_SECONDS 1U
+
 //------ Page table ------
 
+/**
+* @brief Per-frame attributes checked on the guest write path
+*/
+typedef enum{
+	CODE_FRAME		= 0b00000001, //Frame holds decoded instructions
+	MBC_FRAME		= 0b00000010, //Frame holds MBC_FLAG_ADDR
+	ROM_FRAME		= 0b00000100, //Frame belongs to an isROM device, guest stores are ignored
+	IO_FRAME		= 0b00001000, //Frame holds registers of a command device, stores are passed to kemuDev_ioTrap
+}KemuSys_frameAttr;
+
 typedef struct{
 	uint8_t devID; 
 	uint8_t pageIndex; 
@@ -39,15 +87,72 @@ typedef struct{
 	uint8_t lastBank; 
 }KemuSys_pageEntry;
 
+//------ Device registry ------
+
+//devID is stored as uint8_t in page entries, 0 is reserved for empty rows
+#define KEMU_DEV_MAX 256U
+
+/**
+* @brief Constant time device lookup, indices point into KemuSys.dev
+*/
+typedef struct{
+	uint8_t slot[KEMU_DEV_MAX]; //devID -> dev index + 1, 0 = unused ID
+	uint64_t freeID[KEMU_DEV_MAX / 64]; //Set bit = devID available
+	uint8_t typeIndex[DEV_TYPE_COUNT][KEMU_DEV_MAX]; //Nth device of type -> dev index
+	uint16_t typeCount[DEV_TYPE_COUNT];
+}KemuSys_devRegistry;
+
+struct KemuRewind;
+
 typedef struct{
 	uint64_t emuClockSpeed;
 	uint64_t hostClockSpeed;
+	uint64_t quantumCycles; //emu-cycles run between clock syncs, 0 = 1ms
+	uint8_t runMode; //KemuSys_runMode
+	uint64_t cycleLimit; //emu-cycles kemuSys_loop runs before returning, 0 = until TRM
+	uint64_t insRetired; //CPU instructions executed
 
 	size_t mapPageCount;
-	size_t pageSize;
+	size_t pageSize; //Always KEMU_PAGE_SIZE
 	uint16_t **frameTable;
+	uint8_t *frameAttr; //KemuSys_frameAttr flags, one per frameTable entry
+	uint8_t **frameDirty; //Dirty byte of the device chunk behind each frame
+	uint8_t *pageRow; //Page table row each frame was resolved from, KEMU_PAGE_ROWS = unmapped
+	uint8_t nullDirty; //Dirty byte of unmapped and untracked frames
+	const void *snapBase; //KemuSnap that SNAP_DIRTY bits are relative to
+	size_t rewindBudget; //Bytes of rewind deltas kemuSys_loop keeps, 0 = disabled
+	uint64_t rewindCycles; //emu-cycles between rewind frames, 0 = emuClockSpeed/KEMU_REWIND_HZ
+	struct KemuRewind *rewind;
+	void *imageBase; //Warm-boot image mapping backing IMAGE_STORE devices
+	size_t imageSize;
+	void *progBase; //Program image mapping backing its section devices
+	size_t progSize;
+	uint8_t progDevCount; //Section devices of the loaded program, last in dev
+	uint16_t *vasBase; //KEMU_FLAT_VAS window, NULL otherwise
+	int nullFd; //Backs unmapped window slices
+	size_t slicePages; //Pages per host page sized window slice
+	uint8_t sliceMissed[(UINT16_MAX+1) >> KEMU_PAGE_SHIFT]; //1 = window slice doesn't alias its frames
+	uint16_t sliceMiss; //Missed window slices, VAS access goes through frameTable while nonzero
 	KemuSys_pageEntry *pageTable; 
 	KaelTree dev;
+	KemuSys_devRegistry devReg;
+	KemuSched sched; //Pending device events
+	uint64_t emuCycle; //Emulated time, advanced by kemuDev_run
+	uint64_t cpuCycle; //emu-cycle the running CPU batch reached, updated at its stores
+	uint64_t cpuEnd; //emu-cycle the running CPU batch stops at, lowered by earlier events its stores schedule. 0 = no batch
+	uint8_t workerCount; //Threads for GPU_DEV, AUDIO_DEV. 0 = all devices on main thread
+	KemuWorker_pool workers;
+	uint32_t diskCacheBanks; //Resident banks of disk/disk.img, streamed with pread/pwrite. 0 = map it whole
+	const char *program; //Sectioned program image booted instead of the built-in loader, NULL = built-in
+	const char *diskOverlay; //Per-instance delta over a read-only disk/disk.img, NULL = write the image in place
+	uint8_t ioThreads; //Block controller transfer threads, 0 = transfers run on the main thread
+	KemuWorker_io io;
+	uint32_t flushMs; //Write-back interval of FILE_STORE devices, 0 = only on kemuSys_flush and free
+	KemuWorker_flusher flusher;
+
+	uint8_t engine; //KemuSys_engine
+	KemuCache icache; //Decoded instructions
+	KemuJit jit;
 
 	uint8_t quitFlag;
 }KemuSys;
@@ -55,7 +160,95 @@ typedef struct{
 //------ Virtual Address Space Macro ------
 
 uint16_t* kemuSys_resolveVAS(const KemuSys *sys, const uint16_t addr) ;
-#define SYS_VAS(addr) (*kemuSys_resolveVAS(sys, (addr)))
+void kemuSys_writeTrap(KemuSys *sys, const uint16_t addr, const uint16_t value);
+
+/**
+ * @brief Pointer to VAS word. DEBUG builds take the checked kemuSys_resolveVAS path
+ * KEMU_FLAT_VAS builds use the window unless a slice of it can't alias its frames
+*/
+static inline uint16_t *kemuSys_vasPtr(const KemuSys *sys, const uint16_t addr){
+#if KAEL_DEBUG
+	return kemuSys_resolveVAS(sys, addr);
+#else
+	#if KEMU_FLAT_VAS
+		if(sys->sliceMiss == 0){
+			return &sys->vasBase[addr];
+		}
+	#endif
+	return &sys->frameTable[addr >> KEMU_PAGE_SHIFT][addr & KEMU_PAGE_MASK];
+#endif
+}
+
+static inline uint16_t kemuSys_vasRead(const KemuSys *sys, const uint16_t addr){
+	return *kemuSys_vasPtr(sys, addr);
+}
+
+/**
+ * @brief Mark the device chunk behind page dirty, after its data is written
+ * The flusher clears FLUSH_DIRTY concurrently, so the mark is an atomic store ordered after the data
+*/
+static inline void kemuSys_markDirty(const KemuSys *sys, const uint16_t page){
+	__atomic_store_n(sys->frameDirty[page], KEMU_DIRTY_ALL, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Host write, frame attributes are not checked. The backing chunk is marked dirty
+*/
+static inline void kemuSys_vasWrite(const KemuSys *sys, const uint16_t addr, const uint16_t value){
+	*kemuSys_vasPtr(sys, addr) = value;
+	kemuSys_markDirty(sys, addr >> KEMU_PAGE_SHIFT);
+}
+
+/**
+ * @brief Guest store. Stores to frames with attributes are done by kemuSys_writeTrap
+*/
+static inline void kemuSys_storeVAS(KemuSys *sys, const uint16_t addr, const uint16_t value){
+	uint16_t page = addr >> KEMU_PAGE_SHIFT;
+	if(sys->frameAttr[page]){
+		kemuSys_writeTrap(sys, addr, value);
+		return;
+	}
+	kemuSys_vasWrite(sys, addr, value);
+}
+
+/**
+ * @brief Words from addr to the end of its page
+*/
+static inline uint16_t kemuSys_pageLeft(const uint16_t addr){
+	return KEMU_PAGE_SIZE - (addr & KEMU_PAGE_MASK);
+}
+
+/**
+ * @brief Frame run for host stores up to the end of the page at addr, kemuSys_markDirty once the run is written
+ * NULL if the page has attributes, stores to it take kemuSys_storeVAS
+*/
+static inline uint16_t *kemuSys_storeRun(KemuSys *sys, const uint16_t addr){
+	uint16_t page = addr >> KEMU_PAGE_SHIFT;
+	if(sys->frameAttr[page]){
+		return NULL;
+	}
+	return kemuSys_vasPtr(sys, addr);
+}
+
+#define SYS_VAS(addr) (*kemuSys_vasPtr(sys, (addr)))
+void kemuSys_markFrame(KemuSys *sys, const uint16_t page, const uint8_t attr);
+void kemuSys_dropCode(KemuSys *sys, const uint16_t page);
+
+void kemuSys_writeVAS(KemuSys *sys, const uint16_t addr, const uint16_t *src, const size_t length);
+void kemuSys_readVAS(const KemuSys *sys, const uint16_t addr, uint16_t *dst, const size_t length);
+void kemuSys_fillVAS(KemuSys *sys, const uint16_t addr, const uint16_t value, const size_t length);
+int kemuSys_compareVAS(const KemuSys *sys, const uint16_t addr, const uint16_t *src, const size_t length);
+
+//------ Page table ------
+
+uint16_t *kemuSys_resolvePage(KemuSys *sys, const uint16_t page, KemuDev **frameDev);
+void kemuSys_remapPages(KemuSys *sys, const size_t first, const size_t count);
+void kemuSys_remapRow(KemuSys *sys, const uint16_t row, const KemuSys_pageEntry entry);
+void kemuSys_setRow(KemuSys *sys, const uint16_t row, const KemuSys_pageEntry entry);
+void kemuSys_mapFrameTable(KemuSys *sys);
+
+KemuSys_pageEntry kemuSys_readRow(const KemuSys *sys, const uint16_t row);
+void kemuSys_writeRow(const KemuSys *sys, const uint16_t row, const KemuSys_pageEntry entry);
 
 
 //------ System ------
@@ -66,6 +259,7 @@ void kemuSys_alloc(KemuSys *sys);
 void kemuSys_free(KemuSys *sys);
 
 void kemuSys_pushDev(KemuSys *sys, KemuDev *dev);
+void kemuSys_popDev(KemuSys *sys);
 
 void kemuSys_addDevices(KemuSys *sys);
 
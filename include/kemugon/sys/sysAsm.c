@@ -0,0 +1,246 @@
+/**
+ * @file sysAsm.c
+ * 
+ * @brief Implementation, packed instruction decoder, encoder, line assembler and disassembler driven by KEMU_INS_TABLE
+ *
+ * Every function takes the instructions and their operand forms from instr.h, so adding an instruction to the table
+ * makes it decodable, assemblable and printable. Only its interpreter handler and JIT translation are written by hand.
+ */
+
+#include <strings.h>
+
+#include "kemugon/sys/sysAsm.h"
+
+/**
+ * @brief KemuSys_insForm of op, NONE_FORM if op is unknown
+*/
+static uint8_t kemuAsm_form(const uint16_t op){
+	#include "kemugon/sys/instr.h"
+	#define KEMU_INS_FORM(name, form, cycles) [name] = form,
+	static const uint8_t insForm[INS_COUNT] = { KEMU_INS_TABLE(KEMU_INS_FORM) };
+	#undef KEMU_INS_FORM
+	return op < INS_COUNT ? insForm[op] : NONE_FORM;
+}
+
+/**
+ * @brief Mnemonic of op, NULL if op is unknown
+*/
+static const char *kemuAsm_name(const uint16_t op){
+	#include "kemugon/sys/instr.h"
+	#define KEMU_INS_NAME(name, form, cycles) [name] = #name,
+	static const char *insName[INS_COUNT] = { KEMU_INS_TABLE(KEMU_INS_NAME) };
+	#undef KEMU_INS_NAME
+	return op < INS_COUNT ? insName[op] : NULL;
+}
+
+/**
+ * @brief Name of register r, NULL past SP
+*/
+static const char *kemuAsm_regName(const uint16_t r){
+	#include "kemugon/sys/instr.h"
+	static const char *regName[REG_COUNT] = { "R0", "R1", "R2", "R3", "R4", "R5", "R6", "R7", "PC", "SP" };
+	return r < REG_COUNT ? regName[r] : NULL;
+}
+
+/**
+ * @brief Decode instruction in word, KEMU_INS_WORDS_MAX words of which only the first has to be valid without ext
+ * Sets op, arg and cycles of entry, returns the number of words the instruction takes
+*/
+uint8_t kemuAsm_decode(const uint16_t *word, KemuCache_entry *entry){
+	#include "kemugon/sys/instr.h"
+	//Cycle cost per instruction, one per fetched word plus execution
+	#define KEMU_INS_CYCLES(name, form, cycles) [name] = cycles,
+	static const uint8_t insCycles[INS_COUNT] = { KEMU_INS_TABLE(KEMU_INS_CYCLES) };
+	#undef KEMU_INS_CYCLES
+
+	uint16_t op = word[0] >> KEMU_INS_OP_SHIFT;
+	uint16_t rd = (word[0] >> KEMU_INS_RD_SHIFT) & KEMU_INS_RD_MASK;
+	uint8_t ext = (word[0] & KEMU_INS_EXT) != 0;
+	uint16_t operand = ext ? word[1] : word[0] & KEMU_INS_SHORT_MASK;
+	uint8_t valid = op < INS_COUNT;
+
+	entry->arg[0] = 0;
+	entry->arg[1] = 0;
+	switch(kemuAsm_form(op)){
+		case NONE_FORM:
+			valid = valid && !ext;
+			break;
+
+		case IMM_FORM:
+			entry->arg[0] = operand;
+			break;
+
+		case REG_IMM_FORM:
+			valid = valid && rd < REG_COUNT;
+			entry->arg[0] = rd;
+			entry->arg[1] = operand;
+			break;
+
+		case REG_REG_FORM:
+			valid = valid && rd < REG_COUNT && !ext && operand < REG_COUNT;
+			entry->arg[0] = rd;
+			entry->arg[1] = operand;
+			break;
+	}
+	if(!valid){
+		op = NOP;
+		ext = 0;
+		entry->arg[0] = 0;
+		entry->arg[1] = 0;
+	}
+	entry->op = op;
+	entry->cycles = 1 + ext + insCycles[op];
+	return 1 + ext;
+}
+
+/**
+ * @brief Encode instruction into out, the short operand is used if it fits
+ * Returns words written, 0 if op or a register is invalid
+*/
+uint8_t kemuAsm_encode(uint16_t *out, const uint16_t op, const uint16_t rd, const uint16_t operand){
+	#include "kemugon/sys/instr.h"
+	if(op >= INS_COUNT){
+		return 0;
+	}
+	uint16_t insRd = rd;
+	switch(kemuAsm_form(op)){
+		case NONE_FORM:
+			out[0] = KEMU_ASM(op, 0, 0);
+			return 1;
+
+		case REG_REG_FORM:
+			if(rd >= REG_COUNT || operand >= REG_COUNT){
+				return 0;
+			}
+			out[0] = KEMU_ASM(op, rd, operand);
+			return 1;
+
+		case REG_IMM_FORM:
+			if(rd >= REG_COUNT){
+				return 0;
+			}
+			break;
+
+		default:
+			insRd = 0;
+	}
+	if(operand <= KEMU_INS_SHORT_MASK){
+		out[0] = KEMU_ASM(op, insRd, operand);
+		return 1;
+	}
+	out[0] = KEMU_ASM(op, insRd, 0) | KEMU_INS_EXT;
+	out[1] = operand;
+	return 2;
+}
+
+/**
+ * @brief Register index of name, -1 if tok is not a register
+*/
+static int32_t kemuAsm_reg(const char *tok){
+	for(int32_t i=0; tok && kemuAsm_regName(i); i++){
+		if(strcasecmp(tok, kemuAsm_regName(i)) == 0){
+			return i;
+		}
+	}
+	return -1;
+}
+
+/**
+ * @brief 16-bit value of a number in C notation, -1 if tok is not one
+*/
+static int32_t kemuAsm_imm(const char *tok){
+	if(tok == NULL){
+		return -1;
+	}
+	char *end;
+	long value = strtol(tok, &end, 0);
+	if(end == tok || *end != '\0' || value < 0 || value > UINT16_MAX){
+		return -1;
+	}
+	return value;
+}
+
+/**
+ * @brief Assemble one line "OP", "OP imm", "OP Rd, imm" or "OP Rd, Rs" into out, ';' starts a comment
+ * Returns words written, 0 if the line is empty or invalid
+*/
+uint8_t kemuAsm_line(uint16_t *out, const char *line){
+	#include "kemugon/sys/instr.h"
+
+	char text[64];
+	size_t len = strcspn(line, ";\n");
+	if(len >= sizeof(text)){
+		return 0;
+	}
+	memcpy(text, line, len);
+	text[len] = '\0';
+
+	char *save;
+	char *name = strtok_r(text, " \t,", &save);
+	char *tok[3] = {0};
+	for(uint8_t i=0; name && i<3; i++){
+		tok[i] = strtok_r(NULL, " \t,", &save);
+	}
+	if(name == NULL || tok[2]){
+		return 0;
+	}
+
+	uint16_t op = INS_COUNT;
+	for(uint16_t i=0; i<INS_COUNT; i++){
+		if(strcasecmp(name, kemuAsm_name(i)) == 0){
+			op = i;
+		}
+	}
+	int32_t rd = 0;
+	int32_t operand = 0;
+	switch(kemuAsm_form(op)){
+		case NONE_FORM:
+			operand = tok[0] ? -1 : 0;
+			break;
+
+		case IMM_FORM:
+			operand = tok[1] ? -1 : kemuAsm_imm(tok[0]);
+			break;
+
+		case REG_IMM_FORM:
+			rd = kemuAsm_reg(tok[0]);
+			operand = kemuAsm_imm(tok[1]);
+			break;
+
+		case REG_REG_FORM:
+			rd = kemuAsm_reg(tok[0]);
+			operand = kemuAsm_reg(tok[1]);
+			break;
+	}
+	if(op == INS_COUNT || rd < 0 || operand < 0){
+		return 0;
+	}
+	return kemuAsm_encode(out, op, rd, operand);
+}
+
+/**
+ * @brief Print instruction in word to buf, KEMU_INS_WORDS_MAX words as for kemuAsm_decode
+ * Returns the number of words the instruction takes
+*/
+uint8_t kemuAsm_disasm(const uint16_t *word, char *buf, const size_t size){
+	#include "kemugon/sys/instr.h"
+	KemuCache_entry ins;
+	uint8_t wordCount = kemuAsm_decode(word, &ins);
+	switch(kemuAsm_form(ins.op)){
+		case IMM_FORM:
+			snprintf(buf, size, "%s 0x%04X", kemuAsm_name(ins.op), ins.arg[0]);
+			break;
+
+		case REG_IMM_FORM:
+			snprintf(buf, size, "%s %s, 0x%04X", kemuAsm_name(ins.op), kemuAsm_regName(ins.arg[0]), ins.arg[1]);
+			break;
+
+		case REG_REG_FORM:
+			snprintf(buf, size, "%s %s, %s", kemuAsm_name(ins.op), kemuAsm_regName(ins.arg[0]), kemuAsm_regName(ins.arg[1]));
+			break;
+
+		default:
+			snprintf(buf, size, "%s", kemuAsm_name(ins.op));
+	}
+	return wordCount;
+}
@@ -0,0 +1,13 @@
+/**
+ * @file sysAsm.h
+ * 
+ * @brief Header, packed instruction decoder, encoder, line assembler and disassembler driven by KEMU_INS_TABLE
+ */
+#pragma once
+
+#include "kemugon/sys/sys.h"
+
+uint8_t kemuAsm_decode(const uint16_t *word, KemuCache_entry *entry);
+uint8_t kemuAsm_encode(uint16_t *out, const uint16_t op, const uint16_t rd, const uint16_t operand);
+uint8_t kemuAsm_line(uint16_t *out, const char *line);
+uint8_t kemuAsm_disasm(const uint16_t *word, char *buf, const size_t size);
@@ -0,0 +1,244 @@
+/**
+ * @file sysBlock.c
+ *
+ * @brief Implementation, block controller moving whole blocks between devices and VAS off the CPU thread
+ *
+ * The main thread gathers VAS into a bounce buffer on submit, and does both copies of the transfer on completion.
+ * IO threads only prefault the device range, page faults of image backed devices stall them instead of the CPU.
+ * Device data and dirty bytes are never written off the main thread, so CPU loads, snapshots and rewind captures need not wait for them.
+ * Completion is an event count * KEMU_BLOCK_CYCLES after submit, so guest timing does not depend on the host.
+ */
+
+#include "kemugon/sys/sysBlock.h"
+#include "kemugon/sys/sysDev.h"
+
+/**
+ * @brief Fault in the pages of the device range, the copy on completion then runs at memory speed
+*/
+static void kemuBlock_prefault(KemuWorker_ioReq *req){
+	#ifdef MADV_POPULATE_WRITE
+		uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+		uintptr_t start = (uintptr_t)req->fault & ~(page - 1);
+		uintptr_t end = (uintptr_t)req->fault + req->faultBytes;
+		//Failure only costs the faults on completion
+		madvise((void *)start, end - start, req->write ? MADV_POPULATE_WRITE : MADV_POPULATE_READ);
+	#else
+		(void)req;
+	#endif
+}
+
+/**
+ * @brief Copy request between buffer and target data. Written chunks are marked dirty and dropped from the caches
+*/
+static void kemuBlock_transfer(KemuSys *sys, KemuDev *target, KemuWorker_ioReq *req){
+	uint16_t *data = &target->data[req->offset];
+	if(!req->write){
+		memcpy(req->buf, data, req->words * sizeof(uint16_t));
+		return;
+	}
+	memcpy(data, req->buf, req->words * sizeof(uint16_t));
+	size_t lastChunk = (req->offset + req->words) >> KEMU_PAGE_SHIFT;
+	for(size_t c=req->offset >> KEMU_PAGE_SHIFT; target->dirty && c<lastChunk; c++){
+		__atomic_store_n(&target->dirty[c], KEMU_DIRTY_ALL, __ATOMIC_RELEASE);
+	}
+	kemuSys_dropRange(sys, data, &data[req->words]);
+}
+
+static void *kemuBlock_ioMain(void *arg){
+	KemuWorker_io *io = arg;
+	pthread_mutex_lock(&io->lock);
+	for(;;){
+		while(!io->stop && io->head == io->tail){
+			pthread_cond_wait(&io->wake, &io->lock);
+		}
+		if(io->head == io->tail){
+			break;
+		}
+		KemuWorker_ioReq *req = &io->req[io->queue[io->head++ % 256]];
+		pthread_mutex_unlock(&io->lock);
+
+		kemuBlock_prefault(req);
+
+		pthread_mutex_lock(&io->lock);
+		__atomic_store_n(&req->state, DONE_IO, __ATOMIC_RELAXED);
+		pthread_cond_broadcast(&io->done);
+	}
+	pthread_mutex_unlock(&io->lock);
+	return NULL;
+}
+
+/**
+ * @brief Command register written. Validate registers and start the transfer, completion is scheduled on dev
+*/
+void kemuDev_blockCommand(KemuSys *sys, KemuDev *dev){
+	KemuWorker_io *io = &sys->io;
+	KemuWorker_ioReq *req = &io->req[dev->devID];
+	KemuDev_block *reg = (void *)dev->bank[0];
+	uint16_t command = reg->io.command;
+	reg->io.command = NONE_BLOCK;
+	if(command != READ_BLOCK && command != WRITE_BLOCK){
+		return;
+	}
+	//One transfer per controller
+	if(__atomic_load_n(&req->state, __ATOMIC_RELAXED) != IDLE_IO){
+		kemuDev_ioStatus(sys, dev, ERROR_STATUS);
+		return;
+	}
+
+	KemuDev *target = kemuDev_devByID(sys, reg->devID);
+	size_t offset = ((size_t)reg->lbaHi << 16 | reg->lbaLo) << KEMU_PAGE_SHIFT;
+	size_t words = (size_t)reg->count << KEMU_PAGE_SHIFT;
+	uint8_t valid = target && target != dev && words;
+	//Streamed banks are not all in data
+	valid = valid && kemuDev_stateWords(target) == target->head.bankSize * target->head.bankCount;
+	valid = valid && offset <= kemuDev_stateWords(target) && words <= kemuDev_stateWords(target) - offset;
+	valid = valid && !(command == WRITE_BLOCK && target->head.isROM);
+	uint16_t *buf = valid ? malloc(words * sizeof(uint16_t)) : NULL;
+	if(buf == NULL){
+		kemuDev_ioStatus(sys, dev, ERROR_STATUS);
+		return;
+	}
+	if(command == WRITE_BLOCK){
+		kemuSys_readVAS(sys, reg->vasAddr, buf, words);
+	}
+
+	*req = (KemuWorker_ioReq){
+		.fault = (uint8_t *)&target->data[offset],
+		.faultBytes = words * sizeof(uint16_t),
+		.buf = buf,
+		.devID = target->devID,
+		.offset = offset,
+		.words = words,
+		.write = command == WRITE_BLOCK,
+		.state = PENDING_IO,
+	};
+	kemuDev_ioStatus(sys, dev, BUSY_STATUS);
+	kemuDev_schedule(sys, dev, (uint64_t)reg->count * KEMU_BLOCK_CYCLES);
+
+	if(io->threadCount == 0){
+		req->state = DONE_IO;
+		return;
+	}
+	pthread_mutex_lock(&io->lock);
+	io->queue[io->tail++ % 256] = dev->devID;
+	pthread_cond_signal(&io->wake);
+	pthread_mutex_unlock(&io->lock);
+}
+
+/**
+ * @brief Completion event. Waits for the host only if it is slower than the emulated transfer
+*/
+uint64_t kemuDev_runBlock(KemuSys *sys, KemuDev *dev){
+	KemuWorker_io *io = &sys->io;
+	KemuWorker_ioReq *req = &io->req[dev->devID];
+	KemuDev_block *reg = (void *)dev->bank[0];
+	if(__atomic_load_n(&req->state, __ATOMIC_RELAXED) == IDLE_IO){
+		//Restored or rewound to a state with a transfer in flight, kemuSys_cancelIO dropped it
+		if(reg->io.status == BUSY_STATUS){
+			kemuDev_ioStatus(sys, dev, ERROR_STATUS);
+		}
+		return 0;
+	}
+
+	if(io->threadCount){
+		pthread_mutex_lock(&io->lock);
+		while(req->state == PENDING_IO){
+			pthread_cond_wait(&io->done, &io->lock);
+		}
+		pthread_mutex_unlock(&io->lock);
+	}
+
+	//Target popped or replaced since submit
+	KemuDev *target = kemuDev_devByID(sys, req->devID);
+	uint16_t status = ERROR_STATUS;
+	if(target && (uint8_t *)&target->data[req->offset] == req->fault && kemuDev_stateWords(target) >= req->offset + req->words){
+		kemuBlock_transfer(sys, target, req);
+		if(!req->write){
+			kemuSys_writeVAS(sys, reg->vasAddr, req->buf, req->words);
+		}
+		status = DONE_STATUS;
+	}
+	free(req->buf);
+	req->buf = NULL;
+	req->state = IDLE_IO;
+	kemuDev_ioStatus(sys, dev, status);
+	return 0;
+}
+
+/**
+ * @brief Spawn sys->ioThreads transfer threads. Falls back to the main thread on failure
+*/
+void kemuSys_startIO(KemuSys *sys){
+	KemuWorker_io *io = &sys->io;
+	memset(io, 0, sizeof(KemuWorker_io));
+	io->sys = sys;
+	if(sys->ioThreads == 0){
+		return;
+	}
+	io->thread = calloc(sys->ioThreads, sizeof(pthread_t));
+	if(NULL_CHECK(io->thread)){
+		return;
+	}
+	pthread_mutex_init(&io->lock, NULL);
+	pthread_cond_init(&io->wake, NULL);
+	pthread_cond_init(&io->done, NULL);
+	for(uint8_t i=0; i<sys->ioThreads; i++){
+		if(pthread_create(&io->thread[i], NULL, kemuBlock_ioMain, io) != 0){
+			printf("IO thread %u failed to start\n", i);
+			break;
+		}
+		io->threadCount++;
+	}
+	if(io->threadCount == 0){
+		pthread_cond_destroy(&io->done);
+		pthread_cond_destroy(&io->wake);
+		pthread_mutex_destroy(&io->lock);
+		free(io->thread);
+		io->thread = NULL;
+	}
+}
+
+/**
+ * @brief Drop every transfer in flight, waiting for IO threads still prefaulting for them
+ * Restore and rewind replace the machine state they were submitted from, their completion events go with it
+*/
+void kemuSys_cancelIO(KemuSys *sys){
+	KemuWorker_io *io = &sys->io;
+	if(io->threadCount){
+		pthread_mutex_lock(&io->lock);
+		for(size_t i=0; i<256; i++){
+			while(io->req[i].state == PENDING_IO){
+				pthread_cond_wait(&io->done, &io->lock);
+			}
+		}
+		pthread_mutex_unlock(&io->lock);
+	}
+	for(size_t i=0; i<256; i++){
+		free(io->req[i].buf);
+		io->req[i].buf = NULL;
+		io->req[i].state = IDLE_IO;
+	}
+}
+
+/**
+ * @brief Finish queued prefaults and join threads. Buffers of unfinished requests are freed
+*/
+void kemuSys_stopIO(KemuSys *sys){
+	KemuWorker_io *io = &sys->io;
+	if(io->threadCount){
+		pthread_mutex_lock(&io->lock);
+		io->stop = 1;
+		pthread_cond_broadcast(&io->wake);
+		pthread_mutex_unlock(&io->lock);
+		for(uint8_t i=0; i<io->threadCount; i++){
+			pthread_join(io->thread[i], NULL);
+		}
+		pthread_cond_destroy(&io->done);
+		pthread_cond_destroy(&io->wake);
+		pthread_mutex_destroy(&io->lock);
+		free(io->thread);
+		io->thread = NULL;
+		io->threadCount = 0;
+	}
+	kemuSys_cancelIO(sys);
+}
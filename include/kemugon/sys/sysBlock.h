@@ -0,0 +1,21 @@
+/**
+ * @file sysBlock.h
+ * 
+ * @brief Header, block controller moving whole blocks between devices and VAS off the CPU thread
+ */
+#pragma once
+
+#include "kemugon/sys/sys.h"
+#include "kemugon/dev/dev.h"
+
+//Emulated transfer time per block, completion is due after count * KEMU_BLOCK_CYCLES
+#ifndef KEMU_BLOCK_CYCLES
+	#define KEMU_BLOCK_CYCLES 64U
+#endif
+
+void kemuDev_blockCommand(KemuSys *sys, KemuDev *dev);
+uint64_t kemuDev_runBlock(KemuSys *sys, KemuDev *dev);
+
+void kemuSys_startIO(KemuSys *sys);
+void kemuSys_cancelIO(KemuSys *sys);
+void kemuSys_stopIO(KemuSys *sys);
@@ -6,20 +6,19 @@
 
 
 #include "kemugon/sys/sysDev.h"
+#include "kemugon/sys/sysBlock.h"
+#include "kemugon/sys/sysDma.h"
+#include "kemugon/sys/sysAsm.h"
 
 /**
  * @brief Return device by id
  * 
 */
 KemuDev *kemuDev_devByID(const KemuSys *sys, const uint16_t devID){
-	uint8_t devCount = kaelTree_length(&sys->dev);
-	for(uint8_t i=0; i<devCount; i++){
-		KemuDev *curDev = kaelTree_get(&sys->dev, i);
-		if(curDev->devID == devID){
-			return curDev;
-		}
+	if(devID >= KEMU_DEV_MAX || sys->devReg.slot[devID] == 0){
+		return NULL;
 	}
-	return NULL;
+	return kaelTree_get(&sys->dev, sys->devReg.slot[devID] - 1);
 }
 
 /**
@@ -27,131 +26,1090 @@ KemuDev *kemuDev_devByID(const KemuSys *sys, const uint16_t devID){
  * 
 */
 KemuDev *kemuDev_devByType(const KemuSys *sys, const uint16_t devType, uint8_t n){
-	uint8_t count=0;
-	uint8_t devCount = kaelTree_length(&sys->dev);
-	for(uint8_t i=0; i<devCount; i++){
-		KemuDev *curDev = kaelTree_get(&sys->dev, i);
-		if(curDev->head.type==devType){
-			if(count==n){
-				return curDev;
-			}
-			count++;
-		}
+	if(devType >= DEV_TYPE_COUNT || n >= sys->devReg.typeCount[devType]){
+		return NULL;
 	}
-	return NULL;
+	return kaelTree_get(&sys->dev, sys->devReg.typeIndex[devType][n]);
 }
 
 //------ Running devices ------
 
-/** @brief Run single device 
- * 
+/**
+ * @brief Carry and overflow of ALU instruction op on dst and operand src
+*/
+uint16_t kemuDev_aluFlags(const uint16_t op, const uint16_t dst, const uint16_t src){
+	#include "kemugon/sys/instr.h"
+	uint32_t result = 0;
+	uint8_t carry = 0;
+	uint8_t overflow = 0;
+	switch(op){
+		case ADD:
+			result = (uint32_t)dst + src;
+			carry = result > UINT16_MAX;
+			overflow = ((dst ^ result) & (src ^ result) & 0x8000) != 0;
+			break;
+
+		case SUB: //Carry is borrow
+			result = (uint32_t)dst - src;
+			carry = dst < src;
+			overflow = ((dst ^ src) & (dst ^ result) & 0x8000) != 0;
+			break;
+
+		case MUL:
+			carry = (uint32_t)dst * src > UINT16_MAX;
+			overflow = (int32_t)(int16_t)dst * (int16_t)src != (int16_t)(dst * src);
+			break;
+
+		case SHL: //Carry is the last bit shifted out, overflow a changed sign
+			result = (uint32_t)dst << (src & 0xF);
+			carry = (src & 0xF) && (result & 0x10000);
+			overflow = ((dst ^ result) & 0x8000) != 0;
+			break;
+
+		default:
+			return 0;
+	}
+	return (carry ? CARRY_CPU : 0) | (overflow ? OVERFLOW_CPU : 0);
+}
+
+/**
+ * @brief Materialize flags of the pending ALU instruction and return them
+ * ALU instructions only record their operands, flags are computed when an instruction or a save state reads them
+*/
+uint16_t kemuDev_flagsCPU(KemuDev_CPU *cpu){
+	#include "kemugon/sys/instr.h"
+	if(cpu->flagOp != NOP){
+		cpu->flags = kemuDev_aluFlags(cpu->flagOp, cpu->flagDst, cpu->flagSrc);
+		cpu->flagOp = NOP;
+	}
+	return cpu->flags;
+}
+
+/**
+ * @brief Materialize flags of every CPU so saved state holds them
+*/
+void kemuSys_settleFlags(const KemuSys *sys){
+	KemuDev *cpu;
+	for(uint8_t n=0; (cpu = kemuDev_devByType(sys, CPU_DEV, n)); n++){
+		kemuDev_flagsCPU((void *)cpu->bank[0]);
+	}
+}
+
+/**
+ * @brief Decode instruction at pc into cache entry. Handler is left for the caller
+ * Pages the instruction spans are marked as code so writes invalidate the entry
+*/
+void kemuDev_decodeCPU(KemuSys *sys, const uint16_t pc, KemuCache_entry *entry){
+	#include "kemugon/sys/instr.h"
+	//Extension word is fetched only if the instruction has one
+	uint16_t word[KEMU_INS_WORDS_MAX] = { SYS_VAS(pc), 0 };
+	if(word[0] & KEMU_INS_EXT){
+		word[1] = SYS_VAS((uint16_t)(pc+1));
+	}
+	uint8_t wordCount = kemuAsm_decode(word, entry);
+	entry->nextPC = pc + wordCount;
+
+	uint16_t firstPage = pc >> KEMU_PAGE_SHIFT;
+	uint16_t lastPage = (uint16_t)(pc + wordCount - 1) >> KEMU_PAGE_SHIFT;
+	kemuSys_markFrame(sys, firstPage, CODE_FRAME);
+	if(lastPage != firstPage){
+		kemuSys_markFrame(sys, lastPage, CODE_FRAME);
+	}
+}
+
+/**
+ * @brief Check op starts a superinstruction of KEMU_FUSE_TABLE
 */
-void kemuDev_runCPU(KemuSys *sys, KemuDev *dev){
+uint8_t kemuDev_fuseHead(const uint8_t op){
+	#include "kemugon/sys/instr.h"
+	#define KEMU_FUSE_HEAD(name, op0, op1, op2) op0,
+	static const uint8_t headOp[] = { KEMU_FUSE_TABLE(KEMU_FUSE_HEAD) };
+	#undef KEMU_FUSE_HEAD
+	for(uint8_t i=0; i<sizeof(headOp); i++){
+		if(headOp[i] == op){
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * @brief Superinstruction starting at the decoded entry of pc, NONE_FUSED if the instructions after it don't form one
+ * All words of a superinstruction lie in the page of pc, so dropping its code drops the fused entry too
+ * Instructions after the first are decoded into the cache but left without a handler
+*/
+uint8_t kemuDev_fuseCPU(KemuSys *sys, const uint16_t pc){
+	#include "kemugon/sys/instr.h"
+	#define KEMU_FUSE_OPS(name, op0, op1, op2) { op0, op1, op2 },
+	static const uint8_t fuseOps[FUSED_COUNT-1][3] = { KEMU_FUSE_TABLE(KEMU_FUSE_OPS) };
+	#undef KEMU_FUSE_OPS
+
+	//Up to three instructions in the page, none touching PC since fused handlers only set it once
+	KemuCache_entry *ins[3];
+	uint8_t insCount = 0;
+	uint16_t insPC = pc;
+	for(; insCount<3; insCount++){
+		KemuCache_entry *cur = &sys->icache.entry[insPC];
+		if(insCount && cur->handler == NULL){
+			kemuDev_decodeCPU(sys, insPC, cur);
+		}
+		uint16_t lastWord = cur->nextPC - 1;
+		uint8_t regCount = (cur->op==ST || cur->op==AND || cur->op==OR) ? 2 : (cur->op==JMP || cur->op==JC || cur->op==JV || cur->op==TRM || cur->op==NOP) ? 0 : 1;
+		if((lastWord >> KEMU_PAGE_SHIFT) != (pc >> KEMU_PAGE_SHIFT) || lastWord < insPC){
+			break;
+		}
+		if((regCount > 0 && cur->arg[0] >= PC) || (regCount > 1 && cur->arg[1] >= PC)){
+			break;
+		}
+		ins[insCount] = cur;
+		insPC = cur->nextPC;
+	}
+
+	for(uint8_t f=0; f<FUSED_COUNT-1; f++){
+		uint8_t length = fuseOps[f][2] == NOP ? 2 : 3;
+		if(length > insCount){
+			continue;
+		}
+		uint8_t match = 1;
+		for(uint8_t i=0; i<length; i++){
+			match = match && ins[i]->op == fuseOps[f][i];
+		}
+		switch(f + 1){
+			case PACK_ST_FUSED: //Store the packed register
+				match = match && ins[2]->arg[1] == ins[0]->arg[0];
+				//fallthrough
+			case PACK_FUSED: //OR into the shifted register
+				match = match && ins[1]->arg[0] == ins[0]->arg[0];
+				break;
+		}
+		if(match){
+			return f + 1;
+		}
+	}
+	return NONE_FUSED;
+}
+
+/** @brief Run instructions through the decoded instruction cache until cycleBudget is spent, or a store schedules an earlier event
+ * Registers are kept in locals for the whole batch. Last instruction may overshoot the budget
+ * Returns the number of spent cycles
+*/
+#pragma GCC diagnostic push 
+#pragma GCC diagnostic ignored "-Wpedantic" //Computed goto is a GNU extension
+uint64_t kemuDev_runCPU(KemuSys *sys, KemuDev *dev, const uint64_t cycleBudget){
 	KemuDev_CPU *cpu = (void *)dev->bank[0];
+	KemuCache_entry *entry;
+	const uint64_t startCycle = sys->cpuCycle;
+	uint64_t budget = cycleBudget;
+	uint64_t cycles = 0;
+	uint64_t retired = 0;
+
+	#include "kemugon/sys/instr.h"
+	uint16_t reg[REG_COUNT];
+	memcpy(reg, cpu->reg, sizeof(reg));
+	uint16_t flags = cpu->flags;
+	uint16_t flagOp = cpu->flagOp;
+	uint16_t flagDst = cpu->flagDst;
+	uint16_t flagSrc = cpu->flagSrc;
+
+	//Every instruction of KEMU_INS_TABLE needs an ins_ label below
+	#define KEMU_INS_LABEL(name, form, cycles) [name] = &&ins_##name,
+	static const void *insLabel[INS_COUNT] = { KEMU_INS_TABLE(KEMU_INS_LABEL) };
+	#undef KEMU_INS_LABEL
+	#define KEMU_FUSE_LABEL(name, op0, op1, op2) [name##_FUSED] = &&fuse_##name,
+	static const void *fuseLabel[FUSED_COUNT] = { [NONE_FUSED] = NULL, KEMU_FUSE_TABLE(KEMU_FUSE_LABEL) };
+	#undef KEMU_FUSE_LABEL
 
+	//Fetch next entry, decode on miss. pc is advanced before execution so handlers may overwrite it
 	#if KAEL_DEBUG
-	//debug
-	printf("word: %04X\n", SYS_VAS(cpu->pc));
+		#define CPU_TRACE() do{ \
+			char text[32]; \
+			uint16_t word[KEMU_INS_WORDS_MAX] = { SYS_VAS(reg[PC]), SYS_VAS((uint16_t)(reg[PC]+1)) }; \
+			kemuAsm_disasm(word, text, sizeof(text)); \
+			printf("%04X: %s\n", reg[PC], text); \
+		}while(0)
+	#else
+		#define CPU_TRACE() ((void)0)
 	#endif
+	#define CPU_DISPATCH() do{ \
+		if(cycles >= budget){ goto done; } \
+		entry = &sys->icache.entry[reg[PC]]; \
+		if(entry->handler == NULL){ \
+			kemuDev_decodeCPU(sys, reg[PC], entry); \
+			entry->handler = (KEMU_FUSE_HEAT && kemuDev_fuseHead(entry->op)) ? &&fuse_probe : insLabel[entry->op]; \
+		} \
+		CPU_TRACE(); \
+		reg[PC] = entry->nextPC; \
+		cycles += entry->cycles; \
+		retired++; \
+		goto *entry->handler; \
+	}while(0)
 
-	//Load next word
-	cpu->rw[0] = SYS_VAS(cpu->pc);
-	cpu->pc++;
+	//Stores may schedule a device event before the batch end, the batch then ends at that event
+	#define CPU_STORE(addr, value) do{ \
+		sys->cpuCycle = startCycle + cycles; \
+		kemuSys_storeVAS(sys, addr, value); \
+		if(sys->cpuEnd && sys->cpuEnd < startCycle + budget){ \
+			budget = sys->cpuEnd - startCycle; \
+		} \
+	}while(0)
 
-	//interpret as instruction
-	#include "kemugon/sys/instr.h"
-	switch(cpu->rw[0]){ 
-		case TRM:
-			printf("Terminate instruction\n");
-			sys->quitFlag=1;
-			break;
+	//ALU instructions record operands instead of computing flags
+	#define CPU_RECORD(op, ins) do{ \
+		flagOp = (op); \
+		flagDst = reg[(ins)->arg[0]]; \
+		flagSrc = (ins)->arg[1]; \
+	}while(0)
+	#define CPU_FLAGS() do{ \
+		if(flagOp != NOP){ \
+			flags = kemuDev_aluFlags(flagOp, flagDst, flagSrc); \
+			flagOp = NOP; \
+		} \
+	}while(0)
 
-		case JMP: //Jump to address in next word
-			cpu->pc = SYS_VAS(cpu->pc);
+	CPU_DISPATCH();
 
-		default:
+	ins_LD:
+		reg[entry->arg[0]] = entry->arg[1];
+		CPU_DISPATCH();
+
+	ins_ST:
+		CPU_STORE(reg[entry->arg[0]], reg[entry->arg[1]]);
+		CPU_DISPATCH();
+
+	ins_JMP: //Jump to operand
+		reg[PC] = entry->arg[0];
+		CPU_DISPATCH();
+
+	ins_TRM:
+		printf("Terminate instruction\n");
+		sys->quitFlag=1;
+		goto done;
+
+	ins_ADD:
+		CPU_RECORD(ADD, entry);
+		reg[entry->arg[0]] += entry->arg[1];
+		CPU_DISPATCH();
+
+	ins_SUB:
+		CPU_RECORD(SUB, entry);
+		reg[entry->arg[0]] -= entry->arg[1];
+		CPU_DISPATCH();
+
+	ins_MUL:
+		CPU_RECORD(MUL, entry);
+		reg[entry->arg[0]] *= entry->arg[1];
+		CPU_DISPATCH();
+
+	ins_DIV: //Division by zero saturates
+		reg[entry->arg[0]] = entry->arg[1] ? reg[entry->arg[0]] / entry->arg[1] : UINT16_MAX;
+		CPU_DISPATCH();
+
+	ins_SHL:
+		CPU_RECORD(SHL, entry);
+		reg[entry->arg[0]] <<= (entry->arg[1] & 0xF);
+		CPU_DISPATCH();
+
+	ins_SHR:
+		reg[entry->arg[0]] >>= (entry->arg[1] & 0xF);
+		CPU_DISPATCH();
+
+	ins_AND:
+		reg[entry->arg[0]] &= reg[entry->arg[1]];
+		CPU_DISPATCH();
+
+	ins_OR:
+		reg[entry->arg[0]] |= reg[entry->arg[1]];
+		CPU_DISPATCH();
+
+	ins_NOP:
+		CPU_DISPATCH();
+
+	ins_JC:
+		CPU_FLAGS();
+		if(flags & CARRY_CPU){
+			reg[PC] = entry->arg[0];
+		}
+		CPU_DISPATCH();
+
+	ins_JV:
+		CPU_FLAGS();
+		if(flags & OVERFLOW_CPU){
+			reg[PC] = entry->arg[0];
+		}
+		CPU_DISPATCH();
+
+	//Superinstructions. The first instruction was dispatched, the rest are read from the entries following it
+	//If the budget would stop the unfused sequence early only the first instruction runs, so fusion never changes timing
+	#define CPU_FUSE_NEXT(prev) (&sys->icache.entry[(prev)->nextPC])
+	#define CPU_FUSE_RETIRE(last, extraCycles, extraCount) do{ \
+		reg[PC] = (last)->nextPC; \
+		cycles += (extraCycles); \
+		retired += (extraCount); \
+	}while(0)
+
+	fuse_probe: //First instruction of a possible superinstruction, checked once hot
+		if(++sys->icache.heat[entry - sys->icache.entry] >= KEMU_FUSE_HEAT){
+			const void *fused = fuseLabel[kemuDev_fuseCPU(sys, entry - sys->icache.entry)];
+			entry->handler = fused ? fused : insLabel[entry->op];
+			goto *entry->handler;
+		}
+		goto *insLabel[entry->op];
+
+	fuse_PACK_ST:{ //Rd = Rd<<imm | Rs, [Ra] = Rd
+		const KemuCache_entry *second = CPU_FUSE_NEXT(entry);
+		const KemuCache_entry *third = CPU_FUSE_NEXT(second);
+		if(cycles + second->cycles >= budget){
+			goto *insLabel[entry->op];
+		}
+		CPU_RECORD(SHL, entry);
+		reg[entry->arg[0]] <<= (entry->arg[1] & 0xF);
+		reg[entry->arg[0]] |= reg[second->arg[1]];
+		CPU_FUSE_RETIRE(third, second->cycles + third->cycles, 2);
+		CPU_STORE(reg[third->arg[0]], reg[third->arg[1]]);
+		CPU_DISPATCH();
+	}
+
+	fuse_LD_LD_ST:{ //Ra = imm, Rb = imm, [Rx] = Ry
+		const KemuCache_entry *second = CPU_FUSE_NEXT(entry);
+		const KemuCache_entry *third = CPU_FUSE_NEXT(second);
+		if(cycles + second->cycles >= budget){
+			goto *insLabel[entry->op];
+		}
+		reg[entry->arg[0]] = entry->arg[1];
+		reg[second->arg[0]] = second->arg[1];
+		CPU_FUSE_RETIRE(third, second->cycles + third->cycles, 2);
+		CPU_STORE(reg[third->arg[0]], reg[third->arg[1]]);
+		CPU_DISPATCH();
+	}
+
+	fuse_PACK:{ //Rd = Rd<<imm | Rs
+		const KemuCache_entry *second = CPU_FUSE_NEXT(entry);
+		if(cycles >= budget){
+			goto *insLabel[entry->op];
+		}
+		CPU_RECORD(SHL, entry);
+		reg[entry->arg[0]] <<= (entry->arg[1] & 0xF);
+		reg[entry->arg[0]] |= reg[second->arg[1]];
+		CPU_FUSE_RETIRE(second, second->cycles, 1);
+		CPU_DISPATCH();
 	}
 
+	fuse_LD_LD:{ //Ra = imm, Rb = imm
+		const KemuCache_entry *second = CPU_FUSE_NEXT(entry);
+		if(cycles >= budget){
+			goto *insLabel[entry->op];
+		}
+		reg[entry->arg[0]] = entry->arg[1];
+		reg[second->arg[0]] = second->arg[1];
+		CPU_FUSE_RETIRE(second, second->cycles, 1);
+		CPU_DISPATCH();
+	}
+
+	fuse_ADD_ST:{ //Rd += imm, [Ra] = Rs
+		const KemuCache_entry *second = CPU_FUSE_NEXT(entry);
+		if(cycles >= budget){
+			goto *insLabel[entry->op];
+		}
+		CPU_RECORD(ADD, entry);
+		reg[entry->arg[0]] += entry->arg[1];
+		CPU_FUSE_RETIRE(second, second->cycles, 1);
+		CPU_STORE(reg[second->arg[0]], reg[second->arg[1]]);
+		CPU_DISPATCH();
+	}
+
+	done:
+	#undef CPU_FLAGS
+	#undef CPU_RECORD
+	#undef CPU_STORE
+	#undef CPU_FUSE_RETIRE
+	#undef CPU_FUSE_NEXT
+	#undef CPU_DISPATCH
+	#undef CPU_TRACE
+	memcpy(cpu->reg, reg, sizeof(reg));
+	cpu->flags = flags;
+	cpu->flagOp = flagOp;
+	cpu->flagDst = flagDst;
+	cpu->flagSrc = flagSrc;
+	sys->insRetired += retired;
+	return cycles;
 }
+#pragma GCC diagnostic pop
 
 /**
- * @brief Emulate Memory Bank Controller
- * TODO: Read section of ram and repopulate pageTable accordingly
+ * @brief Emulate Memory Bank Controller, run by kemuSys_writeTrap when the guest writes MBC_FLAG_ADDR
+ * ADD_MBC and REM_MBC sync page table rows in VAS that differ from sys->pageTable, a zeroed row removes its mapping
+ * Only pages of changed rows are remapped
 */
 void kemuDev_runMBC(KemuSys *sys){
+	uint16_t flag = kemuSys_vasRead(sys, MBC_FLAG_ADDR);
+	if(flag != ADD_MBC && flag != REM_MBC){
+		return;
+	}
+	kemuSys_vasWrite(sys, MBC_FLAG_ADDR, BUSY_MBC);
+
+	for(uint16_t i=0; i<KEMU_PAGE_ROWS; i++){
+		kemuSys_setRow(sys, i, kemuSys_readRow(sys, i));
+	}
+
+	kemuSys_vasWrite(sys, MBC_FLAG_ADDR, NONE_MBC);
 }
 
 /**
- * @brief Emulate connected special devices
- * TODO: Potential for multi-threading
- * 
+ * @brief Handle due event of dev, tickBudget is the device ticks until the next pending event or quantum end
+ * Returns device ticks until the next event of dev, 0 = idle until rescheduled
+*/
+uint64_t kemuDev_event(KemuSys *sys, KemuDev *dev, const uint64_t tickBudget){
+	switch(dev->head.type){
+		
+		case MBC_DEV: //Event driven, see kemuDev_runMBC
+			return 0;
+			
+		case CPU_DEV:{ //Runs until the next event, or an earlier one its stores schedule, resumes right after
+			sys->cpuCycle = sys->emuCycle;
+			sys->cpuEnd = sys->emuCycle + tickBudget;
+			uint64_t ticks = sys->engine == JIT_ENGINE ? kemuJit_run(sys, dev, tickBudget) : kemuDev_runCPU(sys, dev, tickBudget);
+			sys->cpuEnd = 0;
+			return ticks;
+		}
+		
+		case GPU_DEV:
+			return 0;
+		
+		case AUDIO_DEV:
+			return 0;
+
+		case BLOCK_DEV: //Transfer completion, see kemuDev_ioTrap
+			return kemuDev_runBlock(sys, dev);
+
+		case DMA_DEV:
+			return kemuDev_runDma(sys, dev);
+
+		default:
+			return 0;
+	}
+}
+
+/**
+ * @brief Event queue of the thread owning dev
+*/
+static KemuSched *kemuDev_ownerSched(KemuSys *sys, const KemuDev *dev, uint64_t **emuCycle){
+	if(dev->worker){
+		KemuWorker *worker = &sys->workers.worker[dev->worker - 1];
+		*emuCycle = &worker->emuCycle;
+		return &worker->sched;
+	}
+	*emuCycle = &sys->emuCycle;
+	return &sys->sched;
+}
+
+/**
+ * @brief Queue event of dev after delay emu-cycles, replacing its pending one
+ * Scheduled by a store of the running CPU batch, delay counts from that store and the batch ends no later than the event
+*/
+void kemuDev_schedule(KemuSys *sys, const KemuDev *dev, const uint64_t delay){
+	uint64_t *emuCycle;
+	KemuSched *sched = kemuDev_ownerSched(sys, dev, &emuCycle);
+	//A stale event would complete a command early
+	kemuSched_remove(sched, dev->devID);
+	uint64_t time = *emuCycle + delay;
+	if(sys->cpuEnd && !dev->worker){
+		time = sys->cpuCycle + delay;
+		sys->cpuEnd = kaelMath_min(sys->cpuEnd, time);
+	}
+	kemuSched_push(sched, time, dev->devID);
+}
+
+/**
+ * @brief Drop pending event of dev
+*/
+void kemuDev_unschedule(KemuSys *sys, const KemuDev *dev){
+	uint64_t *emuCycle;
+	kemuSched_remove(kemuDev_ownerSched(sys, dev, &emuCycle), dev->devID);
+}
+
+/**
+ * @brief Run due events of sched up to endCycle. Only the main thread stops early, when an event sets quitFlag
+*/
+static void kemuDev_runSched(KemuSys *sys, KemuSched *sched, uint64_t *emuCycle, const uint64_t endCycle, const uint8_t isMain){
+	while(kemuSched_nextTime(sched) < endCycle){
+		KemuSched_event event = kemuSched_pop(sched);
+		KemuDev *dev = kemuDev_devByID(sys, event.devID);
+		if(dev==NULL){
+			continue;
+		}
+		*emuCycle = kaelMath_max(*emuCycle, event.time);
+
+		uint64_t div = dev->clockDiv ? dev->clockDiv : 1;
+		uint64_t limit = kaelMath_min(kemuSched_nextTime(sched), endCycle);
+		uint64_t tickBudget = kaelMath_max((limit - *emuCycle) / div, 1);
+		
+		uint8_t quitFlag = sys->quitFlag;
+		uint64_t ticks = kemuDev_event(sys, dev, tickBudget);
+		if(isMain && sys->quitFlag && !quitFlag){
+			*emuCycle += ticks * div;
+			return;
+		}
+		if(ticks){
+			kemuSched_push(sched, *emuCycle + ticks * div, dev->devID);
+		}
+	}
+	*emuCycle = endCycle;
+}
+
+/**
+ * @brief Emulate connected special devices for one quantum of cycleBudget emu-cycles
+ * Due events are run in timestamp order, idle devices have no event and are not visited
+ * Workers run their devices to the same quantum end in parallel, messages are exchanged after the barrier
+ * Returns spent cycles, less than cycleBudget if CPU terminated
 */
-void kemuDev_run(KemuSys *sys){
+uint64_t kemuDev_run(KemuSys *sys, const uint64_t cycleBudget){
+	KemuWorker_pool *pool = &sys->workers;
+	const uint64_t startCycle = sys->emuCycle;
+	const uint64_t endCycle = startCycle + cycleBudget;
+
+	if(pool->workerCount){
+		atomic_store_explicit(&pool->endCycle, endCycle, memory_order_relaxed);
+		atomic_fetch_add_explicit(&pool->epoch, 1, memory_order_release);
+	}
+
+	kemuDev_runSched(sys, &sys->sched, &sys->emuCycle, endCycle, 1);
+
+	if(pool->workerCount){
+		kemuDev_routeMessages(sys);
+	}
+
+	return sys->emuCycle - startCycle;
+}
+
+//------ Command devices ------
+
+/**
+ * @brief Check devType has KemuDev_ioRegs and a frame attribute IO_FRAME
+*/
+uint8_t kemuDev_isCommand(const uint8_t devType){
+	switch(devType){
+		case BLOCK_DEV:
+		case DMA_DEV:
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+/**
+ * @brief Set status register, irqDev is sent final states
+*/
+void kemuDev_ioStatus(KemuSys *sys, KemuDev *dev, const uint16_t status){
+	KemuDev_ioRegs *reg = (void *)dev->bank[0];
+	reg->status = status;
+	if(dev->dirty){
+		__atomic_store_n(&dev->dirty[0], KEMU_DIRTY_ALL, __ATOMIC_RELEASE);
+	}
+	if(status != BUSY_STATUS && reg->irqDev
+		&& kemuDev_post(sys, dev, (KemuQueue_msg){ .devID = reg->irqDev, .addr = reg->irqAddr, .value = status }) == KEMU_FAIL){
+		printf("Device %u status %u to device %u was not delivered\n", dev->devID, status, reg->irqDev);
+	}
+}
+
+/**
+ * @brief Guest store to an IO_FRAME, a write to the command register of the device runs the command
+*/
+void kemuDev_ioTrap(KemuSys *sys, const uint16_t addr){
+	uint16_t *word = &sys->frameTable[addr >> KEMU_PAGE_SHIFT][addr & KEMU_PAGE_MASK];
 	uint8_t devCount = kaelTree_length(&sys->dev);
-	for(uint8_t i=0; i<devCount ; i++ ){
-		KemuDev *curDev = kaelTree_get(&sys->dev, i);
-		if(curDev==NULL){
+	for(uint8_t i=0; i<devCount; i++){
+		KemuDev *dev = kaelTree_get(&sys->dev, i);
+		if(!kemuDev_isCommand(dev->head.type) || word != dev->bank[0]){
 			continue;
 		}
-		switch(curDev->head.type){
-			
-			case MBC_DEV:
-				kemuDev_runMBC(sys);
-				break;
-				
-			case CPU_DEV:
-				kemuDev_runCPU(sys, curDev);
+		switch(dev->head.type){
+			case BLOCK_DEV:
+				kemuDev_blockCommand(sys, dev);
 				break;
-			
-			case GPU_DEV:
-				break;
-			
-			case AUDIO_DEV:
+
+			case DMA_DEV:
+				kemuDev_dmaCommand(sys, dev);
 				break;
+		}
+		return;
+	}
+}
 
-			default:
+//------ Worker threads ------
+
+/**
+ * @brief Device types run by workers
+*/
+static uint8_t kemuDev_isThreaded(const uint8_t devType){
+	switch(devType){
+		case GPU_DEV:
+		case AUDIO_DEV:
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+/**
+ * @brief Write message to receiving device data, on the thread owning it
+*/
+static void kemuDev_deliver(KemuSys *sys, const KemuQueue_msg msg){
+	KemuDev *dev = kemuDev_devByID(sys, msg.devID);
+	if(dev==NULL || msg.addr >= dev->head.bankSize * dev->head.bankCount){
+		return;
+	}
+	dev->data[msg.addr] = msg.value;
+	if(dev->dirty){
+		__atomic_store_n(&dev->dirty[msg.addr >> KEMU_PAGE_SHIFT], KEMU_DIRTY_ALL, __ATOMIC_RELEASE);
+	}
+}
+
+/**
+ * @brief Main thread side of kemuDev_post. Writes to worker devices wait in the pending list until workers are parked
+*/
+static uint8_t kemuDev_send(KemuSys *sys, const KemuQueue_msg msg){
+	KemuWorker_pool *pool = &sys->workers;
+	KemuDev *dst = kemuDev_devByID(sys, msg.devID);
+	if(dst==NULL){
+		return KEMU_FAIL;
+	}
+	if(dst->worker){
+		if(pool->pendingCount == pool->pendingSize){
+			size_t size = pool->pendingSize ? pool->pendingSize * 2 : KEMU_QUEUE_SIZE;
+			KemuQueue_msg *pending = realloc(pool->pending, size * sizeof(KemuQueue_msg));
+			if(NULL_CHECK(pending)){
+				return KEMU_FAIL;
+			}
+			pool->pending = pending;
+			pool->pendingSize = size;
+		}
+		pool->pending[pool->pendingCount++] = msg;
+		return KEMU_SUCCESS;
+	}
+	kemuDev_deliver(sys, msg);
+	return KEMU_SUCCESS;
+}
+
+/**
+ * @brief Send register write from src to msg.devID
+ * Writes crossing threads are delivered after the current quantum. A worker waits for room in a full outbox,
+ * the main thread drains outboxes at the barrier. Fails only if the main thread can't grow its pending list
+*/
+uint8_t kemuDev_post(KemuSys *sys, const KemuDev *src, const KemuQueue_msg msg){
+	if(src->worker){
+		KemuQueue *outbox = &sys->workers.worker[src->worker - 1].outbox;
+		uint32_t spin = 0;
+		while(kemuQueue_push(outbox, msg) == KEMU_FAIL){
+			kemuWorker_pause(&spin);
+		}
+		return KEMU_SUCCESS;
+	}
+	return kemuDev_send(sys, msg);
+}
+
+/**
+ * @brief Main thread after its quantum, forward the outbox of worker
+ * Writes to main thread devices are delivered, writes to worker devices wait in the pending list
+*/
+static void kemuDev_routeOutbox(KemuSys *sys, KemuWorker *worker){
+	KemuQueue_msg msg;
+	while(kemuQueue_pop(&worker->outbox, &msg) == KEMU_SUCCESS){
+		if(kemuDev_send(sys, msg) == KEMU_FAIL){
+			printf("Worker %u message to device %u was not delivered\n", worker->id, msg.devID);
+		}
+	}
+}
+
+/**
+ * @brief Main thread, wait for workers to finish the quantum while draining their outboxes, then deliver
+ * every pending message. Workers are parked afterwards, so no message is left in flight between quanta
+*/
+void kemuDev_routeMessages(KemuSys *sys){
+	KemuWorker_pool *pool = &sys->workers;
+	uint64_t epoch = atomic_load_explicit(&pool->epoch, memory_order_relaxed);
+	for(uint8_t i=0; i<pool->workerCount; i++){
+		KemuWorker *worker = &pool->worker[i];
+		uint32_t spin = 0;
+		while(atomic_load_explicit(&worker->doneEpoch, memory_order_acquire) < epoch){
+			kemuDev_routeOutbox(sys, worker);
+			kemuWorker_pause(&spin);
+		}
+		kemuDev_routeOutbox(sys, worker);
+	}
+	for(size_t i=0; i<pool->pendingCount; i++){
+		kemuDev_deliver(sys, pool->pending[i]);
+	}
+	pool->pendingCount = 0;
+}
+
+static void *kemuDev_workerMain(void *arg){
+	KemuWorker *worker = arg;
+	KemuSys *sys = worker->sys;
+	KemuWorker_pool *pool = &sys->workers;
+	uint64_t epoch = 0;
+	for(;;){
+		epoch++;
+		kemuWorker_wait(&pool->epoch, epoch);
+		if(atomic_load_explicit(&pool->stop, memory_order_acquire)){
+			break;
+		}
+
+		uint64_t endCycle = atomic_load_explicit(&pool->endCycle, memory_order_relaxed);
+		kemuDev_runSched(sys, &worker->sched, &worker->emuCycle, endCycle, 0);
+
+		atomic_store_explicit(&worker->doneEpoch, epoch, memory_order_release);
+	}
+	return NULL;
+}
+
+/**
+ * @brief Spawn sys->workerCount threads. Falls back to main thread on failure
+*/
+void kemuSys_startWorkers(KemuSys *sys){
+	KemuWorker_pool *pool = &sys->workers;
+	pool->workerCount = 0;
+	pool->nextWorker = 0;
+	atomic_store(&pool->epoch, 0);
+	atomic_store(&pool->stop, 0);
+	pool->pending = NULL;
+	pool->pendingCount = 0;
+	pool->pendingSize = 0;
+	if(sys->workerCount==0){
+		pool->worker = NULL;
+		return;
+	}
+
+	pool->worker = calloc(sys->workerCount, sizeof(KemuWorker));
+	if(NULL_CHECK(pool->worker)){
+		return;
+	}
+	for(uint8_t i=0; i<sys->workerCount; i++){
+		KemuWorker *worker = &pool->worker[i];
+		worker->sys = sys;
+		worker->id = i + 1;
+		worker->emuCycle = sys->emuCycle;
+		kemuSched_init(&worker->sched);
+		if(pthread_create(&worker->thread, NULL, kemuDev_workerMain, worker) != 0){
+			printf("Worker %u failed to start\n", i);
+			break;
+		}
+		pool->workerCount++;
+	}
+}
+
+/**
+ * @brief Join workers, their devices and pending events move to the main thread
+ * Call before devices are freed, so no worker runs a device being freed
+*/
+void kemuSys_stopWorkers(KemuSys *sys){
+	KemuWorker_pool *pool = &sys->workers;
+	atomic_store_explicit(&pool->stop, 1, memory_order_release);
+	atomic_fetch_add_explicit(&pool->epoch, 1, memory_order_release);
+	for(uint8_t i=0; i<pool->workerCount; i++){
+		pthread_join(pool->worker[i].thread, NULL);
+	}
+	uint8_t devCount = kaelTree_length(&sys->dev);
+	for(uint8_t i=0; i<devCount; i++){
+		KemuDev *dev = kaelTree_get(&sys->dev, i);
+		if(dev->worker){
+			KemuWorker *worker = &pool->worker[dev->worker - 1];
+			for(size_t e=0; e<worker->sched.count; e++){
+				if(worker->sched.event[e].devID == dev->devID){
+					kemuSched_push(&sys->sched, worker->sched.event[e].time, dev->devID);
+				}
+			}
+			dev->worker = 0;
 		}
 	}
+	pool->workerCount = 0;
+	free(pool->worker);
+	pool->worker = NULL;
+	free(pool->pending);
+	pool->pending = NULL;
+	pool->pendingCount = 0;
+	pool->pendingSize = 0;
+}
+
+//------ Write-back ------
+
+/**
+ * @brief Exclude the flusher while the device list changes
+*/
+void kemuSys_lockDevices(KemuSys *sys){
+	if(sys->flusher.running){
+		pthread_mutex_lock(&sys->flusher.lock);
+	}
+}
+
+void kemuSys_unlockDevices(KemuSys *sys){
+	if(sys->flusher.running){
+		pthread_mutex_unlock(&sys->flusher.lock);
+	}
+}
+
+/**
+ * @brief Chunks are handed to the files with devices locked, the disk is waited on without the lock
+ * Duplicated descriptors stay valid if a device is freed meanwhile
+*/
+static uint8_t kemuSys_flushDevices(KemuSys *sys, const uint8_t barrier){
+	int syncFd[UINT8_MAX];
+	uint8_t err = KEMU_SUCCESS;
+	kemuSys_lockDevices(sys);
+	uint8_t devCount = kaelTree_length(&sys->dev);
+	for(uint8_t i=0; i<devCount; i++){
+		if(kemuDev_writeBack(kaelTree_get(&sys->dev, i), barrier, &syncFd[i]) == KEMU_FAIL){
+			err = KEMU_FAIL;
+		}
+	}
+	kemuSys_unlockDevices(sys);
+	for(uint8_t i=0; i<devCount; i++){
+		if(kemuDev_sync(syncFd[i]) == KEMU_FAIL){
+			err = KEMU_FAIL;
+		}
+	}
+	return err;
+}
+
+static void *kemuSys_flushMain(void *arg){
+	KemuSys *sys = arg;
+	KemuWorker_flusher *flusher = &sys->flusher;
+	pthread_mutex_lock(&flusher->lock);
+	while(!flusher->stop){
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		uint64_t nsec = deadline.tv_nsec + (uint64_t)(sys->flushMs % 1000) * 1000000;
+		deadline.tv_sec += sys->flushMs / 1000 + nsec / 1000000000;
+		deadline.tv_nsec = nsec % 1000000000;
+		pthread_cond_timedwait(&flusher->wake, &flusher->lock, &deadline);
+		if(!flusher->stop){
+			pthread_mutex_unlock(&flusher->lock);
+			kemuSys_flushDevices(sys, 0);
+			pthread_mutex_lock(&flusher->lock);
+		}
+	}
+	pthread_mutex_unlock(&flusher->lock);
+	return NULL;
+}
+
+/**
+ * @brief Barrier, returns once every FILE_STORE write before the call is synced to its image
+*/
+uint8_t kemuSys_flush(KemuSys *sys){
+	return kemuSys_flushDevices(sys, 1);
 }
 
+/**
+ * @brief Start write-back thread if sys->flushMs is set
+*/
+void kemuSys_startFlusher(KemuSys *sys){
+	KemuWorker_flusher *flusher = &sys->flusher;
+	flusher->running = 0;
+	flusher->stop = 0;
+	if(sys->flushMs == 0){
+		return;
+	}
+	pthread_mutex_init(&flusher->lock, NULL);
+	pthread_cond_init(&flusher->wake, NULL);
+	//Set before the thread starts, it locks devices through running as well
+	flusher->running = 1;
+	if(pthread_create(&flusher->thread, NULL, kemuSys_flushMain, sys) != 0){
+		printf("Flusher failed to start\n");
+		flusher->running = 0;
+		pthread_cond_destroy(&flusher->wake);
+		pthread_mutex_destroy(&flusher->lock);
+	}
+}
 
+void kemuSys_stopFlusher(KemuSys *sys){
+	KemuWorker_flusher *flusher = &sys->flusher;
+	if(!flusher->running){
+		return;
+	}
+	pthread_mutex_lock(&flusher->lock);
+	flusher->stop = 1;
+	pthread_cond_signal(&flusher->wake);
+	pthread_mutex_unlock(&flusher->lock);
+	pthread_join(flusher->thread, NULL);
+	pthread_cond_destroy(&flusher->wake);
+	pthread_mutex_destroy(&flusher->lock);
+	flusher->running = 0;
+}
 
  /**
  * @brief Allocate and add devices to dev list
+ * Nonzero newDev->devID is kept if unused
 */
 void kemuSys_pushDev(KemuSys *sys, KemuDev *newDev){
+	KemuSys_devRegistry *reg = &sys->devReg;
+	const size_t devIndex = kaelTree_length(&sys->dev);
+	if(newDev->head.type >= DEV_TYPE_COUNT || devIndex >= KEMU_DEV_MAX - 1){
+		return;
+	}
+
+	//Keep requested ID if free, otherwise first set bit of the free ID bitmap
+	uint16_t devID = newDev->devID;
+	if(devID >= KEMU_DEV_MAX || !(reg->freeID[devID/64] & (1ULL << (devID%64)))){
+		devID = 0;
+		for(uint16_t i=0; i<KEMU_DEV_MAX/64; i++){
+			if(reg->freeID[i]){
+				devID = i*64 + __builtin_ctzll(reg->freeID[i]);
+				break;
+			}
+		}
+	}
+	if(devID == 0){
+		return;
+	}
+
 	//Each device contains data which must be allocated and freed. 
 	//Tree takes the memory ownership
 	if( kemuDev_alloc(newDev) == KEMU_FAIL ){
 		return;
 	};
+	newDev->devID = devID;
+	newDev->worker = 0;
 
-	//Generate device ID
-	const uint8_t devCount = kaelTree_length(&sys->dev);
-	
-	//List all used IDs
-	uint8_t usedList[devCount];
-	for(uint16_t i=0; i<devCount; i++){
+	//Dirty chunks line up with frames only if banks are whole pages
+	newDev->dirty = NULL;
+	if(newDev->head.bankSize && newDev->head.bankSize % KEMU_PAGE_SIZE == 0){
+		size_t chunkCount = kemuDev_residentWords(newDev) >> KEMU_PAGE_SHIFT;
+		newDev->dirty = malloc(chunkCount);
+		if(newDev->dirty){
+			//Image file contents are already on disk
+			memset(newDev->dirty, KEMU_DIRTY_ALL & ~FLUSH_DIRTY, chunkCount);
+		}
+	}
+	KemuWorker_pool *pool = &sys->workers;
+	if(pool->workerCount && kemuDev_isThreaded(newDev->head.type)){
+		newDev->worker = pool->nextWorker % pool->workerCount + 1;
+		pool->nextWorker++;
+	}
+	kemuSys_lockDevices(sys);
+	kaelTree_push(&sys->dev, newDev);
+	kemuSys_unlockDevices(sys);
+
+	reg->freeID[devID/64] &= ~(1ULL << (devID%64));
+	reg->slot[devID] = devIndex + 1;
+	reg->typeIndex[newDev->head.type][reg->typeCount[newDev->head.type]++] = devIndex;
+
+	//First event lets the device pick its rate, passive devices go idle
+	kemuDev_schedule(sys, newDev, 0);
+}
+
+/**
+ * @brief Drop decoded instructions of frames in host range [start, end)
+*/
+void kemuSys_dropRange(KemuSys *sys, const uint16_t *start, const uint16_t *end){
+	for(uint16_t i=0; i<sys->mapPageCount; i++){
+		if((sys->frameAttr[i] & CODE_FRAME) && sys->frameTable[i] >= start && sys->frameTable[i] < end){
+			kemuSys_dropCode(sys, i);
+		}
+	}
+}
+
+/**
+ * @brief Check a page table row maps bank of dev
+*/
+static uint8_t kemuSys_bankMapped(const KemuSys *sys, const KemuDev *dev, const uint32_t bank){
+	for(uint16_t i=0; i<KEMU_PAGE_ROWS; i++){
+		KemuSys_pageEntry row = sys->pageTable[i];
+		if(row.devID == dev->devID && bank >= row.firstBank && bank <= row.lastBank){
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * @brief First device whose contents are not all machine state, NULL if none
+ * Snapshots, rewind and machine images refuse such machines, restoring them would leave its contents as they are
+*/
+KemuDev *kemuSys_streamedDev(const KemuSys *sys){
+	uint8_t devCount = kaelTree_length(&sys->dev);
+	for(uint8_t i=0; i<devCount; i++){
 		KemuDev *curDev = kaelTree_get(&sys->dev, i);
-		usedList[i] = curDev->devID;
+		if(kemuDev_stateWords(curDev) != curDev->head.bankSize * curDev->head.bankCount){
+			return curDev;
+		}
 	}
+	return NULL;
+}
 
-	//Find first unused ID
-	for (uint16_t i=1; i!=0; i++) {
-		uint8_t isUsed = 0;
-		for (uint8_t j=0; j<devCount; j++) {
-			if (usedList[j] == i) {
-				isUsed = 1;
-				break;
-			}
+/**
+ * @brief Resident bank of a STREAM_STORE device, loaded over the least recently mapped unmapped slot
+ * NULL if every slot holds a mapped bank
+*/
+uint16_t *kemuSys_streamBank(KemuSys *sys, KemuDev *dev, const uint32_t bank){
+	KemuDev_cache *cache = &dev->cache;
+	if(dev->bank[bank]){
+		cache->slot[(dev->bank[bank] - dev->data) / dev->head.bankSize].lastUse = ++cache->clock;
+		return dev->bank[bank];
+	}
+
+	uint32_t victim = KEMU_SLOT_EMPTY;
+	for(uint32_t i=0; i<cache->slotCount; i++){
+		KemuDev_slot *cur = &cache->slot[i];
+		if(cur->bank != KEMU_SLOT_EMPTY && kemuSys_bankMapped(sys, dev, cur->bank)){
+			continue;
 		}
-		if (!isUsed) {
-				newDev->devID = i;
-		break;
+		if(victim == KEMU_SLOT_EMPTY || cur->lastUse < cache->slot[victim].lastUse){
+			victim = i;
 		}
+		if(cur->bank == KEMU_SLOT_EMPTY){
+			break;
+		}
+	}
+	if(victim == KEMU_SLOT_EMPTY){
+		printf("Bank cache of device %u is full\n", dev->devID);
+		return NULL;
 	}
 
-	kaelTree_push(&sys->dev, newDev);
+	//Frames of rows being remapped may still point into the slot
+	uint16_t *slotData = dev->data + victim * dev->head.bankSize;
+	kemuSys_dropRange(sys, slotData, slotData + dev->head.bankSize);
+
+	kemuSys_lockDevices(sys);
+	uint16_t *bankData = kemuDev_fillSlot(dev, victim, bank);
+	kemuSys_unlockDevices(sys);
+	return bankData;
+}
+
+/**
+ * @brief Zero banks of dev and return their host memory, decoded instructions in them are dropped
+*/
+uint8_t kemuSys_resetBanks(KemuSys *sys, KemuDev *dev, const size_t firstBank, const size_t count){
+	if(kemuDev_resetBanks(dev, firstBank, count) == KEMU_FAIL){
+		return KEMU_FAIL;
+	}
+	for(size_t b=firstBank; b<firstBank + count; b++){
+		if(dev->bank[b]){
+			kemuSys_dropRange(sys, dev->bank[b], dev->bank[b] + dev->head.bankSize);
+		}
+	}
+	return KEMU_SUCCESS;
+}
+
+/**
+ * @brief Free last device and release its ID
+*/
+void kemuSys_popDev(KemuSys *sys){
+	KemuSys_devRegistry *reg = &sys->devReg;
+	KemuDev *lastDev = (KemuDev*)kaelTree_back(&sys->dev);
+	if(lastDev == NULL){
+		return;
+	}
+	//Last device is also last of its type
+	reg->typeCount[lastDev->head.type]--;
+	reg->slot[lastDev->devID] = 0;
+	reg->freeID[lastDev->devID/64] |= 1ULL << (lastDev->devID%64);
+	kemuDev_unschedule(sys, lastDev);
+
+	kemuSys_lockDevices(sys);
+	kemuDev_free(lastDev);
+	free(lastDev->dirty);
+	lastDev->dirty = NULL;
+	kaelTree_pop(&sys->dev);
+	kemuSys_unlockDevices(sys);
 }
 
 void kemuSys_initDevices(KemuSys *sys){
@@ -176,8 +1134,9 @@ void kemuSys_initDevices(KemuSys *sys){
 		.isROM		=	1,
 		.type			=	DATA_DEV,
 	};
+	//Held in memory, the boot loader is flashed into it on every boot
 	KemuDev sysROM = {
-		.path = "disk/rom.img",
+		.path = NULL,
 		.fd = -1,
 		.head = sysROMHeader,
 	};
@@ -208,10 +1167,50 @@ void kemuSys_initDevices(KemuSys *sys){
 		.path = "disk/disk.img",
 		.fd = -1,
 		.head = dataDiskHeader,
+		.cache = { .slotCount = sys->diskCacheBanks },
+	};
+
+	//Command devices take a whole window slice, smaller banks are not mapped under KEMU_FLAT_VAS
+	size_t ioWords = KEMU_PAGE_SIZE;
+	#if KEMU_FLAT_VAS
+		ioWords *= sys->slicePages;
+	#endif
+
+	//Block controller, registers fill the first page
+	KemuDev_head blockCtlHeader = {
+		.bankSize	=	ioWords,
+		.bankCount	=	1,
+		.isROM		=	0,
+		.type			=	BLOCK_DEV,
 	};
+	KemuDev blockCtl = {
+		.path = NULL,
+		.fd = -1,
+		.head = blockCtlHeader,
+	};
+
+	//DMA engine
+	KemuDev_head dmaCtlHeader = {
+		.bankSize	=	ioWords,
+		.bankCount	=	1,
+		.isROM		=	0,
+		.type			=	DMA_DEV,
+	};
+	KemuDev dmaCtl = {
+		.path = NULL,
+		.fd = -1,
+		.head = dmaCtlHeader,
+	};
+
+	if(sys->diskOverlay){
+		dataDisk.basePath = dataDisk.path;
+		dataDisk.path = sys->diskOverlay;
+	}
 
 	kemuSys_pushDev(sys, &sysCPU);
 	kemuSys_pushDev(sys, &sysRAM);
 	kemuSys_pushDev(sys, &sysROM);
 	kemuSys_pushDev(sys, &dataDisk);
+	kemuSys_pushDev(sys, &blockCtl);
+	kemuSys_pushDev(sys, &dmaCtl);
 }
\ No newline at end of file
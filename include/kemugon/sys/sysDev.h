@@ -14,6 +14,11 @@ typedef enum{
 	ADD_MBC,
 }KemuDev_flagMBC;
 
+//Executions of a decoded instruction before it is checked for superinstruction fusion, 0 = never fuse
+#ifndef KEMU_FUSE_HEAT
+	#define KEMU_FUSE_HEAT 16U
+#endif
+
 typedef enum{
 	CARRY_CPU		= 0b00000001,
 	OVERFLOW_CPU	= 0b00000010,
@@ -22,8 +27,39 @@ typedef enum{
 KemuDev *kemuDev_devByID(const KemuSys *sys, const uint16_t devID);
 KemuDev *kemuDev_devByType(const KemuSys *sys, const uint16_t devType, uint8_t n);
 
-void kemuDev_runCPU(KemuSys *sys, KemuDev *dev);
-void kemuDev_run(KemuSys *sys);
+uint16_t kemuDev_aluFlags(const uint16_t op, const uint16_t dst, const uint16_t src);
+uint16_t kemuDev_flagsCPU(KemuDev_CPU *cpu);
+void kemuSys_settleFlags(const KemuSys *sys);
+void kemuDev_decodeCPU(KemuSys *sys, const uint16_t pc, KemuCache_entry *entry);
+uint8_t kemuDev_fuseHead(const uint8_t op);
+uint8_t kemuDev_fuseCPU(KemuSys *sys, const uint16_t pc);
+uint64_t kemuDev_runCPU(KemuSys *sys, KemuDev *dev, const uint64_t cycleBudget);
+void kemuDev_runMBC(KemuSys *sys);
+uint64_t kemuJit_run(KemuSys *sys, KemuDev *dev, const uint64_t cycleBudget);
+uint64_t kemuDev_event(KemuSys *sys, KemuDev *dev, const uint64_t tickBudget);
+void kemuDev_schedule(KemuSys *sys, const KemuDev *dev, const uint64_t delay);
+void kemuDev_unschedule(KemuSys *sys, const KemuDev *dev);
+uint64_t kemuDev_run(KemuSys *sys, const uint64_t cycleBudget);
+
+uint8_t kemuDev_post(KemuSys *sys, const KemuDev *src, const KemuQueue_msg msg);
+void kemuDev_routeMessages(KemuSys *sys);
+uint8_t kemuDev_isCommand(const uint8_t devType);
+void kemuDev_ioStatus(KemuSys *sys, KemuDev *dev, const uint16_t status);
+void kemuDev_ioTrap(KemuSys *sys, const uint16_t addr);
+
+void kemuSys_startWorkers(KemuSys *sys);
+void kemuSys_stopWorkers(KemuSys *sys);
+
+void kemuSys_lockDevices(KemuSys *sys);
+void kemuSys_unlockDevices(KemuSys *sys);
+uint8_t kemuSys_flush(KemuSys *sys);
+void kemuSys_startFlusher(KemuSys *sys);
+void kemuSys_stopFlusher(KemuSys *sys);
 
 void kemuSys_pushDev(KemuSys *sys, KemuDev *newDev);
+void kemuSys_popDev(KemuSys *sys);
+void kemuSys_dropRange(KemuSys *sys, const uint16_t *start, const uint16_t *end);
+KemuDev *kemuSys_streamedDev(const KemuSys *sys);
+uint16_t *kemuSys_streamBank(KemuSys *sys, KemuDev *dev, const uint32_t bank);
+uint8_t kemuSys_resetBanks(KemuSys *sys, KemuDev *dev, const size_t firstBank, const size_t count);
 void kemuSys_initDevices(KemuSys *sys);
\ No newline at end of file
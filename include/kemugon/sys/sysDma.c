@@ -0,0 +1,89 @@
+/**
+ * @file sysDma.c
+ *
+ * @brief Implementation, DMA engine copying and filling VAS a frame run at a time
+ *
+ * Runs are split where the source or destination crosses a page, each is one memmove or fill of frameTable frames.
+ * Data moves when the command is written, the status turns DONE_STATUS after the emulated transfer time.
+ */
+
+#include "kemugon/sys/sysDma.h"
+#include "kemugon/sys/sysDev.h"
+
+/**
+ * @brief Copy run of n words within one source and one destination page
+*/
+static void kemuDma_copyRun(KemuSys *sys, const uint16_t dst, const uint16_t src, const uint16_t n, const uint8_t backward){
+	uint16_t *to = kemuSys_storeRun(sys, dst);
+	if(to){
+		memmove(to, kemuSys_vasPtr(sys, src), n * sizeof(uint16_t));
+		kemuSys_markDirty(sys, dst >> KEMU_PAGE_SHIFT);
+		return;
+	}
+	for(uint16_t i=0; i<n; i++){
+		uint16_t k = backward ? n - 1 - i : i;
+		kemuSys_storeVAS(sys, dst + k, kemuSys_vasRead(sys, src + k));
+	}
+}
+
+/**
+ * @brief memmove within VAS, runs go backward if dst overlaps the tail of src
+*/
+static void kemuDma_copy(KemuSys *sys, const uint16_t dst, const uint16_t src, const uint32_t length){
+	uint8_t backward = dst != src && (uint16_t)(dst - src) < length;
+	uint32_t done = 0;
+	while(done < length){
+		uint32_t left = length - done;
+		if(!backward){
+			uint16_t s = src + done;
+			uint16_t d = dst + done;
+			uint16_t n = kaelMath_min(left, kaelMath_min(kemuSys_pageLeft(s), kemuSys_pageLeft(d)));
+			kemuDma_copyRun(sys, d, s, n, 0);
+			done += n;
+		}else{
+			//Last word of the remaining range and the words before it in the same page
+			uint16_t sEnd = src + left - 1;
+			uint16_t dEnd = dst + left - 1;
+			uint16_t n = kaelMath_min(left, kaelMath_min((sEnd & KEMU_PAGE_MASK) + 1U, (dEnd & KEMU_PAGE_MASK) + 1U));
+			kemuDma_copyRun(sys, dEnd - n + 1, sEnd - n + 1, n, 1);
+			done += n;
+		}
+	}
+}
+
+/**
+ * @brief Command register written. Moves the data and schedules completion after the emulated transfer time
+*/
+void kemuDev_dmaCommand(KemuSys *sys, KemuDev *dev){
+	KemuDev_dma *reg = (void *)dev->bank[0];
+	uint16_t command = reg->io.command;
+	reg->io.command = NONE_DMA;
+	if(reg->io.status == BUSY_STATUS){
+		return;
+	}
+	switch(command){
+		case COPY_DMA:
+			kemuDma_copy(sys, reg->dst, reg->src, reg->length);
+			break;
+
+		case FILL_DMA:
+			kemuSys_fillVAS(sys, reg->dst, reg->fill, reg->length);
+			break;
+
+		default:
+			return;
+	}
+	kemuDev_ioStatus(sys, dev, BUSY_STATUS);
+	kemuDev_schedule(sys, dev, reg->length / KEMU_DMA_WORDS_PER_CYCLE + 1);
+}
+
+/**
+ * @brief Completion event
+*/
+uint64_t kemuDev_runDma(KemuSys *sys, KemuDev *dev){
+	KemuDev_dma *reg = (void *)dev->bank[0];
+	if(reg->io.status == BUSY_STATUS){
+		kemuDev_ioStatus(sys, dev, DONE_STATUS);
+	}
+	return 0;
+}
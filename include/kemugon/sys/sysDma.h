@@ -0,0 +1,17 @@
+/**
+ * @file sysDma.h
+ * 
+ * @brief Header, DMA engine copying and filling VAS a frame run at a time
+ */
+#pragma once
+
+#include "kemugon/sys/sys.h"
+#include "kemugon/dev/dev.h"
+
+//Emulated bus throughput, completion is due after length / KEMU_DMA_WORDS_PER_CYCLE + 1
+#ifndef KEMU_DMA_WORDS_PER_CYCLE
+	#define KEMU_DMA_WORDS_PER_CYCLE 4U
+#endif
+
+void kemuDev_dmaCommand(KemuSys *sys, KemuDev *dev);
+uint64_t kemuDev_runDma(KemuSys *sys, KemuDev *dev);
@@ -0,0 +1,229 @@
+/**
+ * @file sysImage.c
+ *
+ * @brief Implementation, versioned warm-boot machine image mapped MAP_PRIVATE on load
+ *
+ * Layout: KemuImage_head, device records, then device data each starting on a host page.
+ * Loaded devices point straight into the private mapping, guest writes never reach the file.
+ */
+
+#include <sys/stat.h>
+#include <stdio.h>
+
+#include "kemugon/sys/sysImage.h"
+#include "kemugon/sys/sysDev.h"
+
+/**
+ * @brief Pending event time of devID in sched, UINT64_MAX if none
+*/
+static uint64_t kemuImage_nextEvent(const KemuSched *sched, const uint8_t devID, uint64_t time){
+	for(size_t i=0; i<sched->count; i++){
+		if(sched->event[i].devID == devID){
+			time = kaelMath_min(time, sched->event[i].time);
+		}
+	}
+	return time;
+}
+
+/**
+ * @brief Write machine state to path. Written to path.tmp first, then renamed over path
+ * Call between quanta. Fails if a device is streamed, its contents are not part of the state
+*/
+uint8_t kemuSys_saveImage(const KemuSys *sys, const char *path){
+	if(NULL_CHECK(sys) || NULL_CHECK(path)){
+		return KEMU_FAIL;
+	}
+	KemuDev *streamed = kemuSys_streamedDev(sys);
+	if(streamed){
+		printf("Device %u is streamed, no machine image written\n", streamed->devID);
+		return KEMU_FAIL;
+	}
+	uint64_t hostPage = sysconf(_SC_PAGESIZE);
+	uint32_t devCount = kaelTree_length(&sys->dev);
+	kemuSys_settleFlags(sys);
+	size_t headSize = sizeof(KemuImage_head) + devCount * sizeof(KemuImage_dev);
+	KemuImage_head *head = calloc(1, headSize);
+	if(NULL_CHECK(head)){
+		return KEMU_FAIL;
+	}
+
+	memcpy(head->magic, KEMU_IMAGE_MAGIC, sizeof(KEMU_IMAGE_MAGIC));
+	head->version = KEMU_IMAGE_VERSION;
+	head->pageShift = KEMU_PAGE_SHIFT;
+	head->emuCycle = sys->emuCycle;
+	head->insRetired = sys->insRetired;
+	memcpy(head->pageTable, sys->pageTable, sizeof(head->pageTable));
+	head->devCount = devCount;
+
+	uint64_t offset = kemuDev_align(headSize, hostPage);
+	for(uint32_t i=0; i<devCount; i++){
+		KemuDev *curDev = kaelTree_get(&sys->dev, i);
+		uint64_t nextEvent = kemuImage_nextEvent(&sys->sched, curDev->devID, UINT64_MAX);
+		for(uint8_t j=0; j<sys->workers.workerCount; j++){
+			nextEvent = kemuImage_nextEvent(&sys->workers.worker[j].sched, curDev->devID, nextEvent);
+		}
+		head->dev[i] = (KemuImage_dev){
+			.bankSize	= curDev->head.bankSize,
+			.bankCount	= curDev->head.bankCount,
+			.dataOffset	= offset,
+			.nextEvent	= nextEvent,
+			.clockDiv	= curDev->clockDiv,
+			.devID		= curDev->devID,
+			.type			= curDev->head.type,
+			.isROM		= curDev->head.isROM,
+		};
+		offset = kemuDev_align(offset + curDev->head.bankSize * curDev->head.bankCount * sizeof(uint16_t), hostPage);
+	}
+	head->fileSize = offset;
+
+	char tmpPath[PATH_MAX];
+	snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", path);
+	int fd = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if(fd < 0){
+		perror("Failed to create machine image");
+		free(head);
+		return KEMU_FAIL;
+	}
+
+	uint8_t err = KEMU_SUCCESS;
+	if(ftruncate(fd, head->fileSize) < 0 || kemuDev_write(fd, head, headSize, 0) == KEMU_FAIL){
+		err = KEMU_FAIL;
+	}
+	for(uint32_t i=0; err==KEMU_SUCCESS && i<devCount; i++){
+		KemuDev *curDev = kaelTree_get(&sys->dev, i);
+		size_t size = curDev->head.bankSize * curDev->head.bankCount * sizeof(uint16_t);
+		err = kemuDev_write(fd, curDev->data, size, head->dev[i].dataOffset);
+	}
+	close(fd);
+	free(head);
+
+	if(err == KEMU_FAIL || rename(tmpPath, path) < 0){
+		perror("Failed to write machine image");
+		unlink(tmpPath);
+		return KEMU_FAIL;
+	}
+	return KEMU_SUCCESS;
+}
+
+/**
+ * @brief Check header and that every device lies within the file
+*/
+static uint8_t kemuImage_valid(const KemuImage_head *head, const size_t size){
+	uint64_t hostPage = sysconf(_SC_PAGESIZE);
+	if(size < sizeof(KemuImage_head) || memcmp(head->magic, KEMU_IMAGE_MAGIC, sizeof(KEMU_IMAGE_MAGIC)) != 0){
+		return 0;
+	}
+	if(head->version != KEMU_IMAGE_VERSION || head->pageShift != KEMU_PAGE_SHIFT || head->fileSize != size){
+		return 0;
+	}
+	if(head->devCount >= KEMU_DEV_MAX || sizeof(KemuImage_head) + head->devCount * sizeof(KemuImage_dev) > size){
+		return 0;
+	}
+	for(uint32_t i=0; i<head->devCount; i++){
+		const KemuImage_dev *rec = &head->dev[i];
+		if(rec->bankSize == 0 || rec->bankSize > size || rec->bankCount > size){
+			return 0;
+		}
+		//Frames point into device data, banks are whole pages. A single smaller bank holds registers and is never mapped
+		if(rec->bankSize % KEMU_PAGE_SIZE && (rec->bankCount != 1 || rec->bankSize > KEMU_PAGE_SIZE)){
+			return 0;
+		}
+		if(rec->dataOffset % hostPage || rec->dataOffset > size){
+			return 0;
+		}
+		if(rec->bankCount > (size - rec->dataOffset) / (rec->bankSize * sizeof(uint16_t))){
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/**
+ * @brief Resume machine from image at path instead of booting. sys must be allocated with no devices
+ * Devices keep their IDs and contents, writes go to private copies of the mapped pages
+ * Missing images and ones written by an incompatible build fail before sys is modified
+*/
+uint8_t kemuSys_loadImage(KemuSys *sys, const char *path){
+	if(NULL_CHECK(sys) || NULL_CHECK(path) || !kaelTree_empty(&sys->dev)){
+		return KEMU_FAIL;
+	}
+	int fd = open(path, O_RDONLY);
+	if(fd < 0){
+		return KEMU_FAIL;
+	}
+	struct stat st;
+	if(fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(KemuImage_head)){
+		close(fd);
+		return KEMU_FAIL;
+	}
+	size_t size = st.st_size;
+	void *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(base == MAP_FAILED){
+		return KEMU_FAIL;
+	}
+	const KemuImage_head *head = base;
+	if(!kemuImage_valid(head, size)){
+		printf("Incompatible machine image %s\n", path);
+		munmap(base, size);
+		return KEMU_FAIL;
+	}
+
+	sys->imageBase = base;
+	sys->imageSize = size;
+	sys->emuCycle = head->emuCycle;
+	sys->insRetired = head->insRetired;
+	for(uint8_t i=0; i<sys->workers.workerCount; i++){
+		sys->workers.worker[i].emuCycle = head->emuCycle;
+	}
+
+	for(uint32_t i=0; i<head->devCount; i++){
+		const KemuImage_dev *rec = &head->dev[i];
+		KemuDev imageDev = {
+			.devID = rec->devID,
+			.path = NULL,
+			.fd = -1,
+			.clockDiv = rec->clockDiv,
+			.head = {
+				.bankSize	= rec->bankSize,
+				.bankCount	= rec->bankCount,
+				.isROM		= rec->isROM,
+				.type			= rec->type,
+			},
+		};
+		uint16_t *data = (uint16_t *)((uint8_t *)base + rec->dataOffset);
+		#if KEMU_FLAT_VAS
+			//Window slices alias device memfds, copy instead
+			kemuSys_pushDev(sys, &imageDev);
+			KemuDev *newDev = kemuDev_devByID(sys, rec->devID);
+			if(newDev){
+				memcpy(newDev->data, data, rec->bankSize * rec->bankCount * sizeof(uint16_t));
+			}
+		#else
+			imageDev.store = IMAGE_STORE;
+			imageDev.data = data;
+			kemuSys_pushDev(sys, &imageDev);
+			KemuDev *newDev = kemuDev_devByID(sys, rec->devID);
+		#endif
+		if(newDev == NULL){
+			printf("Machine image device %u failed\n", rec->devID);
+			return KEMU_FAIL;
+		}
+
+		//Resume the saved event instead of the one given on push
+		kemuDev_unschedule(sys, newDev);
+		if(rec->nextEvent != UINT64_MAX){
+			kemuDev_schedule(sys, newDev, kaelMath_max(rec->nextEvent, head->emuCycle) - head->emuCycle);
+		}
+	}
+
+	memcpy(sys->pageTable, head->pageTable, sizeof(head->pageTable));
+	kemuSys_mapFrameTable(sys);
+
+	#if KEMU_FLAT_VAS
+		munmap(base, size);
+		sys->imageBase = NULL;
+		sys->imageSize = 0;
+	#endif
+	return KEMU_SUCCESS;
+}
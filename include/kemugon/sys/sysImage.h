@@ -0,0 +1,44 @@
+/**
+ * @file sysImage.h
+ * 
+ * @brief Header, versioned warm-boot machine image mapped MAP_PRIVATE on load
+ */
+#pragma once
+
+#include "kemugon/sys/sys.h"
+#include "kemugon/dev/dev.h"
+
+#define KEMU_IMAGE_MAGIC "KEMUIMG"
+#define KEMU_IMAGE_VERSION 2U
+
+/**
+ * @brief Device record, data is at host page aligned dataOffset
+*/
+typedef struct{
+	uint64_t bankSize;
+	uint64_t bankCount;
+	uint64_t dataOffset;
+	uint64_t nextEvent; //Absolute emu-cycle, UINT64_MAX = idle
+	uint16_t clockDiv;
+	uint8_t devID;
+	uint8_t type;
+	uint8_t isROM;
+}KemuImage_dev;
+
+/**
+ * @brief File header, followed by devCount device records
+*/
+typedef struct{
+	char magic[8];
+	uint32_t version;
+	uint32_t pageShift; //KEMU_PAGE_SHIFT of the writer
+	uint64_t fileSize;
+	uint64_t emuCycle;
+	uint64_t insRetired;
+	KemuSys_pageEntry pageTable[KEMU_PAGE_ROWS];
+	uint32_t devCount;
+	KemuImage_dev dev[];
+}KemuImage_head;
+
+uint8_t kemuSys_saveImage(const KemuSys *sys, const char *path);
+uint8_t kemuSys_loadImage(KemuSys *sys, const char *path);
@@ -0,0 +1,224 @@
+/**
+ * @file sysProg.c
+ *
+ * @brief Implementation, sectioned guest program image mapped straight into VAS
+ *
+ * Layout: KemuProg_head, section records, then section data each starting on a host page.
+ * The file is mapped MAP_PRIVATE once, each section becomes an IMAGE_STORE device whose banks are rows of the page table.
+ * ROM sections are mapped read-only and stay shared with the page cache, writable ones are copied on first write.
+ */
+
+#include <sys/stat.h>
+#include <stdio.h>
+
+#include "kemugon/sys/sysProg.h"
+#include "kemugon/sys/sysDev.h"
+
+/**
+ * @brief Write program image to path, data[i] holds bankSize * bankCount words of section[i]
+ * dataOffset of the given sections is ignored. Written to path.tmp first, then renamed over path
+ * so machines still running the old image keep their mapping
+*/
+uint8_t kemuProg_save(const char *path, const uint16_t entry, const KemuProg_section *section, const uint16_t *const *data, const uint32_t sectionCount){
+	if(NULL_CHECK(path) || (sectionCount && (NULL_CHECK(section) || NULL_CHECK(data)))){
+		return KEMU_FAIL;
+	}
+	uint64_t hostPage = sysconf(_SC_PAGESIZE);
+	size_t headSize = sizeof(KemuProg_head) + sectionCount * sizeof(KemuProg_section);
+	KemuProg_head *head = calloc(1, headSize);
+	if(NULL_CHECK(head)){
+		return KEMU_FAIL;
+	}
+
+	memcpy(head->magic, KEMU_PROG_MAGIC, sizeof(KEMU_PROG_MAGIC));
+	head->version = KEMU_PROG_VERSION;
+	head->pageShift = KEMU_PAGE_SHIFT;
+	head->entry = entry;
+	head->sectionCount = sectionCount;
+
+	uint64_t offset = kemuDev_align(headSize, hostPage);
+	for(uint32_t i=0; i<sectionCount; i++){
+		head->section[i] = section[i];
+		head->section[i].dataOffset = offset;
+		offset = kemuDev_align(offset + section[i].bankSize * section[i].bankCount * sizeof(uint16_t), hostPage);
+	}
+	head->fileSize = offset;
+
+	char tmpPath[PATH_MAX];
+	snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", path);
+	int fd = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if(fd < 0){
+		perror("Failed to create program image");
+		free(head);
+		return KEMU_FAIL;
+	}
+
+	uint8_t err = KEMU_SUCCESS;
+	if(ftruncate(fd, head->fileSize) < 0 || kemuDev_write(fd, head, headSize, 0) == KEMU_FAIL){
+		err = KEMU_FAIL;
+	}
+	for(uint32_t i=0; err==KEMU_SUCCESS && i<sectionCount; i++){
+		size_t size = section[i].bankSize * section[i].bankCount * sizeof(uint16_t);
+		err = kemuDev_write(fd, data[i], size, head->section[i].dataOffset);
+	}
+	close(fd);
+	free(head);
+
+	if(err == KEMU_FAIL || rename(tmpPath, path) < 0){
+		perror("Failed to write program image");
+		unlink(tmpPath);
+		return KEMU_FAIL;
+	}
+	return KEMU_SUCCESS;
+}
+
+/**
+ * @brief Check header and that every section is a mappable device lying within the file
+*/
+static uint8_t kemuProg_valid(const KemuProg_head *head, const size_t size){
+	uint64_t hostPage = sysconf(_SC_PAGESIZE);
+	if(size < sizeof(KemuProg_head) || memcmp(head->magic, KEMU_PROG_MAGIC, sizeof(KEMU_PROG_MAGIC)) != 0){
+		return 0;
+	}
+	if(head->version != KEMU_PROG_VERSION || head->pageShift != KEMU_PAGE_SHIFT || head->fileSize != size){
+		return 0;
+	}
+	if(head->sectionCount >= KEMU_DEV_MAX || sizeof(KemuProg_head) + head->sectionCount * sizeof(KemuProg_section) > size){
+		return 0;
+	}
+	for(uint32_t i=0; i<head->sectionCount; i++){
+		const KemuProg_section *rec = &head->section[i];
+		if(rec->type != RAM_DEV && rec->type != DATA_DEV){
+			return 0;
+		}
+		//Frames point into section data, banks must be whole pages
+		if(rec->bankSize == 0 || rec->bankSize % KEMU_PAGE_SIZE || rec->bankSize > size || rec->bankCount > size){
+			return 0;
+		}
+		if(rec->row >= KEMU_PAGE_ROWS || rec->map.firstBank > rec->map.lastBank || rec->map.lastBank >= rec->bankCount){
+			return 0;
+		}
+		uint64_t bytes = rec->bankSize * rec->bankCount * sizeof(uint16_t);
+		if(rec->dataOffset % hostPage || rec->dataOffset > size || bytes > size - rec->dataOffset){
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/**
+ * @brief Map program image at path into VAS and start the CPU at its entry
+ * Section devices are pushed after the existing ones and their rows replace the page table rows given
+ * Fails before sys is modified if the image is missing or written by an incompatible build
+*/
+uint8_t kemuSys_loadProgram(KemuSys *sys, const char *path){
+	if(NULL_CHECK(sys) || NULL_CHECK(path) || sys->progBase || sys->progDevCount){
+		return KEMU_FAIL;
+	}
+	int fd = open(path, O_RDONLY);
+	if(fd < 0){
+		return KEMU_FAIL;
+	}
+	struct stat st;
+	if(fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(KemuProg_head)){
+		close(fd);
+		return KEMU_FAIL;
+	}
+	size_t size = st.st_size;
+	void *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(base == MAP_FAILED){
+		return KEMU_FAIL;
+	}
+	const KemuProg_head *head = base;
+	if(!kemuProg_valid(head, size)){
+		printf("Incompatible program image %s\n", path);
+		munmap(base, size);
+		return KEMU_FAIL;
+	}
+	sys->progBase = base;
+	sys->progSize = size;
+
+	for(uint32_t i=0; i<head->sectionCount; i++){
+		const KemuProg_section *rec = &head->section[i];
+		KemuDev sectionDev = {
+			.devID = rec->map.devID,
+			.path = NULL,
+			.fd = -1,
+			.head = {
+				.bankSize	= rec->bankSize,
+				.bankCount	= rec->bankCount,
+				.isROM		= rec->flags & ROM_SECTION,
+				.type			= rec->type,
+			},
+		};
+		uint16_t *data = (uint16_t *)((uint8_t *)base + rec->dataOffset);
+		size_t bytes = rec->bankSize * rec->bankCount * sizeof(uint16_t);
+		size_t devCount = kaelTree_length(&sys->dev);
+		#if KEMU_FLAT_VAS
+			//Window slices alias device memfds, copy instead
+			kemuSys_pushDev(sys, &sectionDev);
+			if(kaelTree_length(&sys->dev) > devCount){
+				memcpy(((KemuDev *)kaelTree_back(&sys->dev))->data, data, bytes);
+			}
+		#else
+			if((rec->flags & ROM_SECTION) && mprotect(data, bytes, PROT_READ) < 0){
+				perror("Failed to protect ROM section");
+			}
+			sectionDev.store = IMAGE_STORE;
+			sectionDev.data = data;
+			kemuSys_pushDev(sys, &sectionDev);
+		#endif
+		if(kaelTree_length(&sys->dev) == devCount){
+			printf("Program section %u failed\n", i);
+			kemuSys_unloadProgram(sys);
+			return KEMU_FAIL;
+		}
+		sys->progDevCount++;
+
+		KemuSys_pageEntry entry = rec->map;
+		entry.devID = ((KemuDev *)kaelTree_back(&sys->dev))->devID;
+		kemuSys_setRow(sys, rec->row, entry);
+		kemuSys_writeRow(sys, rec->row, entry);
+	}
+
+	//A CPU stopped by TRM of the previous program is rescheduled as well
+	KemuDev *cpu = kemuDev_devByType(sys, CPU_DEV, 0);
+	if(cpu && cpu->bank[0]){
+		((KemuDev_CPU *)cpu->bank[0])->pc = head->entry;
+		kemuDev_schedule(sys, cpu, 0);
+	}
+
+	#if KEMU_FLAT_VAS
+		munmap(base, size);
+		sys->progBase = NULL;
+		sys->progSize = 0;
+	#endif
+	return KEMU_SUCCESS;
+}
+
+/**
+ * @brief Remove the loaded program, its rows are left empty. No devices may be pushed after it
+ * A program is reloaded by kemuSys_unloadProgram and kemuSys_loadProgram, only the header is read again
+*/
+void kemuSys_unloadProgram(KemuSys *sys){
+	if(NULL_CHECK(sys)){
+		return;
+	}
+	for(; sys->progDevCount && !kaelTree_empty(&sys->dev); sys->progDevCount--){
+		const KemuDev *dev = kaelTree_back(&sys->dev);
+		for(uint16_t i=0; i<KEMU_PAGE_ROWS; i++){
+			if(sys->pageTable[i].devID == dev->devID){
+				kemuSys_setRow(sys, i, (KemuSys_pageEntry){0});
+				kemuSys_writeRow(sys, i, (KemuSys_pageEntry){0});
+			}
+		}
+		kemuSys_popDev(sys);
+	}
+	sys->progDevCount = 0;
+	if(sys->progBase){
+		munmap(sys->progBase, sys->progSize);
+		sys->progBase = NULL;
+		sys->progSize = 0;
+	}
+}
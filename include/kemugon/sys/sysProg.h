@@ -0,0 +1,50 @@
+/**
+ * @file sysProg.h
+ *
+ * @brief Header, sectioned guest program image mapped straight into VAS
+ */
+#pragma once
+
+#include "kemugon/sys/sys.h"
+#include "kemugon/dev/dev.h"
+
+#define KEMU_PROG_MAGIC "KEMUPRG"
+#define KEMU_PROG_VERSION 1U
+
+/**
+ * @brief Section flags
+*/
+typedef enum{
+	ROM_SECTION		= 0b00000001, //Read-only, file pages are shared and never copied
+}KemuProg_flags;
+
+/**
+ * @brief Section record, data is at host page aligned dataOffset
+ * Each section becomes a device, map.devID requests its ID and 0 takes any free one
+*/
+typedef struct{
+	uint64_t dataOffset;
+	uint64_t bankSize; //Multiple of KEMU_PAGE_SIZE
+	uint64_t bankCount;
+	KemuSys_pageEntry map; //Load page and banks, written to page table row
+	uint8_t row;
+	uint8_t type; //RAM_DEV or DATA_DEV
+	uint8_t flags; //KemuProg_flags
+}KemuProg_section;
+
+/**
+ * @brief File header, followed by sectionCount section records
+*/
+typedef struct{
+	char magic[8];
+	uint32_t version;
+	uint32_t pageShift; //KEMU_PAGE_SHIFT of the writer
+	uint64_t fileSize;
+	uint16_t entry; //Initial program counter
+	uint32_t sectionCount;
+	KemuProg_section section[];
+}KemuProg_head;
+
+uint8_t kemuProg_save(const char *path, const uint16_t entry, const KemuProg_section *section, const uint16_t *const *data, const uint32_t sectionCount);
+uint8_t kemuSys_loadProgram(KemuSys *sys, const char *path);
+void kemuSys_unloadProgram(KemuSys *sys);
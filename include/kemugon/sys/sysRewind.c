@@ -0,0 +1,444 @@
+/**
+ * @file sysRewind.c
+ *
+ * @brief Implementation, bounded ring of periodic machine states stored as XOR/RLE deltas
+ *
+ * Frame layout in the ring, all u16 words:
+ * 	state: emuCycle[4] insRetired[4] quitFlag pageTable[KEMU_PAGE_ROWS*2] sched, worker sched...
+ * 	deltas: devIndex chunkLo chunkHi tokenWords, tokens of {zeroRun literalCount XOR[literalCount]}
+ * Only chunks with REWIND_DIRTY are encoded, so capture cost follows guest writes
+ */
+
+#include "kemugon/sys/sysRewind.h"
+#include "kemugon/sys/sysDev.h"
+#include "kemugon/sys/sysBlock.h"
+
+//REWIND_DIRTY of 8 chunks at once
+#define KEMU_REWIND_DIRTY8 (0x0101010101010101ULL * REWIND_DIRTY)
+
+//Worst case encoded chunk, alternating zero and literal words
+#define KEMU_REWIND_CHUNK_WORDS (4U + 2U*KEMU_PAGE_SIZE + 2U)
+
+//------ Ring access ------
+
+static void kemuRewind_put(KemuRewind *rw, const uint16_t word){
+	rw->ring[rw->head % rw->ringWords] = word;
+	rw->head++;
+}
+
+static void kemuRewind_put64(KemuRewind *rw, const uint64_t value){
+	for(uint8_t i=0; i<4; i++){
+		kemuRewind_put(rw, value >> (16*i));
+	}
+}
+
+static uint16_t kemuRewind_get(const KemuRewind *rw, uint64_t *pos){
+	uint16_t word = rw->ring[*pos % rw->ringWords];
+	(*pos)++;
+	return word;
+}
+
+static uint64_t kemuRewind_get64(const KemuRewind *rw, uint64_t *pos){
+	uint64_t value = 0;
+	for(uint8_t i=0; i<4; i++){
+		value |= (uint64_t)kemuRewind_get(rw, pos) << (16*i);
+	}
+	return value;
+}
+
+static KemuRewind_frame *kemuRewind_frame(KemuRewind *rw, const size_t n){
+	return &rw->frame[(rw->first + n) % KEMU_REWIND_FRAMES];
+}
+
+static void kemuRewind_dropOldest(KemuRewind *rw, const uint64_t frameStart){
+	rw->first = (rw->first + 1) % KEMU_REWIND_FRAMES;
+	rw->frameCount--;
+	rw->tail = rw->frameCount ? kemuRewind_frame(rw, 0)->start : frameStart;
+}
+
+/**
+ * @brief Make room for words by dropping oldest frames, fails if the frame being written alone does not fit
+*/
+static uint8_t kemuRewind_reserve(KemuRewind *rw, const size_t words, const uint64_t frameStart){
+	while(rw->ringWords - (rw->head - rw->tail) < words){
+		if(rw->frameCount == 0){
+			return KEMU_FAIL;
+		}
+		kemuRewind_dropOldest(rw, frameStart);
+	}
+	return KEMU_SUCCESS;
+}
+
+//------ Frame state ------
+
+static size_t kemuRewind_stateWords(const KemuSys *sys){
+	size_t words = 4 + 4 + 1 + KEMU_PAGE_ROWS*2 + 1 + sys->sched.count*5 + 1;
+	for(uint8_t i=0; i<sys->workers.workerCount; i++){
+		words += 4 + 1 + sys->workers.worker[i].sched.count*5;
+	}
+	return words;
+}
+
+static void kemuRewind_putSched(KemuRewind *rw, const KemuSched *sched){
+	kemuRewind_put(rw, sched->count);
+	for(size_t i=0; i<sched->count; i++){
+		kemuRewind_put64(rw, sched->event[i].time);
+		kemuRewind_put(rw, sched->event[i].devID);
+	}
+}
+
+static void kemuRewind_getSched(const KemuRewind *rw, uint64_t *pos, KemuSched *sched){
+	size_t count = kemuRewind_get(rw, pos);
+	for(size_t i=0; i<count; i++){
+		KemuSched_event event;
+		event.time = kemuRewind_get64(rw, pos);
+		event.devID = kemuRewind_get(rw, pos);
+		if(sched){
+			sched->event[i] = event;
+		}
+	}
+	if(sched){
+		sched->count = count;
+	}
+}
+
+static void kemuRewind_putState(KemuRewind *rw, const KemuSys *sys){
+	kemuRewind_put64(rw, sys->emuCycle);
+	kemuRewind_put64(rw, sys->insRetired);
+	kemuRewind_put(rw, sys->quitFlag);
+	for(uint16_t i=0; i<KEMU_PAGE_ROWS; i++){
+		KemuSys_pageEntry row = sys->pageTable[i];
+		kemuRewind_put(rw, kemuSys_u8Pack(row.pageIndex, row.devID));
+		kemuRewind_put(rw, kemuSys_u8Pack(row.lastBank, row.firstBank));
+	}
+	kemuRewind_putSched(rw, &sys->sched);
+	kemuRewind_put(rw, sys->workers.workerCount);
+	for(uint8_t i=0; i<sys->workers.workerCount; i++){
+		kemuRewind_put64(rw, sys->workers.worker[i].emuCycle);
+		kemuRewind_putSched(rw, &sys->workers.worker[i].sched);
+	}
+}
+
+/**
+ * @brief Read state header at pos, applied to sys unless sys is NULL
+*/
+static void kemuRewind_getState(const KemuRewind *rw, uint64_t *pos, KemuSys *sys){
+	uint64_t emuCycle = kemuRewind_get64(rw, pos);
+	uint64_t insRetired = kemuRewind_get64(rw, pos);
+	uint8_t quitFlag = kemuRewind_get(rw, pos);
+	for(uint16_t i=0; i<KEMU_PAGE_ROWS; i++){
+		uint16_t lo = kemuRewind_get(rw, pos);
+		uint16_t hi = kemuRewind_get(rw, pos);
+		KemuSys_pageEntry row = {
+			.devID		= lo & 0xFF,
+			.pageIndex	= lo >> 8,
+			.firstBank	= hi & 0xFF,
+			.lastBank	= hi >> 8,
+		};
+		if(sys){
+			kemuSys_setRow(sys, i, row);
+		}
+	}
+	kemuRewind_getSched(rw, pos, sys ? &sys->sched : NULL);
+	uint8_t workerCount = kemuRewind_get(rw, pos);
+	for(uint8_t i=0; i<workerCount; i++){
+		uint64_t workerCycle = kemuRewind_get64(rw, pos);
+		KemuWorker *worker = sys ? &sys->workers.worker[i] : NULL;
+		kemuRewind_getSched(rw, pos, worker ? &worker->sched : NULL);
+		if(worker){
+			worker->emuCycle = workerCycle;
+		}
+	}
+	if(sys){
+		sys->emuCycle = emuCycle;
+		sys->insRetired = insRetired;
+		sys->quitFlag = quitFlag;
+	}
+}
+
+//------ Deltas ------
+
+/**
+ * @brief Append XOR of cur against ref as zero/literal runs. Unchanged chunks leave no record
+*/
+static void kemuRewind_encode(KemuRewind *rw, const uint8_t devIndex, const size_t chunk, const uint16_t *cur, const uint16_t *ref, const size_t len){
+	uint64_t record = rw->head;
+	kemuRewind_put(rw, devIndex);
+	kemuRewind_put(rw, chunk & 0xFFFF);
+	kemuRewind_put(rw, chunk >> 16);
+	kemuRewind_put(rw, 0);
+
+	uint8_t changed = 0;
+	size_t i = 0;
+	while(i < len){
+		size_t zeroStart = i;
+		while(i < len && cur[i] == ref[i]){
+			i++;
+		}
+		size_t litStart = i;
+		while(i < len && cur[i] != ref[i]){
+			i++;
+		}
+		kemuRewind_put(rw, litStart - zeroStart);
+		kemuRewind_put(rw, i - litStart);
+		for(size_t j=litStart; j<i; j++){
+			kemuRewind_put(rw, cur[j] ^ ref[j]);
+		}
+		changed |= i > litStart;
+	}
+
+	if(!changed){
+		rw->head = record;
+		return;
+	}
+	uint64_t tokenWords = rw->head - record - 4;
+	rw->ring[(record + 3) % rw->ringWords] = tokenWords;
+}
+
+/**
+ * @brief XOR deltas of frame into device data and ref, turning the newer state into the older one
+*/
+static void kemuRewind_undo(KemuSys *sys, KemuRewind *rw, const KemuRewind_frame *frame){
+	uint64_t pos = frame->start;
+	kemuRewind_getState(rw, &pos, NULL);
+	while(pos < frame->end){
+		uint8_t devIndex = kemuRewind_get(rw, &pos);
+		size_t chunk = kemuRewind_get(rw, &pos);
+		chunk |= (size_t)kemuRewind_get(rw, &pos) << 16;
+		uint16_t tokenWords = kemuRewind_get(rw, &pos);
+		uint64_t end = pos + tokenWords;
+
+		KemuDev *dev = kaelTree_get(&sys->dev, devIndex);
+		uint16_t *ref = rw->ref[devIndex];
+		size_t j = chunk << KEMU_PAGE_SHIFT;
+		while(pos < end){
+			j += kemuRewind_get(rw, &pos);
+			uint16_t litCount = kemuRewind_get(rw, &pos);
+			for(uint16_t k=0; k<litCount; k++, j++){
+				uint16_t x = kemuRewind_get(rw, &pos);
+				dev->data[j] ^= x;
+				ref[j] ^= x;
+			}
+		}
+		if(dev->dirty){
+			__atomic_fetch_or(&dev->dirty[chunk], KEMU_DIRTY_ALL & ~REWIND_DIRTY, __ATOMIC_RELEASE);
+		}
+	}
+}
+
+//------ Setup ------
+
+void kemuSys_freeRewind(KemuSys *sys){
+	KemuRewind *rw = sys->rewind;
+	if(rw==NULL){
+		return;
+	}
+	for(uint8_t i=0; rw->ref && i<rw->devCount; i++){
+		free(rw->ref[i]);
+	}
+	free(rw->ref);
+	free(rw->refID);
+	free(rw->refWords);
+	free(rw->ring);
+	free(rw);
+	sys->rewind = NULL;
+}
+
+static uint8_t kemuRewind_match(const KemuSys *sys, const KemuRewind *rw){
+	uint8_t devCount = kaelTree_length(&sys->dev);
+	if(rw->devCount != devCount || rw->workerCount != sys->workers.workerCount){
+		return 0;
+	}
+	for(uint8_t i=0; i<devCount; i++){
+		KemuDev *curDev = kaelTree_get(&sys->dev, i);
+		if(rw->refID[i] != curDev->devID || rw->refWords[i] != kemuDev_stateWords(curDev)){
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/**
+ * @brief Empty ring with ref copied from current device data
+*/
+static uint8_t kemuRewind_alloc(KemuSys *sys){
+	kemuSys_freeRewind(sys);
+	KemuRewind *rw = calloc(1, sizeof(KemuRewind));
+	if(NULL_CHECK(rw)){
+		return KEMU_FAIL;
+	}
+	sys->rewind = rw;
+	uint8_t devCount = kaelTree_length(&sys->dev);
+	rw->ringWords = sys->rewindBudget / sizeof(uint16_t);
+	rw->ring = malloc(rw->ringWords * sizeof(uint16_t));
+	rw->ref = calloc(devCount, sizeof(uint16_t*));
+	rw->refID = calloc(devCount, sizeof(uint8_t));
+	rw->refWords = calloc(devCount, sizeof(size_t));
+	if(NULL_CHECK(rw->ring) || NULL_CHECK(rw->ref) || NULL_CHECK(rw->refID) || NULL_CHECK(rw->refWords)){
+		kemuSys_freeRewind(sys);
+		return KEMU_FAIL;
+	}
+	rw->devCount = devCount;
+	rw->workerCount = sys->workers.workerCount;
+
+	for(uint8_t i=0; i<devCount; i++){
+		KemuDev *curDev = kaelTree_get(&sys->dev, i);
+		size_t words = kemuDev_stateWords(curDev);
+		rw->refID[i] = curDev->devID;
+		rw->refWords[i] = words;
+		rw->ref[i] = malloc(words * sizeof(uint16_t));
+		if(words && NULL_CHECK(rw->ref[i])){
+			kemuSys_freeRewind(sys);
+			return KEMU_FAIL;
+		}
+		memcpy(rw->ref[i], curDev->data, words * sizeof(uint16_t));
+		size_t chunkCount = words >> KEMU_PAGE_SHIFT;
+		for(size_t c=0; curDev->dirty && c<chunkCount; c++){
+			__atomic_fetch_and(&curDev->dirty[c], (uint8_t)~REWIND_DIRTY, __ATOMIC_RELAXED);
+		}
+	}
+	return KEMU_SUCCESS;
+}
+
+//------ Capture and rewind ------
+
+/**
+ * @brief Append a frame of the current machine state. Oldest frames are dropped to stay within sys->rewindBudget
+ * Call between quanta. Fails if a device is streamed, its contents are not part of the state
+*/
+uint8_t kemuSys_capture(KemuSys *sys){
+	if(NULL_CHECK(sys) || sys->rewindBudget == 0){
+		return KEMU_FAIL;
+	}
+	KemuDev *streamed = kemuSys_streamedDev(sys);
+	if(streamed){
+		printf("Device %u is streamed, no rewind frame captured\n", streamed->devID);
+		return KEMU_FAIL;
+	}
+	KemuRewind *rw = sys->rewind;
+	if(rw==NULL || !kemuRewind_match(sys, rw)){
+		if(kemuRewind_alloc(sys) == KEMU_FAIL){
+			return KEMU_FAIL;
+		}
+		rw = sys->rewind;
+	}
+
+	if(rw->frameCount == KEMU_REWIND_FRAMES){
+		kemuRewind_dropOldest(rw, rw->head);
+	}
+	uint64_t frameStart = rw->head;
+	size_t stateWords = kemuRewind_stateWords(sys);
+	if(kemuRewind_reserve(rw, stateWords, frameStart) == KEMU_FAIL){
+		printf("Rewind budget %zu too small\n", sys->rewindBudget);
+		return KEMU_FAIL;
+	}
+	kemuRewind_putState(rw, sys);
+
+	//Deltas are kept while they fit. Otherwise this frame becomes the oldest and needs none
+	uint8_t keepDelta = 1;
+	for(uint8_t i=0; i<rw->devCount; i++){
+		KemuDev *dev = kaelTree_get(&sys->dev, i);
+		size_t words = rw->refWords[i];
+		size_t chunkCount = (words + KEMU_PAGE_MASK) >> KEMU_PAGE_SHIFT;
+		if(dev->head.isROM){
+			continue;
+		}
+		for(size_t c=0; c<chunkCount; c++){
+			if(dev->dirty){
+				//Skip 8 clean chunks at once
+				if((c & 7) == 0 && c + 8 <= chunkCount){
+					uint64_t dirty8;
+					memcpy(&dirty8, &dev->dirty[c], sizeof(dirty8));
+					if((dirty8 & KEMU_REWIND_DIRTY8) == 0){
+						c += 7;
+						continue;
+					}
+				}
+				if(!(dev->dirty[c] & REWIND_DIRTY)){
+					continue;
+				}
+				__atomic_fetch_and(&dev->dirty[c], (uint8_t)~REWIND_DIRTY, __ATOMIC_RELAXED);
+			}
+			size_t offset = c << KEMU_PAGE_SHIFT;
+			size_t len = kaelMath_min(KEMU_PAGE_SIZE, words - offset);
+
+			if(keepDelta && kemuRewind_reserve(rw, KEMU_REWIND_CHUNK_WORDS, frameStart) == KEMU_FAIL){
+				keepDelta = 0;
+				rw->head = frameStart;
+				rw->tail = frameStart;
+				kemuRewind_putState(rw, sys);
+			}
+			if(keepDelta){
+				kemuRewind_encode(rw, i, c, &dev->data[offset], &rw->ref[i][offset], len);
+			}
+			memcpy(&rw->ref[i][offset], &dev->data[offset], len * sizeof(uint16_t));
+		}
+	}
+
+	rw->frameCount++;
+	*kemuRewind_frame(rw, rw->frameCount - 1) = (KemuRewind_frame){
+		.start		= frameStart,
+		.end			= rw->head,
+		.emuCycle	= sys->emuCycle,
+	};
+	return KEMU_SUCCESS;
+}
+
+/**
+ * @brief Return to the newest frame at least ms emulated milliseconds before now, or the oldest one
+ * Frames after it are discarded. Call between quanta. Fails if a device is streamed
+*/
+uint8_t kemuSys_rewind(KemuSys *sys, const uint64_t ms){
+	if(NULL_CHECK(sys)){
+		return KEMU_FAIL;
+	}
+	KemuRewind *rw = sys->rewind;
+	if(rw==NULL || rw->frameCount==0 || !kemuRewind_match(sys, rw) || kemuSys_streamedDev(sys)){
+		return KEMU_FAIL;
+	}
+	uint64_t back = ms * sys->emuClockSpeed / 1000;
+	uint64_t target = sys->emuCycle > back ? sys->emuCycle - back : 0;
+	//Transfers in flight belong to the state being left
+	kemuSys_cancelIO(sys);
+
+	//Undo writes since the newest frame
+	for(uint8_t i=0; i<rw->devCount; i++){
+		KemuDev *dev = kaelTree_get(&sys->dev, i);
+		size_t words = rw->refWords[i];
+		if(dev->head.isROM){
+			continue;
+		}
+		if(dev->dirty==NULL){
+			memcpy(dev->data, rw->ref[i], words * sizeof(uint16_t));
+			continue;
+		}
+		size_t chunkCount = words >> KEMU_PAGE_SHIFT;
+		for(size_t c=0; c<chunkCount; c++){
+			if(dev->dirty[c] & REWIND_DIRTY){
+				size_t offset = c << KEMU_PAGE_SHIFT;
+				memcpy(&dev->data[offset], &rw->ref[i][offset], KEMU_PAGE_SIZE * sizeof(uint16_t));
+				__atomic_store_n(&dev->dirty[c], KEMU_DIRTY_ALL & ~REWIND_DIRTY, __ATOMIC_RELEASE);
+			}
+		}
+	}
+
+	size_t n = rw->frameCount - 1;
+	while(n > 0 && kemuRewind_frame(rw, n)->emuCycle > target){
+		kemuRewind_undo(sys, rw, kemuRewind_frame(rw, n));
+		n--;
+	}
+
+	//Decoded instructions may come from any undone chunk
+	for(uint16_t i=0; i<sys->mapPageCount; i++){
+		if(sys->frameAttr[i] & CODE_FRAME){
+			kemuSys_dropCode(sys, i);
+		}
+	}
+
+	KemuRewind_frame *frame = kemuRewind_frame(rw, n);
+	uint64_t pos = frame->start;
+	kemuRewind_getState(rw, &pos, sys);
+	rw->frameCount = n + 1;
+	rw->head = frame->end;
+	return KEMU_SUCCESS;
+}
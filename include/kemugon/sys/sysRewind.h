@@ -0,0 +1,46 @@
+/**
+ * @file sysRewind.h
+ * 
+ * @brief Header, bounded ring of periodic machine states stored as XOR/RLE deltas
+ */
+#pragma once
+
+#include "kemugon/sys/sys.h"
+#include "kemugon/dev/dev.h"
+
+//Frames kept at most, oldest are dropped first
+#define KEMU_REWIND_FRAMES 4096U
+
+//Default capture rate if sys->rewindCycles is 0
+#define KEMU_REWIND_HZ 60U
+
+typedef struct{
+	uint64_t start; //Ring position of the state header
+	uint64_t end; //Ring position past the last delta
+	uint64_t emuCycle;
+}KemuRewind_frame;
+
+/**
+ * @brief Each frame stores its state header and the XOR of changed chunks against the previous frame
+ * ref holds device data as of the newest frame, older ones are reached by XORing deltas backwards
+*/
+typedef struct KemuRewind{
+	uint16_t *ring;
+	size_t ringWords;
+	uint64_t head; //Monotonic write position
+	uint64_t tail; //Start of oldest frame
+
+	KemuRewind_frame frame[KEMU_REWIND_FRAMES];
+	size_t first; //Oldest frame index
+	size_t frameCount;
+
+	uint16_t **ref; //Device data as of newest frame
+	uint8_t *refID; //devID of each ref
+	size_t *refWords;
+	uint8_t devCount;
+	uint8_t workerCount;
+}KemuRewind;
+
+uint8_t kemuSys_capture(KemuSys *sys);
+uint8_t kemuSys_rewind(KemuSys *sys, const uint64_t ms);
+void kemuSys_freeRewind(KemuSys *sys);
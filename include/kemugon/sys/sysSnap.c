@@ -0,0 +1,206 @@
+/**
+ * @file sysSnap.c
+ * 
+ * @brief Implementation, in-memory save states copying only chunks dirtied since the previous one
+ * 
+ * A snapshot keeps a full copy of every device. SNAP_DIRTY marks chunks written since the last
+ * kemuSys_snapshot or kemuSys_restore of sys->snapBase, only those differ from it and are copied.
+ * Using another KemuSnap falls back to a full copy. Call between quanta, never from a device.
+ */
+
+#include "kemugon/sys/sysSnap.h"
+#include "kemugon/sys/sysDev.h"
+#include "kemugon/sys/sysBlock.h"
+
+//SNAP_DIRTY of 8 chunks at once
+#define KEMU_SNAP_DIRTY8 (0x0101010101010101ULL * SNAP_DIRTY)
+
+void kemuSnap_free(KemuSnap *snap){
+	for(uint8_t i=0; snap->dev && i<snap->devCount; i++){
+		free(snap->dev[i].data);
+	}
+	free(snap->dev);
+	free(snap->workerSched);
+	free(snap->workerCycle);
+	snap->dev = NULL;
+	snap->devCount = 0;
+	snap->workerSched = NULL;
+	snap->workerCycle = NULL;
+	snap->workerCount = 0;
+}
+
+/**
+ * @brief Check snap was taken of the same devices
+*/
+static uint8_t kemuSnap_match(const KemuSys *sys, const KemuSnap *snap){
+	uint8_t devCount = kaelTree_length(&sys->dev);
+	if(snap->dev==NULL || snap->devCount != devCount || snap->workerCount != sys->workers.workerCount){
+		return 0;
+	}
+	for(uint8_t i=0; i<devCount; i++){
+		KemuDev *curDev = kaelTree_get(&sys->dev, i);
+		if(snap->dev[i].devID != curDev->devID || snap->dev[i].wordCount != kemuDev_stateWords(curDev)){
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static uint8_t kemuSnap_alloc(const KemuSys *sys, KemuSnap *snap){
+	kemuSnap_free(snap);
+	uint8_t devCount = kaelTree_length(&sys->dev);
+	snap->dev = calloc(devCount, sizeof(KemuSnap_dev));
+	if(NULL_CHECK(snap->dev)){
+		return KEMU_FAIL;
+	}
+	snap->devCount = devCount;
+	for(uint8_t i=0; i<devCount; i++){
+		KemuDev *curDev = kaelTree_get(&sys->dev, i);
+		KemuSnap_dev *saved = &snap->dev[i];
+		saved->devID = curDev->devID;
+		saved->wordCount = kemuDev_stateWords(curDev);
+		saved->data = malloc(saved->wordCount * sizeof(uint16_t));
+		if(saved->wordCount && NULL_CHECK(saved->data)){
+			kemuSnap_free(snap);
+			return KEMU_FAIL;
+		}
+	}
+
+	uint8_t workerCount = sys->workers.workerCount;
+	if(workerCount){
+		snap->workerSched = calloc(workerCount, sizeof(KemuSched));
+		snap->workerCycle = calloc(workerCount, sizeof(uint64_t));
+		if(NULL_CHECK(snap->workerSched) || NULL_CHECK(snap->workerCycle)){
+			kemuSnap_free(snap);
+			return KEMU_FAIL;
+		}
+	}
+	snap->workerCount = workerCount;
+	return KEMU_SUCCESS;
+}
+
+/**
+ * @brief Copy dirty chunks between device and snapshot, or all of them. SNAP_DIRTY is cleared
+*/
+static void kemuSnap_copy(KemuDev *dev, KemuSnap_dev *saved, const uint8_t full, const uint8_t toSnap){
+	//ROM may be mapped read-only and is not machine state
+	if(!toSnap && dev->head.isROM){
+		return;
+	}
+	uint16_t *dst = toSnap ? saved->data : dev->data;
+	uint16_t *src = toSnap ? dev->data : saved->data;
+	size_t chunkCount = saved->wordCount >> KEMU_PAGE_SHIFT;
+
+	//Restored chunks are new data to the other dirty planes. The flusher clears FLUSH_DIRTY concurrently
+	uint8_t setMask = toSnap ? 0 : KEMU_DIRTY_ALL & ~SNAP_DIRTY;
+
+	if(full || dev->dirty==NULL){
+		memcpy(dst, src, saved->wordCount * sizeof(uint16_t));
+		for(size_t i=0; dev->dirty && i<chunkCount; i++){
+			__atomic_fetch_and(&dev->dirty[i], (uint8_t)~SNAP_DIRTY, __ATOMIC_RELAXED);
+			__atomic_fetch_or(&dev->dirty[i], setMask, __ATOMIC_RELEASE);
+		}
+		return;
+	}
+
+	for(size_t i=0; i<chunkCount; i++){
+		//Skip 8 clean chunks at once
+		if((i & 7) == 0 && i + 8 <= chunkCount){
+			uint64_t dirty8;
+			memcpy(&dirty8, &dev->dirty[i], sizeof(dirty8));
+			if((dirty8 & KEMU_SNAP_DIRTY8) == 0){
+				i += 7;
+				continue;
+			}
+		}
+		if(dev->dirty[i] & SNAP_DIRTY){
+			size_t offset = i << KEMU_PAGE_SHIFT;
+			memcpy(&dst[offset], &src[offset], KEMU_PAGE_SIZE * sizeof(uint16_t));
+			__atomic_fetch_and(&dev->dirty[i], (uint8_t)~SNAP_DIRTY, __ATOMIC_RELAXED);
+			__atomic_fetch_or(&dev->dirty[i], setMask, __ATOMIC_RELEASE);
+		}
+	}
+}
+
+/**
+ * @brief Save machine state to snap. Only chunks dirtied since snap was last taken or restored are copied
+ * frameTable is not saved, it is resolved from the page table on restore
+ * Fails if a device is streamed, its contents are not part of the state
+*/
+uint8_t kemuSys_snapshot(KemuSys *sys, KemuSnap *snap){
+	if(NULL_CHECK(sys) || NULL_CHECK(snap)){
+		return KEMU_FAIL;
+	}
+	KemuDev *streamed = kemuSys_streamedDev(sys);
+	if(streamed){
+		printf("Device %u is streamed, no snapshot taken\n", streamed->devID);
+		return KEMU_FAIL;
+	}
+	uint8_t full = sys->snapBase != snap;
+	if(!kemuSnap_match(sys, snap)){
+		if(kemuSnap_alloc(sys, snap) == KEMU_FAIL){
+			sys->snapBase = NULL;
+			return KEMU_FAIL;
+		}
+		full = 1;
+	}
+
+	kemuSys_settleFlags(sys);
+	snap->emuCycle = sys->emuCycle;
+	snap->insRetired = sys->insRetired;
+	snap->quitFlag = sys->quitFlag;
+	memcpy(snap->pageTable, sys->pageTable, sizeof(snap->pageTable));
+	snap->sched = sys->sched;
+	for(uint8_t i=0; i<snap->workerCount; i++){
+		snap->workerSched[i] = sys->workers.worker[i].sched;
+		snap->workerCycle[i] = sys->workers.worker[i].emuCycle;
+	}
+
+	for(uint8_t i=0; i<snap->devCount; i++){
+		kemuSnap_copy(kaelTree_get(&sys->dev, i), &snap->dev[i], full, 1);
+	}
+	sys->nullDirty &= ~SNAP_DIRTY;
+	sys->snapBase = snap;
+	return KEMU_SUCCESS;
+}
+
+/**
+ * @brief Return machine to snap. Cost is proportional to chunks dirtied since snap was taken
+ * Fails if devices were added or removed since, or if a device is streamed
+*/
+uint8_t kemuSys_restore(KemuSys *sys, KemuSnap *snap){
+	if(NULL_CHECK(sys) || NULL_CHECK(snap) || !kemuSnap_match(sys, snap) || kemuSys_streamedDev(sys)){
+		return KEMU_FAIL;
+	}
+	uint8_t full = sys->snapBase != snap;
+	//Transfers in flight belong to the state being left
+	kemuSys_cancelIO(sys);
+
+	//Decoded instructions of restored chunks are stale
+	for(uint16_t i=0; i<sys->mapPageCount; i++){
+		if((sys->frameAttr[i] & CODE_FRAME) && (full || (*sys->frameDirty[i] & SNAP_DIRTY))){
+			kemuSys_dropCode(sys, i);
+		}
+	}
+
+	for(uint8_t i=0; i<snap->devCount; i++){
+		kemuSnap_copy(kaelTree_get(&sys->dev, i), &snap->dev[i], full, 0);
+	}
+	sys->nullDirty &= ~SNAP_DIRTY;
+
+	//Remap rows that changed since
+	for(uint16_t i=0; i<KEMU_PAGE_ROWS; i++){
+		kemuSys_setRow(sys, i, snap->pageTable[i]);
+	}
+
+	sys->emuCycle = snap->emuCycle;
+	sys->insRetired = snap->insRetired;
+	sys->quitFlag = snap->quitFlag;
+	sys->sched = snap->sched;
+	for(uint8_t i=0; i<snap->workerCount; i++){
+		sys->workers.worker[i].sched = snap->workerSched[i];
+		sys->workers.worker[i].emuCycle = snap->workerCycle[i];
+	}
+	sys->snapBase = snap;
+	return KEMU_SUCCESS;
+}
@@ -0,0 +1,40 @@
+/**
+ * @file sysSnap.h
+ * 
+ * @brief Header, in-memory save states copying only chunks dirtied since the previous one
+ */
+#pragma once
+
+#include "kemugon/sys/sys.h"
+#include "kemugon/dev/dev.h"
+
+/**
+ * @brief Saved device data, matched to devices by devID
+*/
+typedef struct{
+	uint8_t devID;
+	size_t wordCount;
+	uint16_t *data;
+}KemuSnap_dev;
+
+/**
+ * @brief Machine state. Zero initialize before first kemuSys_snapshot
+*/
+typedef struct{
+	uint64_t emuCycle;
+	uint64_t insRetired;
+	uint8_t quitFlag;
+	KemuSys_pageEntry pageTable[KEMU_PAGE_ROWS];
+	KemuSched sched;
+
+	KemuSched *workerSched; //One per worker
+	uint64_t *workerCycle;
+	uint8_t workerCount;
+
+	KemuSnap_dev *dev;
+	uint8_t devCount;
+}KemuSnap;
+
+uint8_t kemuSys_snapshot(KemuSys *sys, KemuSnap *snap);
+uint8_t kemuSys_restore(KemuSys *sys, KemuSnap *snap);
+void kemuSnap_free(KemuSnap *snap);
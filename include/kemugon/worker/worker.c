@@ -0,0 +1,60 @@
+/**
+ * @file worker.c
+ * 
+ * @brief Implementation, device worker threads, epoch barrier and lock-free message queues
+ */
+
+#include <sched.h>
+#include <x86intrin.h>
+
+#include "kemugon/worker/worker.h"
+
+/**
+ * @brief Producer side, fails if the queue is full
+*/
+uint8_t kemuQueue_push(KemuQueue *queue, const KemuQueue_msg msg){
+	size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+	size_t head = atomic_load_explicit(&queue->head, memory_order_acquire);
+	if(tail - head >= KEMU_QUEUE_SIZE){
+		return KEMU_FAIL;
+	}
+	queue->msg[tail & (KEMU_QUEUE_SIZE - 1)] = msg;
+	atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+	return KEMU_SUCCESS;
+}
+
+/**
+ * @brief Consumer side, fails if the queue is empty
+*/
+uint8_t kemuQueue_pop(KemuQueue *queue, KemuQueue_msg *msg){
+	size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+	if(head == tail){
+		return KEMU_FAIL;
+	}
+	*msg = queue->msg[head & (KEMU_QUEUE_SIZE - 1)];
+	atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+	return KEMU_SUCCESS;
+}
+
+/**
+ * @brief One step of a wait loop. Spins briefly since quanta are short, then yields
+*/
+void kemuWorker_pause(uint32_t *spin){
+	if(*spin < KEMU_WORKER_SPIN){
+		_mm_pause();
+		(*spin)++;
+	}else{
+		sched_yield();
+	}
+}
+
+/**
+ * @brief Block until counter reaches value
+*/
+void kemuWorker_wait(_Atomic uint64_t *counter, const uint64_t value){
+	uint32_t spin = 0;
+	while(atomic_load_explicit(counter, memory_order_acquire) < value){
+		kemuWorker_pause(&spin);
+	}
+}
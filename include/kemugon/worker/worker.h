@@ -0,0 +1,130 @@
+/**
+ * @file worker.h
+ * 
+ * @brief Header, device worker threads, epoch barrier and lock-free message queues
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "libkael/debug/kaelMacros.h"
+
+#include "kemugon/sched/sched.h"
+
+//Power of 2, messages per queue
+#define KEMU_QUEUE_SIZE 1024U
+
+//Spins before a waiting thread yields its core
+#define KEMU_WORKER_SPIN 4096U
+
+/**
+ * @brief Device register write exchanged between threads
+*/
+typedef struct{
+	uint8_t devID; //Receiving device
+	uint16_t addr; //Word offset in device data
+	uint16_t value;
+}KemuQueue_msg;
+
+/**
+ * @brief Single producer single consumer ring
+*/
+typedef struct{
+	KemuQueue_msg msg[KEMU_QUEUE_SIZE];
+	_Atomic size_t head; //Written by consumer
+	_Atomic size_t tail; //Written by producer
+}KemuQueue;
+
+uint8_t kemuQueue_push(KemuQueue *queue, const KemuQueue_msg msg);
+uint8_t kemuQueue_pop(KemuQueue *queue, KemuQueue_msg *msg);
+
+/**
+ * @brief Thread running a subset of devices in lock-step quanta with the main thread
+*/
+typedef struct{
+	pthread_t thread;
+	void *sys; //KemuSys
+	uint8_t id; //Matches KemuDev.worker
+
+	KemuSched sched; //Events of owned devices
+	uint64_t emuCycle;
+
+	KemuQueue outbox; //worker -> main, drained by main at the barrier
+
+	_Atomic uint64_t doneEpoch; //Last finished quantum
+}KemuWorker;
+
+/**
+ * @brief Quantum barrier shared by main thread and workers
+*/
+typedef struct{
+	KemuWorker *worker;
+	uint8_t workerCount;
+	uint8_t nextWorker; //Round-robin device assignment
+
+	_Atomic uint64_t epoch; //Incremented by main to start a quantum
+	_Atomic uint64_t endCycle; //Emu-cycle the quantum runs to
+	_Atomic uint8_t stop;
+
+	KemuQueue_msg *pending; //Main thread only, messages to worker devices delivered once workers are parked
+	size_t pendingCount;
+	size_t pendingSize;
+}KemuWorker_pool;
+
+/**
+ * @brief Background write-back of FILE_STORE devices
+*/
+typedef struct{
+	pthread_t thread;
+	pthread_mutex_t lock; //Held while flushing and while the device list changes
+	pthread_cond_t wake;
+	uint8_t running;
+	uint8_t stop;
+}KemuWorker_flusher;
+
+/**
+ * @brief KemuWorker_ioReq.state
+*/
+typedef enum{
+	IDLE_IO,
+	PENDING_IO,
+	DONE_IO,
+}KemuWorker_ioState;
+
+/**
+ * @brief Copy between a bounce buffer and device data, one in flight per block controller
+ * IO threads only prefault the device range, the main thread copies on completion
+*/
+typedef struct{
+	uint8_t *fault; //Host range of the device side, prefaulted by an IO thread
+	size_t faultBytes;
+	uint16_t *buf; //VAS side, gathered on submit of a write and scattered on completion of a read
+	uint8_t devID; //Device side, looked up again on completion
+	size_t offset; //Word offset in device data
+	size_t words;
+	uint8_t write; //1 = buf to device
+	uint8_t state; //KemuWorker_ioState, set to DONE_IO by IO threads under KemuWorker_io.lock, atomic outside it
+}KemuWorker_ioReq;
+
+/**
+ * @brief Threads servicing block controller transfers while the CPU keeps running
+*/
+typedef struct{
+	pthread_t *thread;
+	uint8_t threadCount; //0 = no prefault, requests are ready on submit
+	void *sys; //KemuSys
+	pthread_mutex_t lock;
+	pthread_cond_t wake; //Request queued or stop
+	pthread_cond_t done; //Request prefaulted
+	uint8_t queue[256]; //Controller devIDs waiting for a thread
+	uint16_t head;
+	uint16_t tail;
+	uint8_t stop;
+	KemuWorker_ioReq req[256]; //Indexed by controller devID
+}KemuWorker_io;
+
+void kemuWorker_pause(uint32_t *spin);
+void kemuWorker_wait(_Atomic uint64_t *counter, const uint64_t value);
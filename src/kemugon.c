@@ -10,20 +10,48 @@
 #include "kemugon/sys/sys.h"
 #include "kemugon/dev/dev.h"
 #include "kemugon/sys/sysDev.h"
+#include "kemugon/sys/sysImage.h"
 #include "libkael/debug/kaelMacros.h"
 
 
-int main(){
+/**
+ * @brief Optional arguments are a warm-boot image, a disk delta and a program image
+ * The warm-boot image is resumed if valid, otherwise written after a cold boot
+ * With a delta, disk/disk.img stays read-only and can be shared by many instances
+ * A program image is booted instead of the built-in loader
+*/
+int main(int argc, char **argv){
+	const char *imagePath = argc > 1 ? argv[1] : NULL;
+	const char *diskOverlay = argc > 2 ? argv[2] : NULL;
+	const char *program = argc > 3 ? argv[3] : NULL;
+
 	KemuSys system = {
 		.emuClockSpeed  = 4194304U,
 		.hostClockSpeed = 3700003502U,
-		.pageSize = 256U,
+		.quantumCycles = 4194U, //~1ms
+		.runMode = SYNC_RUN,
+		.cycleLimit = 4194304U, //One emulated second, 0 = run until TRM
+		.pageSize = KEMU_PAGE_SIZE,
+		.engine = INTERP_ENGINE,
+		.workerCount = 0, //No threaded devices yet
+		.diskOverlay = diskOverlay,
+		.program = program,
+		.flushMs = 1000, //Background write-back of disk images
+		.rewindBudget = 0, //Bytes, e.g. 16U<<20 keeps rewind frames during kemuSys_loop
 	};
 	kemuSys_alloc(&system);
 
-	kemuSys_initDevices(&system);
-
-	uint8_t err = kemuSys_boot(&system);
+	uint8_t err = KEMU_FAIL;
+	if(imagePath){
+		err = kemuSys_loadImage(&system, imagePath);
+	}
+	if(err==KEMU_FAIL && kaelTree_empty(&system.dev)){
+		kemuSys_initDevices(&system);
+		err = kemuSys_boot(&system);
+		if(err!=KEMU_FAIL && imagePath){
+			kemuSys_saveImage(&system, imagePath);
+		}
+	}
 	if(err!=KEMU_FAIL){
 		kemuSys_loop(&system);
 	}
@@ -0,0 +1,113 @@
+/**
+ * @file kemuAsmUnit.h
+ *
+ * @brief Encoder, decoder, line assembler and disassembler agree on every instruction word
+ */
+
+#pragma once
+
+#include "./kemuUnit.h"
+#include "kemugon/sys/sysAsm.h"
+
+/**
+ * @brief Every op, register and a spread of operands encodes, decodes and prints back to the same instruction
+ */
+void kemuAsm_unitEncode(){
+	#include "kemugon/sys/instr.h"
+	#define KEMU_UNIT_INS(name, form, cycles) [name] = { form, cycles },
+	static const uint8_t insTable[INS_COUNT][2] = { KEMU_INS_TABLE(KEMU_UNIT_INS) };
+	#undef KEMU_UNIT_INS
+	const uint16_t operand[] = { 0, 1, 7, KEMU_INS_SHORT_MASK, KEMU_INS_SHORT_MASK + 1, 0x0100, 0x4000, 0x7FFF, 0xFFFF };
+	uint32_t mismatch = 0;
+	for(uint16_t op=0; op<INS_COUNT; op++){
+		for(uint16_t rd=0; rd<REG_COUNT; rd++){
+			for(uint8_t i=0; i<sizeof(operand)/sizeof(operand[0]); i++){
+				uint16_t word[KEMU_INS_WORDS_MAX] = {0};
+				uint8_t words = kemuAsm_encode(word, op, rd, operand[i]);
+				if(words == 0){
+					//Only register operands past SP are refused
+					mismatch += operand[i] < REG_COUNT;
+					continue;
+				}
+				KemuCache_entry entry;
+				mismatch += kemuAsm_decode(word, &entry) != words || entry.op != op || entry.cycles != words + insTable[op][1];
+				switch(insTable[op][0]){
+					case IMM_FORM:
+						mismatch += entry.arg[0] != operand[i];
+						break;
+
+					case REG_IMM_FORM:
+					case REG_REG_FORM:
+						mismatch += entry.arg[0] != rd || entry.arg[1] != operand[i];
+						break;
+				}
+
+				char text[32];
+				kemuAsm_disasm(word, text, sizeof(text));
+				uint16_t again[KEMU_INS_WORDS_MAX] = {0};
+				uint8_t againWords = kemuAsm_line(again, text);
+				mismatch += againWords != words || memcmp(again, word, words * sizeof(uint16_t)) != 0;
+				if(mismatch){
+					printf("op %u rd %u operand %04X: %s\n", op, rd, operand[i], text);
+					KEMU_UNIT_CHECK(0, "encode round trip");
+					return;
+				}
+			}
+		}
+	}
+}
+
+/**
+ * @brief Every first word decodes to an instruction that prints, assembles and decodes to the same op and arguments
+ * Invalid words are a one word NOP
+ */
+void kemuAsm_unitDecode(){
+	#include "kemugon/sys/instr.h"
+	uint32_t mismatch = 0;
+	for(uint32_t w=0; w<=UINT16_MAX; w++){
+		uint16_t word[KEMU_INS_WORDS_MAX] = { w, (uint16_t)(w * 40503U) };
+		KemuCache_entry entry;
+		uint8_t words = kemuAsm_decode(word, &entry);
+		uint16_t op = w >> KEMU_INS_OP_SHIFT;
+		if(entry.op == NOP && op != NOP){
+			mismatch += words != 1;
+			continue;
+		}
+		char text[32];
+		kemuAsm_disasm(word, text, sizeof(text));
+		uint16_t again[KEMU_INS_WORDS_MAX] = {0};
+		KemuCache_entry againEntry;
+		uint8_t assembled = kemuAsm_line(again, text);
+		kemuAsm_decode(again, &againEntry);
+		uint8_t same = assembled && againEntry.op == entry.op && againEntry.arg[0] == entry.arg[0] && againEntry.arg[1] == entry.arg[1];
+		if(!same && mismatch < 4){
+			printf("word %04X %04X: %s\n", word[0], word[1], text);
+		}
+		mismatch += !same;
+	}
+	KEMU_UNIT_CHECK(mismatch == 0, "%u words did not survive disasm and assembly", mismatch);
+}
+
+/**
+ * @brief Malformed lines are refused, comments and case are accepted
+ */
+void kemuAsm_unitLine(){
+	#include "kemugon/sys/instr.h"
+	const char *bad[] = { "", "; comment", "FOO R0, 1", "ADD R10, 1", "ADD R0", "ADD R0, 1, 2", "ADD R0, 0x10000", "ADD R0, -1",
+		"AND R0, 5", "JMP R0", "TRM 1", "LD 5, R0" };
+	for(uint8_t i=0; i<sizeof(bad)/sizeof(bad[0]); i++){
+		uint16_t word[KEMU_INS_WORDS_MAX];
+		KEMU_UNIT_CHECK(kemuAsm_line(word, bad[i]) == 0, "\"%s\" assembled", bad[i]);
+	}
+	uint16_t word[KEMU_INS_WORDS_MAX];
+	uint16_t expect[] = { KEMU_ASM_EXT(ADD, R3, 0x1234) };
+	KEMU_UNIT_CHECK(kemuAsm_line(word, "  add r3,0x1234 ; comment") == 2 && memcmp(word, expect, sizeof(expect)) == 0, "lower case line");
+}
+
+void kemuAsm_unit(){
+	kemuAsm_unitEncode();
+	kemuAsm_unitDecode();
+	kemuAsm_unitLine();
+
+	printf("kemuAsm_unit Done\n");
+}
@@ -0,0 +1,328 @@
+/**
+ * @file kemuDevUnit.h
+ *
+ * @brief Device events are due a fixed delay after the store that scheduled them, whatever the quantum
+ */
+
+#pragma once
+
+#include "./kemuUnit.h"
+#include "kemugon/sys/sysBlock.h"
+#include "kemugon/sys/sysDma.h"
+#include "kemugon/sys/sysSnap.h"
+#include "kemugon/sys/sysRewind.h"
+
+#define KEMU_UNIT_IO_PAGE 0x10
+
+/**
+ * @brief Unit machine with a command device of type mapped at KEMU_UNIT_IO_PAGE and a DATA_DEV filled with TRM
+ */
+void kemuDev_unitIoBoot(KemuSys *sys, const uint8_t engine, const uint8_t type, const uint16_t *prog, const size_t words){
+	#include "kemugon/sys/instr.h"
+	kemuUnit_boot(sys, engine, prog, words);
+	//Command devices take a whole window slice under KEMU_FLAT_VAS, as in kemuSys_initDevices
+	size_t ioWords = KEMU_PAGE_SIZE;
+	#if KEMU_FLAT_VAS
+		ioWords *= sys->slicePages;
+	#endif
+	KemuDev io = { .fd = -1, .head = { .bankSize = ioWords, .bankCount = 1, .type = type } };
+	KemuDev data = { .fd = -1, .head = { .bankSize = 4*1024, .bankCount = 1, .type = DATA_DEV } };
+	kemuSys_pushDev(sys, &io);
+	kemuSys_pushDev(sys, &data);
+
+	KemuDev *dataDev = kemuDev_devByType(sys, DATA_DEV, 0);
+	for(size_t i=0; i<dataDev->head.bankSize; i++){
+		dataDev->data[i] = KEMU_ASM(TRM, 0, 0);
+	}
+	KemuSys_pageEntry ram = { .devID = kemuDev_devByType(sys, RAM_DEV, 0)->devID, .pageIndex = 0, .firstBank = 0, .lastBank = 3 };
+	KemuSys_pageEntry ioRow = { .devID = kemuDev_devByType(sys, type, 0)->devID, .pageIndex = KEMU_UNIT_IO_PAGE, .firstBank = 0, .lastBank = 0 };
+	kemuSys_setRow(sys, 1, ram);
+	kemuSys_setRow(sys, 0, ioRow);
+}
+
+/**
+ * @brief Read 2 blocks over the spin loop at 0x4100, the guest stops at the TRM they hold
+ * The command is stored at 0x4013, in a batch that began before the completion event existed
+ */
+void kemuDev_blockProg(uint16_t *prog, size_t *words, const uint16_t dataID){
+	#include "kemugon/sys/instr.h"
+	const uint16_t reg = KEMU_UNIT_IO_PAGE << KEMU_PAGE_SHIFT;
+	uint16_t code[0x103] = {
+		KEMU_ASM_EXT(JMP, 0, 0x4002),				//4000 first batch ends at the boot events
+		KEMU_ASM_EXT(LD, R1, reg + 4),			//4002 devID
+		KEMU_ASM_EXT(LD, R2, dataID),				//4004
+		KEMU_ASM(ST, R1, R2),						//4006
+		KEMU_ASM_EXT(LD, R1, reg + 7),			//4007 count
+		KEMU_ASM(LD, R2, 2),							//4009
+		KEMU_ASM(ST, R1, R2),						//400A
+		KEMU_ASM_EXT(LD, R1, reg + 8),			//400B vasAddr
+		KEMU_ASM_EXT(LD, R2, 0x4100),				//400D
+		KEMU_ASM(ST, R1, R2),						//400F
+		KEMU_ASM_EXT(LD, R1, reg),					//4010 command
+		KEMU_ASM(LD, R2, READ_BLOCK),				//4012
+		KEMU_ASM(ST, R1, R2),						//4013
+		KEMU_ASM_EXT(JMP, 0, 0x4100),				//4014
+		[0x100] = KEMU_ASM(ADD, R0, 1),			//4100
+		KEMU_ASM_EXT(JMP, 0, 0x4100),				//4101
+	};
+	memcpy(prog, code, sizeof(code));
+	*words = sizeof(code)/sizeof(code[0]);
+}
+
+/**
+ * @brief With a 1 cycle quantum, completion of the command stored at submitPC is due delay cycles after that store
+ * busy is seen at the end of the quantum the store ran in, done at the end of the quantum the event ran in
+ */
+void kemuDev_unitDelay(KemuSys *sys, const uint16_t submitPC, const uint64_t delay, const char *label){
+	KemuDev_ioRegs *reg = (void *)kemuDev_devByID(sys, sys->pageTable[0].devID)->bank[0];
+	uint64_t busyCycle = 0;
+	uint64_t doneCycle = 0;
+	while(!sys->quitFlag && !doneCycle && sys->emuCycle < 1000000){
+		kemuDev_run(sys, 1);
+		if(!busyCycle && reg->status == BUSY_STATUS){
+			busyCycle = sys->emuCycle;
+		}
+		if(reg->status == DONE_STATUS){
+			doneCycle = sys->emuCycle;
+		}
+	}
+	uint64_t storeCycles = sys->icache.entry[submitPC].cycles;
+	KEMU_UNIT_CHECK(busyCycle && doneCycle - busyCycle == storeCycles + delay,
+		"%s done %lu cycles after the submitting store started, expected %lu", label, doneCycle - busyCycle, storeCycles + delay);
+}
+
+/**
+ * @brief Run 1 cycle quanta until the block controller is busy
+ */
+void kemuDev_unitBusy(KemuSys *sys){
+	KemuDev_ioRegs *reg = (void *)kemuDev_devByType(sys, BLOCK_DEV, 0)->bank[0];
+	while(!sys->quitFlag && reg->status != BUSY_STATUS && sys->emuCycle < 100000){
+		kemuDev_run(sys, 1);
+	}
+}
+
+/**
+ * @brief A restore or rewind drops the transfer in flight, the guest's resubmit after it completes as in an uninterrupted run
+ * A submit while the controller is busy fails with ERROR_STATUS
+ */
+void kemuDev_unitBlockCancel(const uint16_t *prog, const size_t words, const uint16_t loops){
+	#include "kemugon/sys/instr.h"
+	for(uint8_t rewind=0; rewind<2; rewind++){
+		KemuSys sys;
+		kemuDev_unitIoBoot(&sys, INTERP_ENGINE, BLOCK_DEV, prog, words);
+		sys.rewindBudget = 1 << 20;
+		KemuDev_ioRegs *reg = (void *)kemuDev_devByType(&sys, BLOCK_DEV, 0)->bank[0];
+		KemuSnap snap = {0};
+		KEMU_UNIT_CHECK((rewind ? kemuSys_capture(&sys) : kemuSys_snapshot(&sys, &snap)) == KEMU_SUCCESS, "rewind %u: capture failed", rewind);
+		kemuDev_unitBusy(&sys);
+		KEMU_UNIT_CHECK(reg->status == BUSY_STATUS, "rewind %u: block read was never submitted", rewind);
+		kemuSys_storeVAS(&sys, KEMU_UNIT_IO_PAGE << KEMU_PAGE_SHIFT, READ_BLOCK);
+		KEMU_UNIT_CHECK(reg->status == ERROR_STATUS, "rewind %u: submit to a busy controller left status %u, expected ERROR_STATUS", rewind, reg->status);
+
+		//The boot event of the controller must not complete the dropped transfer
+		KEMU_UNIT_CHECK((rewind ? kemuSys_rewind(&sys, 1000) : kemuSys_restore(&sys, &snap)) == KEMU_SUCCESS, "rewind %u: return failed", rewind);
+		kemuDev_unitDelay(&sys, 0x4013, 2 * KEMU_BLOCK_CYCLES, rewind ? "block resubmit after rewind" : "block resubmit after restore");
+		kemuUnit_run(&sys, 1, 100000);
+		KemuDev_CPU *cpu = kemuUnit_cpu(&sys);
+		KEMU_UNIT_CHECK(sys.quitFlag && reg->status == DONE_STATUS && cpu->rw[0] == loops,
+			"rewind %u: resubmit ended with status %u and %u loops, expected DONE_STATUS and %u", rewind, reg->status, cpu->rw[0], loops);
+		kemuSnap_free(&snap);
+		kemuSys_free(&sys);
+	}
+}
+
+/**
+ * @brief With an IO thread the block run matches the main thread run at every quantum end, through a restore mid-transfer
+ * A written block lands in the target on completion
+ */
+void kemuDev_unitBlockThread(const uint16_t *prog, const size_t words){
+	#include "kemugon/sys/instr.h"
+	KemuSys ref, sys;
+	kemuDev_unitIoBoot(&ref, INTERP_ENGINE, BLOCK_DEV, prog, words);
+	kemuDev_unitIoBoot(&sys, INTERP_ENGINE, BLOCK_DEV, prog, words);
+	kemuSys_stopIO(&sys);
+	sys.ioThreads = 1;
+	kemuSys_startIO(&sys);
+	KEMU_UNIT_CHECK(sys.io.threadCount == 1, "IO thread failed to start");
+
+	KemuSnap snap = {0};
+	KemuSnap refSnap = {0};
+	kemuSys_snapshot(&sys, &snap);
+	kemuSys_snapshot(&ref, &refSnap);
+	kemuDev_unitBusy(&ref);
+	kemuDev_unitBusy(&sys);
+	KEMU_UNIT_CHECK(kemuSys_restore(&sys, &snap) == KEMU_SUCCESS, "restore with an IO thread failed");
+	kemuSys_restore(&ref, &refSnap);
+	uint8_t same = 1;
+	while(same && !ref.quitFlag && ref.emuCycle < 100000){
+		kemuDev_run(&ref, 7);
+		kemuDev_run(&sys, 7);
+		same = kemuUnit_sameState(&ref, &sys, "block IO thread");
+	}
+	KEMU_UNIT_CHECK(same && sys.quitFlag, "IO thread run differs from the main thread run at cycle %lu", sys.emuCycle);
+
+	//Block 1 of the DATA_DEV from the program at 0x4000
+	KemuDev *data = kemuDev_devByType(&sys, DATA_DEV, 0);
+	KemuDev_block *reg = (void *)kemuDev_devByType(&sys, BLOCK_DEV, 0)->bank[0];
+	reg->devID = data->devID;
+	reg->lbaLo = 1;
+	reg->lbaHi = 0;
+	reg->count = 1;
+	reg->vasAddr = 0x4000;
+	sys.quitFlag = 0;
+	kemuSys_storeVAS(&sys, KEMU_UNIT_IO_PAGE << KEMU_PAGE_SHIFT, WRITE_BLOCK);
+	while(reg->io.status == BUSY_STATUS && sys.emuCycle < 200000){
+		kemuDev_run(&sys, 7);
+	}
+	uint16_t vas[KEMU_PAGE_SIZE];
+	kemuSys_readVAS(&sys, 0x4000, vas, KEMU_PAGE_SIZE);
+	KEMU_UNIT_CHECK(reg->io.status == DONE_STATUS && memcmp(&data->data[KEMU_PAGE_SIZE], vas, sizeof(vas)) == 0,
+		"block write with an IO thread ended with status %u or missed the target", reg->io.status);
+	kemuSnap_free(&snap);
+	kemuSnap_free(&refSnap);
+	kemuSys_free(&sys);
+	kemuSys_free(&ref);
+}
+
+/**
+ * @brief Block completion lands on the same instruction for every quantum
+ * JIT_ENGINE finishes the block running at the event, so it is compared against itself and only the loop count against INTERP_ENGINE
+ */
+void kemuDev_unitBlock(){
+	uint16_t prog[0x103];
+	size_t words;
+	KemuSys interp;
+	kemuDev_unitIoBoot(&interp, INTERP_ENGINE, BLOCK_DEV, NULL, 0);
+	kemuDev_blockProg(prog, &words, kemuDev_devByType(&interp, DATA_DEV, 0)->devID);
+	kemuSys_free(&interp);
+
+	kemuDev_unitIoBoot(&interp, INTERP_ENGINE, BLOCK_DEV, prog, words);
+	kemuDev_unitDelay(&interp, 0x4013, 2 * KEMU_BLOCK_CYCLES, "block");
+	kemuUnit_run(&interp, 1, 100000);
+	KemuDev_CPU *cpu = kemuUnit_cpu(&interp);
+	KEMU_UNIT_CHECK(cpu->rw[0] && cpu->pc >= 0x4101 && cpu->pc <= 0x4102, "block read did not stop the spin loop, R0 %u pc %04X", cpu->rw[0], cpu->pc);
+
+	const uint64_t quantum[] = { 1, 7, 1000, 100000 };
+	const uint8_t engine[] = { INTERP_ENGINE, JIT_ENGINE };
+	for(uint8_t e=0; e<sizeof(engine)/sizeof(engine[0]); e++){
+		KemuSys ref;
+		kemuDev_unitIoBoot(&ref, engine[e], BLOCK_DEV, prog, words);
+		kemuUnit_run(&ref, 1, 100000);
+		KEMU_UNIT_CHECK(kemuUnit_cpu(&ref)->rw[0] == cpu->rw[0], "engine %u looped %u times, interpreter %u", engine[e], kemuUnit_cpu(&ref)->rw[0], cpu->rw[0]);
+		for(uint8_t i=1; i<sizeof(quantum)/sizeof(quantum[0]); i++){
+			KemuSys sys;
+			kemuDev_unitIoBoot(&sys, engine[e], BLOCK_DEV, prog, words);
+			kemuUnit_run(&sys, quantum[i], 100000);
+			char label[48];
+			snprintf(label, sizeof(label), "block engine %u quantum %lu", engine[e], quantum[i]);
+			KEMU_UNIT_CHECK(kemuUnit_sameState(&ref, &sys, label), "%s", label);
+			kemuSys_free(&sys);
+		}
+		kemuSys_free(&ref);
+	}
+	kemuDev_unitBlockCancel(prog, words, cpu->rw[0]);
+	kemuDev_unitBlockThread(prog, words);
+	kemuSys_free(&interp);
+}
+
+/**
+ * @brief DMA fill status turns done the transfer time after the submitting store
+ */
+void kemuDev_unitDma(){
+	#include "kemugon/sys/instr.h"
+	const uint16_t reg = KEMU_UNIT_IO_PAGE << KEMU_PAGE_SHIFT;
+	uint16_t prog[] = {
+		KEMU_ASM_EXT(LD, R1, reg + 5),			//4000 dst
+		KEMU_ASM_EXT(LD, R2, 0x0800),				//4002
+		KEMU_ASM(ST, R1, R2),						//4004
+		KEMU_ASM_EXT(LD, R1, reg + 6),			//4005 length
+		KEMU_ASM_EXT(LD, R2, 0x0400),				//4007
+		KEMU_ASM(ST, R1, R2),						//4009
+		KEMU_ASM_EXT(LD, R1, reg),					//400A command
+		KEMU_ASM(LD, R2, FILL_DMA),				//400C
+		KEMU_ASM(ST, R1, R2),						//400D
+		KEMU_ASM(ADD, R0, 1),						//400E
+		KEMU_ASM_EXT(JMP, 0, 0x400E),				//400F
+	};
+	KemuSys sys;
+	kemuDev_unitIoBoot(&sys, INTERP_ENGINE, DMA_DEV, prog, sizeof(prog)/sizeof(prog[0]));
+	kemuDev_unitDelay(&sys, 0x400D, 0x0400 / KEMU_DMA_WORDS_PER_CYCLE + 1, "dma");
+	kemuSys_free(&sys);
+}
+
+/**
+ * @brief Pending event time of devID, UINT64_MAX if none
+ */
+uint64_t kemuDev_unitEventTime(const KemuSched *sched, const uint8_t devID){
+	for(size_t i=0; i<sched->count; i++){
+		if(sched->event[i].devID == devID){
+			return sched->event[i].time;
+		}
+	}
+	return UINT64_MAX;
+}
+
+/**
+ * @brief A CPU with clockDiv 3 fires on multiples of 3 and runs as the undivided CPU does in quanta 3 times shorter
+ * A snapshot taken off the phase restores the pending event, and the run continues as it would have
+ */
+void kemuDev_unitClockDiv(){
+	#include "kemugon/sys/instr.h"
+	uint16_t spin[] = {
+		KEMU_ASM(ADD, R0, 1),						//4000
+		KEMU_ASM_EXT(JMP, 0, 0x4000),				//4001
+	};
+	const size_t words = sizeof(spin)/sizeof(spin[0]);
+	KemuSys sys, ref;
+	kemuUnit_boot(&sys, INTERP_ENGINE, spin, words);
+	kemuUnit_boot(&ref, INTERP_ENGINE, spin, words);
+	KemuDev *cpuDev = kemuDev_devByType(&sys, CPU_DEV, 0);
+	cpuDev->clockDiv = 3;
+
+	uint32_t offPhase = 0;
+	uint32_t offPace = 0;
+	KemuDev_CPU *cpu = kemuUnit_cpu(&sys);
+	for(uint8_t i=0; i<50; i++){
+		offPhase += kemuDev_unitEventTime(&sys.sched, cpuDev->devID) % 3 != 0;
+		kemuDev_run(&sys, 3 * 7);
+		kemuDev_run(&ref, 7);
+		offPace += sys.insRetired != ref.insRetired || cpu->reg[R0] != kemuUnit_cpu(&ref)->reg[R0] || cpu->pc != kemuUnit_cpu(&ref)->pc;
+	}
+	KEMU_UNIT_CHECK(offPhase == 0, "divided CPU fired off a multiple of 3 %u times", offPhase);
+	KEMU_UNIT_CHECK(offPace == 0, "divided CPU was off the pace of the undivided one after %u of 50 quanta", offPace);
+	kemuSys_free(&ref);
+	kemuSys_free(&sys);
+
+	//Quanta of 10 put the snapshot between two multiples of 3
+	kemuUnit_boot(&sys, INTERP_ENGINE, spin, words);
+	kemuUnit_boot(&ref, INTERP_ENGINE, spin, words);
+	cpuDev = kemuDev_devByType(&sys, CPU_DEV, 0);
+	cpuDev->clockDiv = 3;
+	kemuDev_devByType(&ref, CPU_DEV, 0)->clockDiv = 3;
+	kemuUnit_run(&sys, 10, 50);
+	kemuUnit_run(&ref, 10, 50);
+	KemuSnap snap = {0};
+	KEMU_UNIT_CHECK(sys.emuCycle % 3 != 0 && kemuSys_snapshot(&sys, &snap) == KEMU_SUCCESS, "snapshot at cycle %lu failed", sys.emuCycle);
+	uint64_t pending = kemuDev_unitEventTime(&sys.sched, cpuDev->devID);
+	kemuUnit_run(&sys, 10, 200);
+	KEMU_UNIT_CHECK(kemuSys_restore(&sys, &snap) == KEMU_SUCCESS, "restore failed");
+	KEMU_UNIT_CHECK(kemuDev_unitEventTime(&sys.sched, cpuDev->devID) == pending, "restore moved the pending event from %lu", pending);
+	for(uint8_t i=0; i<20; i++){
+		offPhase += kemuDev_unitEventTime(&sys.sched, cpuDev->devID) % 3 != 0;
+		kemuDev_run(&sys, 10);
+		kemuDev_run(&ref, 10);
+	}
+	KEMU_UNIT_CHECK(offPhase == 0, "restored CPU fired off a multiple of 3 %u times", offPhase);
+	KEMU_UNIT_CHECK(kemuUnit_sameState(&ref, &sys, "clockDiv restore"), "restored divided CPU differs from an uninterrupted run");
+	kemuSnap_free(&snap);
+	kemuSys_free(&ref);
+	kemuSys_free(&sys);
+}
+
+void kemuDev_unit(){
+	kemuDev_unitBlock();
+	kemuDev_unitDma();
+	kemuDev_unitClockDiv();
+
+	printf("kemuDev_unit Done\n");
+}
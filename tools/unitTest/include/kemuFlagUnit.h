@@ -0,0 +1,130 @@
+/**
+ * @file kemuFlagUnit.h
+ *
+ * @brief Lazily computed carry and overflow match their definition wherever they are read
+ */
+
+#pragma once
+
+#include "./kemuUnit.h"
+#include "kemugon/sys/sysSnap.h"
+
+/**
+ * @brief ALU instruction on dst and src with the flags it must leave
+ */
+typedef struct {
+	uint8_t op;
+	uint16_t dst;
+	uint16_t src;
+	uint16_t flags;
+}KemuFlag_case;
+
+/**
+ * @brief Materializes the flags of the case through JC and JV, R1 = carry, R2 = overflow
+ * A carry and overflow ADD comes first, so the case has to replace its pending flags
+ * SHR and DIV in between leave flags alone
+ */
+void kemuFlag_readProg(uint16_t *prog, size_t *words, const KemuFlag_case *test){
+	#include "kemugon/sys/instr.h"
+	uint16_t code[] = {
+		KEMU_ASM_EXT(LD, R3, 0x8000),			//4000
+		KEMU_ASM_EXT(ADD, R3, 0x8000),		//4002
+		KEMU_ASM_EXT(LD, R0, test->dst),		//4004
+		KEMU_ASM_EXT(test->op, R0, test->src),	//4006
+		KEMU_ASM(SHR, R3, 1),						//4008
+		KEMU_ASM(DIV, R3, 3),						//4009
+		KEMU_ASM_EXT(JC, 0, 0x400F),			//400A
+		KEMU_ASM_EXT(JMP, 0, 0x4010),			//400C
+		KEMU_ASM(NOP, 0, 0),						//400E
+		KEMU_ASM(LD, R1, 1),						//400F
+		KEMU_ASM_EXT(JV, 0, 0x4015),			//4010
+		KEMU_ASM_EXT(JMP, 0, 0x4016),			//4012
+		KEMU_ASM(NOP, 0, 0),						//4014
+		KEMU_ASM(LD, R2, 1),						//4015
+		KEMU_ASM(TRM, 0, 0),						//4016
+	};
+	memcpy(prog, code, sizeof(code));
+	*words = sizeof(code)/sizeof(code[0]);
+}
+
+/**
+ * @brief Flags read by JC and JV on both engines, with pending flags carried across every quantum end or not
+ */
+void kemuFlag_unitRead(const KemuFlag_case *test){
+	#include "kemugon/sys/instr.h"
+	uint16_t prog[32];
+	size_t words;
+	kemuFlag_readProg(prog, &words, test);
+	const uint8_t engine[] = { INTERP_ENGINE, JIT_ENGINE };
+	const uint64_t quantum[] = { 1, 10000 };
+	for(uint8_t e=0; e<sizeof(engine)/sizeof(engine[0]); e++){
+		for(uint8_t q=0; q<sizeof(quantum)/sizeof(quantum[0]); q++){
+			KemuSys sys;
+			kemuUnit_boot(&sys, engine[e], prog, words);
+			kemuUnit_run(&sys, quantum[q], 1000);
+			KemuDev_CPU *cpu = kemuUnit_cpu(&sys);
+			uint16_t flags = (cpu->reg[R1] ? CARRY_CPU : 0) | (cpu->reg[R2] ? OVERFLOW_CPU : 0);
+			KEMU_UNIT_CHECK(sys.quitFlag && flags == test->flags, "op %u %04X, %04X engine %u quantum %lu: JC/JV saw flags %u, expected %u",
+				test->op, test->dst, test->src, engine[e], quantum[q], flags, test->flags);
+			kemuSys_free(&sys);
+		}
+	}
+}
+
+/**
+ * @brief Flags nothing read stay pending until settled, a snapshot settles them
+ */
+void kemuFlag_unitSettle(const KemuFlag_case *test){
+	#include "kemugon/sys/instr.h"
+	uint16_t prog[] = {
+		KEMU_ASM_EXT(LD, R0, test->dst),		//4000
+		KEMU_ASM_EXT(test->op, R0, test->src),	//4002
+		KEMU_ASM(TRM, 0, 0),						//4004
+	};
+	const uint8_t engine[] = { INTERP_ENGINE, JIT_ENGINE };
+	for(uint8_t e=0; e<sizeof(engine)/sizeof(engine[0]); e++){
+		KemuSys sys;
+		kemuUnit_boot(&sys, engine[e], prog, sizeof(prog)/sizeof(prog[0]));
+		kemuUnit_run(&sys, 10000, 1000);
+		KemuDev_CPU *cpu = kemuUnit_cpu(&sys);
+		KEMU_UNIT_CHECK(cpu->flagOp == test->op, "engine %u computed flags nothing read", engine[e]);
+
+		KemuSnap snap = {0};
+		KEMU_UNIT_CHECK(kemuSys_snapshot(&sys, &snap) == KEMU_SUCCESS, "snapshot failed");
+		KEMU_UNIT_CHECK(cpu->flagOp == NOP && cpu->flags == test->flags, "op %u %04X, %04X engine %u: snapshot settled flags %u, expected %u",
+			test->op, test->dst, test->src, engine[e], cpu->flags, test->flags);
+		kemuSnap_free(&snap);
+		kemuSys_free(&sys);
+	}
+}
+
+void kemuFlag_unit(){
+	#include "kemugon/sys/instr.h"
+	const uint16_t both = CARRY_CPU | OVERFLOW_CPU;
+	const KemuFlag_case test[] = {
+		{ ADD, 0x0001, 0x0001, 0 },
+		{ ADD, 0xFFFF, 0x0001, CARRY_CPU },
+		{ ADD, 0x7FFF, 0x0001, OVERFLOW_CPU },
+		{ ADD, 0x8000, 0x8000, both },
+		{ SUB, 0x0005, 0x0005, 0 },
+		{ SUB, 0x0000, 0x0001, CARRY_CPU },
+		{ SUB, 0x8000, 0x0001, OVERFLOW_CPU },
+		{ SUB, 0x7FFF, 0xFFFF, both },
+		{ MUL, 0x0003, 0x0005, 0 },
+		{ MUL, 0xFFFF, 0xFFFF, CARRY_CPU },
+		{ MUL, 0x4000, 0x0002, OVERFLOW_CPU },
+		{ MUL, 0x0100, 0x0100, both },
+		{ SHL, 0x8001, 0x0010, 0 },				//Shift count wraps to 0
+		{ SHL, 0x4000, 0x0001, OVERFLOW_CPU },
+		{ SHL, 0xC000, 0x0001, CARRY_CPU },
+		{ SHL, 0x0003, 0x000F, both },
+	};
+	for(uint8_t i=0; i<sizeof(test)/sizeof(test[0]); i++){
+		KEMU_UNIT_CHECK(kemuDev_aluFlags(test[i].op, test[i].dst, test[i].src) == test[i].flags, "op %u %04X, %04X flags %u, expected %u",
+			test[i].op, test[i].dst, test[i].src, kemuDev_aluFlags(test[i].op, test[i].dst, test[i].src), test[i].flags);
+		kemuFlag_unitRead(&test[i]);
+		kemuFlag_unitSettle(&test[i]);
+	}
+
+	printf("kemuFlag_unit Done\n");
+}
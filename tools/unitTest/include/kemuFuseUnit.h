@@ -0,0 +1,126 @@
+/**
+ * @file kemuFuseUnit.h
+ *
+ * @brief Superinstructions give the same state at every quantum boundary as the instructions they replace
+ */
+
+#pragma once
+
+#include "./kemuUnit.h"
+
+/**
+ * @brief 64 iterations over every superinstruction and the register patterns that must not fuse, then TRM
+ * Stores go to page 3, so the loop's own code is never dropped
+ */
+void kemuFuse_prog(uint16_t *prog, size_t *words){
+	#include "kemugon/sys/instr.h"
+	uint16_t code[] = {
+		KEMU_ASM_EXT(LD, R2, 0x0300),			//4000
+		//loop
+		KEMU_ASM(SHL, R0, 8),						//4002 PACK_ST
+		KEMU_ASM(OR, R0, R1),						//4003
+		KEMU_ASM(ST, R2, R0),						//4004
+		KEMU_ASM_EXT(ADD, R1, 0x0137),		//4005 followed by SHL, none
+		KEMU_ASM(SHL, R3, 4),						//4007 ORs into another register, none
+		KEMU_ASM(OR, R0, R3),						//4008
+		KEMU_ASM(SHL, R0, 1),						//4009 PACK_ST, source is the shifted register
+		KEMU_ASM(OR, R0, R0),						//400A
+		KEMU_ASM(ST, R2, R0),						//400B
+		KEMU_ASM(SHL, R3, 3),						//400C PACK, stores another register
+		KEMU_ASM(OR, R3, R1),						//400D
+		KEMU_ASM(ST, R2, R1),						//400E
+		KEMU_ASM_EXT(LD, R4, 0x0310),			//400F LD_LD_ST
+		KEMU_ASM(LD, R5, 0x21),					//4011
+		KEMU_ASM(ST, R4, R5),						//4012
+		KEMU_ASM(LD, R4, 1),						//4013 LD_LD_ST, second load overwrites the first
+		KEMU_ASM_EXT(LD, R4, 0x0320),			//4014
+		KEMU_ASM(ST, R4, R0),						//4016
+		KEMU_ASM(ADD, R2, 1),						//4017 ADD_ST, through the added register
+		KEMU_ASM(ST, R2, R3),						//4018
+		KEMU_ASM_EXT(ADD, R6, 0x1000),		//4019 ADD_ST, of the added register
+		KEMU_ASM(ST, R2, R6),						//401B
+		KEMU_ASM(LD, R5, 5),						//401C LD_LD
+		KEMU_ASM_EXT(LD, R4, 0x0330),			//401D
+		KEMU_ASM_EXT(ADD, R7, 0x0400),		//401F followed by JC, none
+		KEMU_ASM_EXT(JC, 0, 0x4025),			//4021
+		KEMU_ASM_EXT(JMP, 0, 0x4002),			//4023
+		KEMU_ASM(TRM, 0, 0),						//4025
+	};
+	memcpy(prog, code, sizeof(code));
+	*words = sizeof(code)/sizeof(code[0]);
+}
+
+/**
+ * @brief Every quantum of quantumCycles ends on the state a 1 cycle quantum reaches at the same cycle
+ * A 1 cycle quantum never runs past the first instruction of a superinstruction, so it is the unfused reference
+ */
+void kemuFuse_unitQuantum(KemuSys *sys, const uint16_t *prog, const size_t words, const uint64_t quantumCycles){
+	KemuSys ref;
+	kemuUnit_boot(sys, INTERP_ENGINE, prog, words);
+	kemuUnit_boot(&ref, INTERP_ENGINE, prog, words);
+	char label[48];
+	snprintf(label, sizeof(label), "fused quantum %lu", quantumCycles);
+	uint8_t same = 1;
+	while(same && !sys->quitFlag && sys->emuCycle < 100000){
+		kemuDev_run(sys, quantumCycles);
+		while(!ref.quitFlag && ref.emuCycle < sys->emuCycle){
+			kemuDev_run(&ref, 1);
+		}
+		same = kemuUnit_sameState(&ref, sys, label);
+	}
+	KEMU_UNIT_CHECK(same && sys->quitFlag, "%s differs at cycle %lu", label, sys->emuCycle);
+
+	#if KEMU_FUSE_HEAT
+		#include "kemugon/sys/instr.h"
+		const uint16_t head[][2] = {
+			{ 0x4002, PACK_ST_FUSED }, { 0x4005, NONE_FUSED }, { 0x4007, NONE_FUSED }, { 0x4009, PACK_ST_FUSED },
+			{ 0x400C, PACK_FUSED }, { 0x400F, LD_LD_ST_FUSED }, { 0x4013, LD_LD_ST_FUSED }, { 0x4017, ADD_ST_FUSED },
+			{ 0x4019, ADD_ST_FUSED }, { 0x401C, LD_LD_FUSED }, { 0x401F, NONE_FUSED },
+		};
+		for(uint8_t i=0; i<sizeof(head)/sizeof(head[0]); i++){
+			KEMU_UNIT_CHECK(sys->icache.heat[head[i][0]] >= KEMU_FUSE_HEAT, "%s: %04X never got hot", label, head[i][0]);
+			uint8_t fused = kemuDev_fuseCPU(sys, head[i][0]);
+			KEMU_UNIT_CHECK(fused == head[i][1], "%s: %04X fused as %u, expected %u", label, head[i][0], fused, head[i][1]);
+		}
+	#endif
+
+	kemuSys_free(&ref);
+}
+
+/**
+ * @brief Fused interpreter at quanta 1, 3, 7 and 10000 against itself at 1 cycle quanta, and its final state against JIT_ENGINE
+ * JIT_ENGINE does not fuse and finishes its block at the quantum end, so only its state at TRM is compared
+ */
+void kemuFuse_unitDiff(){
+	#include "kemugon/sys/instr.h"
+	uint16_t prog[64];
+	size_t words;
+	kemuFuse_prog(prog, &words);
+
+	KemuSys interp;
+	kemuFuse_unitQuantum(&interp, prog, words, 1);
+	KEMU_UNIT_CHECK(kemuUnit_cpu(&interp)->reg[R7] == 0 && interp.insRetired > 64 * 27, "loop did not run to the carry");
+	const uint64_t quantum[] = { 3, 7, 10000 };
+	for(uint8_t i=0; i<sizeof(quantum)/sizeof(quantum[0]); i++){
+		KemuSys sys;
+		kemuFuse_unitQuantum(&sys, prog, words, quantum[i]);
+		kemuSys_free(&sys);
+	}
+	const uint64_t jitQuantum[] = { 1, 3, 7, 10000 };
+	for(uint8_t i=0; i<sizeof(jitQuantum)/sizeof(jitQuantum[0]); i++){
+		KemuSys jit;
+		kemuUnit_boot(&jit, JIT_ENGINE, prog, words);
+		kemuUnit_run(&jit, jitQuantum[i], 100000);
+		char label[48];
+		snprintf(label, sizeof(label), "jit quantum %lu", jitQuantum[i]);
+		KEMU_UNIT_CHECK(jit.quitFlag && kemuUnit_sameState(&interp, &jit, label), "%s differs from the fused interpreter", label);
+		kemuSys_free(&jit);
+	}
+	kemuSys_free(&interp);
+}
+
+void kemuFuse_unit(){
+	kemuFuse_unitDiff();
+
+	printf("kemuFuse_unit Done\n");
+}
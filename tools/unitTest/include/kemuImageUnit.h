@@ -0,0 +1,114 @@
+/**
+ * @file kemuImageUnit.h
+ *
+ * @brief Machine images resume exactly, crafted headers are rejected before sys is modified
+ */
+
+#pragma once
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "./kemuUnit.h"
+#include "kemugon/sys/sysImage.h"
+
+#define KEMU_UNIT_IMAGE "kemuUnitImage.img"
+
+/**
+ * @brief Allocated machine without devices, as kemuSys_loadImage expects it
+ */
+void kemuImage_unitEmpty(KemuSys *sys){
+	*sys = (KemuSys){
+		.emuClockSpeed  = 4194304U,
+		.hostClockSpeed = 3700003502U,
+		.quantumCycles = 4194U,
+		.pageSize = KEMU_PAGE_SIZE,
+	};
+	kemuSys_alloc(sys);
+}
+
+/**
+ * @brief Save a running machine, load it into an empty one and run both further
+ */
+void kemuImage_unitResume(){
+	#include "kemugon/sys/instr.h"
+	uint16_t prog[] = {
+		KEMU_ASM_EXT(LD, R2, 0x0200),			//4000
+		//loop
+		KEMU_ASM_EXT(ADD, R0, 0x0123),		//4002
+		KEMU_ASM(ST, R2, R0),					//4004
+		KEMU_ASM(ADD, R2, 1),					//4005
+		KEMU_ASM_EXT(JMP, 0, 0x4002),			//4006
+	};
+	KemuSys ref, sys;
+	kemuUnit_boot(&ref, INTERP_ENGINE, prog, sizeof(prog)/sizeof(prog[0]));
+	kemuUnit_run(&ref, 1000, 3000);
+	KEMU_UNIT_CHECK(kemuSys_saveImage(&ref, KEMU_UNIT_IMAGE) == KEMU_SUCCESS, "save failed");
+
+	kemuImage_unitEmpty(&sys);
+	KEMU_UNIT_CHECK(kemuSys_loadImage(&sys, KEMU_UNIT_IMAGE) == KEMU_SUCCESS, "load failed");
+	KEMU_UNIT_CHECK(kemuUnit_sameState(&ref, &sys, "loaded"), "loaded state differs");
+	kemuUnit_run(&ref, 1000, 2000);
+	kemuUnit_run(&sys, 1000, 2000);
+	KEMU_UNIT_CHECK(kemuUnit_sameState(&ref, &sys, "after load"), "run after load differs");
+
+	kemuSys_free(&sys);
+	kemuSys_free(&ref);
+}
+
+/**
+ * @brief RAM record of the saved image rewritten with bankSize and bankCount, must fail to load
+ */
+void kemuImage_unitCrafted(const uint8_t *file, const size_t size, const uint64_t bankSize, const uint64_t bankCount){
+	uint8_t *crafted = malloc(size);
+	memcpy(crafted, file, size);
+	KemuImage_head *head = (void *)crafted;
+	for(uint32_t i=0; i<head->devCount; i++){
+		if(head->dev[i].type == RAM_DEV){
+			head->dev[i].bankSize = bankSize;
+			head->dev[i].bankCount = bankCount;
+		}
+	}
+	FILE *out = fopen(KEMU_UNIT_IMAGE, "wb");
+	fwrite(crafted, 1, size, out);
+	fclose(out);
+	free(crafted);
+
+	KemuSys sys;
+	kemuImage_unitEmpty(&sys);
+	KEMU_UNIT_CHECK(kemuSys_loadImage(&sys, KEMU_UNIT_IMAGE) == KEMU_FAIL, "bankSize %lu bankCount %lu loaded", bankSize, bankCount);
+	KEMU_UNIT_CHECK(kaelTree_empty(&sys.dev) && sys.imageBase == NULL, "rejected image modified sys");
+	kemuSys_free(&sys);
+}
+
+void kemuImage_unitReject(){
+	KemuSys sys;
+	kemuUnit_boot(&sys, INTERP_ENGINE, NULL, 0);
+	KEMU_UNIT_CHECK(kemuSys_saveImage(&sys, KEMU_UNIT_IMAGE) == KEMU_SUCCESS, "save failed");
+	kemuSys_free(&sys);
+
+	FILE *in = fopen(KEMU_UNIT_IMAGE, "rb");
+	fseek(in, 0, SEEK_END);
+	size_t size = ftell(in);
+	fseek(in, 0, SEEK_SET);
+	uint8_t *file = malloc(size);
+	size_t got = fread(file, 1, size, in);
+	fclose(in);
+	KEMU_UNIT_CHECK(got == size, "read %zu of %zu", got, size);
+
+	kemuImage_unitCrafted(file, size, 1ULL << 62, 4);			//Size wraps to 0
+	kemuImage_unitCrafted(file, size, 4, 1ULL << 62);
+	kemuImage_unitCrafted(file, size, 16*1024 - 64, 4);		//Fits, banks are not whole pages
+	kemuImage_unitCrafted(file, size, 0, 4);
+	kemuImage_unitCrafted(file, size, 16*1024, 5);				//Past end of file
+
+	free(file);
+	unlink(KEMU_UNIT_IMAGE);
+}
+
+void kemuImage_unit(){
+	kemuImage_unitResume();
+	kemuImage_unitReject();
+
+	printf("kemuImage_unit Done\n");
+}
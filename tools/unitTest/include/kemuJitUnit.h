@@ -0,0 +1,161 @@
+/**
+ * @file kemuJitUnit.h
+ *
+ * @brief JIT_ENGINE against INTERP_ENGINE on the same guest programs
+ */
+
+#pragma once
+
+#include "./kemuUnit.h"
+
+/**
+ * @brief Every ALU op, flag jumps, stores and a loop of 64 iterations ending in TRM
+ */
+void kemuJit_mixedProg(uint16_t *prog, size_t *words){
+	#include "kemugon/sys/instr.h"
+	uint16_t code[] = {
+		KEMU_ASM(LD, R0, 0),						//4000
+		KEMU_ASM_EXT(LD, R2, 0x0300),			//4001
+		KEMU_ASM_EXT(LD, R6, 0x1357),			//4003
+		//loop
+		KEMU_ASM_EXT(ADD, R1, 0x0777),		//4005
+		KEMU_ASM(SHL, R1, 1),					//4007
+		KEMU_ASM(OR, R3, R1),					//4008
+		KEMU_ASM(ST, R2, R3),					//4009
+		KEMU_ASM(ADD, R2, 1),					//400A
+		KEMU_ASM_EXT(SUB, R4, 0x0101),		//400B
+		KEMU_ASM_EXT(JV, 0, 0x4030),			//400D
+		KEMU_ASM(MUL, R6, 5),					//400F
+		KEMU_ASM_EXT(LD, R7, 0x00FF),			//4010
+		KEMU_ASM(AND, R7, R6),					//4012
+		KEMU_ASM(SHR, R7, 2),					//4013
+		KEMU_ASM(DIV, R7, 3),					//4014
+		KEMU_ASM_EXT(ADD, R0, 0x0400),		//4015
+		KEMU_ASM_EXT(JC, 0, 0x4020),			//4017
+		KEMU_ASM_EXT(JMP, 0, 0x4005),			//4019
+		KEMU_ASM(NOP, 0, 0), KEMU_ASM(NOP, 0, 0), KEMU_ASM(NOP, 0, 0), KEMU_ASM(NOP, 0, 0), KEMU_ASM(NOP, 0, 0),
+		KEMU_ASM(TRM, 0, 0),						//4020
+		KEMU_ASM(NOP, 0, 0), KEMU_ASM(NOP, 0, 0), KEMU_ASM(NOP, 0, 0), KEMU_ASM(NOP, 0, 0), KEMU_ASM(NOP, 0, 0),
+		KEMU_ASM(NOP, 0, 0), KEMU_ASM(NOP, 0, 0), KEMU_ASM(NOP, 0, 0), KEMU_ASM(NOP, 0, 0), KEMU_ASM(NOP, 0, 0),
+		KEMU_ASM(NOP, 0, 0), KEMU_ASM(NOP, 0, 0), KEMU_ASM(NOP, 0, 0), KEMU_ASM(NOP, 0, 0), KEMU_ASM(NOP, 0, 0),
+		//overflow
+		KEMU_ASM(ADD, R5, 1),					//4030
+		KEMU_ASM_EXT(JMP, 0, 0x400F),			//4031
+	};
+	memcpy(prog, code, sizeof(code));
+	*words = sizeof(code)/sizeof(code[0]);
+}
+
+/**
+ * @brief Both engines end in the same state, whatever the quantum
+ */
+void kemuJit_unitMatch(){
+	uint16_t prog[64];
+	size_t words;
+	kemuJit_mixedProg(prog, &words);
+
+	KemuSys ref;
+	kemuUnit_boot(&ref, INTERP_ENGINE, prog, words);
+	kemuUnit_run(&ref, 10000, UINT64_MAX);
+	KEMU_UNIT_CHECK(kemuUnit_cpu(&ref)->pc == 0x4021, "mixed program ended at %04X", kemuUnit_cpu(&ref)->pc);
+
+	const uint64_t quantum[] = { 1, 3, 7, 64, 10000 };
+	for(uint8_t i=0; i<sizeof(quantum)/sizeof(quantum[0]); i++){
+		KemuSys jit;
+		kemuUnit_boot(&jit, JIT_ENGINE, prog, words);
+		kemuUnit_run(&jit, quantum[i], UINT64_MAX);
+		char label[32];
+		snprintf(label, sizeof(label), "jit quantum %lu", quantum[i]);
+		KEMU_UNIT_CHECK(kemuUnit_sameState(&ref, &jit, label), "%s", label);
+		kemuSys_free(&jit);
+	}
+	kemuSys_free(&ref);
+}
+
+/**
+ * @brief Blocks chained into a loop still leave the arena once the budget is spent
+ */
+void kemuJit_unitChain(){
+	#include "kemugon/sys/instr.h"
+	uint16_t prog[0x14] = {
+		KEMU_ASM(ADD, R0, 1),					//4000
+		KEMU_ASM_EXT(JMP, 0, 0x4010),			//4001
+		[0x10] = KEMU_ASM(ADD, R1, 1),		//4010
+		KEMU_ASM_EXT(JMP, 0, 0x4000),			//4011
+	};
+	KemuSys interp;
+	kemuUnit_boot(&interp, INTERP_ENGINE, prog, sizeof(prog)/sizeof(prog[0]));
+	uint64_t interpSpent = kemuDev_run(&interp, 1000);
+
+	KemuSys jit;
+	kemuUnit_boot(&jit, JIT_ENGINE, prog, sizeof(prog)/sizeof(prog[0]));
+	uint64_t jitSpent = kemuDev_run(&jit, 1000);
+	jitSpent += kemuDev_run(&jit, 1000);
+
+	KemuDev_CPU *cpu = kemuUnit_cpu(&jit);
+	KEMU_UNIT_CHECK(interpSpent == 1000, "interpreter spent %lu of 1000", interpSpent);
+	KEMU_UNIT_CHECK(jitSpent >= 2000 && jitSpent < 2000 + 8, "chained blocks spent %lu of 2000", jitSpent);
+	KEMU_UNIT_CHECK(cpu->reg[R0] + cpu->reg[R1] == jit.insRetired / 2, "R0 %u R1 %u after %lu instructions", cpu->reg[R0], cpu->reg[R1], jit.insRetired);
+	kemuSys_free(&jit);
+	kemuSys_free(&interp);
+}
+
+/**
+ * @brief A block jumping to itself is chained to itself instead of exiting every iteration
+ */
+void kemuJit_unitSelfLink(){
+	#include "kemugon/sys/instr.h"
+	uint16_t prog[] = {
+		KEMU_ASM(ADD, R0, 1),					//4000
+		KEMU_ASM_EXT(JMP, 0, 0x4000),			//4001
+	};
+	KemuSys sys;
+	kemuUnit_boot(&sys, JIT_ENGINE, prog, sizeof(prog)/sizeof(prog[0]));
+	uint64_t spent = kemuDev_run(&sys, 1000);
+
+	KemuJit *jit = &sys.jit;
+	uint8_t *block = jit->block[BOOT_ADDR];
+	KEMU_UNIT_CHECK(block != NULL, "self loop not compiled");
+	if(block){
+		//Block ends in jmp rel32 to the chained block
+		int32_t rel;
+		memcpy(&rel, jit->arena + jit->used - 4, sizeof(rel));
+		KEMU_UNIT_CHECK(jit->arena[jit->used - 5] == 0xE9 && jit->arena + jit->used + rel == block, "self loop not chained");
+	}
+	KEMU_UNIT_CHECK(spent >= 1000 && spent < 1000 + 8, "self loop spent %lu of 1000", spent);
+	KEMU_UNIT_CHECK(kemuUnit_cpu(&sys)->reg[R0] == sys.insRetired / 2, "R0 %u after %lu instructions", kemuUnit_cpu(&sys)->reg[R0], sys.insRetired);
+	kemuSys_free(&sys);
+}
+
+/**
+ * @brief Machine allocated for INTERP_ENGINE switches to JIT_ENGINE mid-run
+ */
+void kemuJit_unitSwitch(){
+	uint16_t prog[64];
+	size_t words;
+	kemuJit_mixedProg(prog, &words);
+
+	KemuSys ref;
+	kemuUnit_boot(&ref, INTERP_ENGINE, prog, words);
+	kemuUnit_run(&ref, 10000, UINT64_MAX);
+
+	KemuSys sys;
+	kemuUnit_boot(&sys, INTERP_ENGINE, prog, words);
+	kemuUnit_run(&sys, 100, 300);
+	KEMU_UNIT_CHECK(sys.jit.arena == NULL, "arena allocated for INTERP_ENGINE");
+	sys.engine = JIT_ENGINE;
+	kemuUnit_run(&sys, 100, UINT64_MAX);
+	KEMU_UNIT_CHECK(sys.jit.arena != NULL && sys.jit.blockCount, "JIT_ENGINE still interpreting after switch");
+	KEMU_UNIT_CHECK(kemuUnit_sameState(&ref, &sys, "engine switch"), "engine switch");
+	kemuSys_free(&sys);
+	kemuSys_free(&ref);
+}
+
+void kemuJit_unit(){
+	kemuJit_unitMatch();
+	kemuJit_unitChain();
+	kemuJit_unitSelfLink();
+	kemuJit_unitSwitch();
+
+	printf("kemuJit_unit Done\n");
+}
@@ -0,0 +1,193 @@
+/**
+ * @file kemuProgUnit.h
+ *
+ * @brief Program images load into VAS as saved, and images with crafted headers are refused before the machine changes
+ */
+
+#pragma once
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "./kemuUnit.h"
+#include "kemugon/sys/sysProg.h"
+
+#define KEMU_UNIT_PROG "kemuUnitProg.img"
+#define KEMU_UNIT_PROG_BAD "kemuUnitProgBad.img"
+#define KEMU_UNIT_PROG_ENTRY 0x4004
+#define KEMU_UNIT_PROG_RAM 0x80
+
+/**
+ * @brief Unit machine with its RAM moved to the last row, so program rows win everywhere they map
+ */
+void kemuProg_unitBoot(KemuSys *sys, const uint8_t engine){
+	kemuUnit_boot(sys, engine, NULL, 0);
+	KemuSys_pageEntry ram = { .devID = kemuDev_devByType(sys, RAM_DEV, 0)->devID, .pageIndex = 0, .firstBank = 0, .lastBank = 3 };
+	kemuSys_setRow(sys, KEMU_PAGE_ROWS - 1, ram);
+	kemuSys_writeRow(sys, KEMU_PAGE_ROWS - 1, ram);
+	kemuSys_setRow(sys, 0, (KemuSys_pageEntry){0});
+	kemuSys_writeRow(sys, 0, (KemuSys_pageEntry){0});
+}
+
+/**
+ * @brief ROM code section at BOOT_ADDR on row 0 and a RAM section at KEMU_UNIT_PROG_RAM on row 1
+ * Code before KEMU_UNIT_PROG_ENTRY is TRM, the entry stores to both sections
+ */
+uint8_t kemuProg_unitSave(uint16_t *code, uint16_t *ram){
+	#include "kemugon/sys/instr.h"
+	const uint16_t prog[] = {
+		KEMU_ASM(TRM, 0, 0),							//4000
+		KEMU_ASM(TRM, 0, 0),							//4001
+		KEMU_ASM(TRM, 0, 0),							//4002
+		KEMU_ASM(TRM, 0, 0),							//4003
+		KEMU_ASM_EXT(LD, R1, KEMU_UNIT_PROG_RAM << KEMU_PAGE_SHIFT | 1),	//4004
+		KEMU_ASM_EXT(LD, R2, 0x1234),				//4006
+		KEMU_ASM(ST, R1, R2),						//4008
+		KEMU_ASM_EXT(LD, R1, 0x4080),				//4009 ROM
+		KEMU_ASM(ST, R1, R2),						//400B
+		KEMU_ASM(TRM, 0, 0),						//400C
+	};
+	memset(code, 0, KEMU_PAGE_SIZE * sizeof(uint16_t));
+	memcpy(code, prog, sizeof(prog));
+	for(uint16_t i=0; i<KEMU_PAGE_SIZE; i++){
+		ram[i] = 0xA000 + i;
+	}
+	const KemuProg_section section[] = {
+		{ .bankSize = KEMU_PAGE_SIZE, .bankCount = 1, .map = { .pageIndex = BOOT_ADDR >> KEMU_PAGE_SHIFT }, .row = 0, .type = DATA_DEV, .flags = ROM_SECTION },
+		{ .bankSize = KEMU_PAGE_SIZE, .bankCount = 1, .map = { .pageIndex = KEMU_UNIT_PROG_RAM }, .row = 1, .type = RAM_DEV },
+	};
+	const uint16_t *data[] = { code, ram };
+	return kemuProg_save(KEMU_UNIT_PROG, KEMU_UNIT_PROG_ENTRY, section, data, 2);
+}
+
+/**
+ * @brief Saved sections read back through VAS, the guest starts at the entry, its stores stay out of the file and the ROM
+ * Unloading removes the section devices and a reload sees the file as saved
+ */
+void kemuProg_unitRoundTrip(const uint8_t engine){
+	uint16_t code[KEMU_PAGE_SIZE];
+	uint16_t ram[KEMU_PAGE_SIZE];
+	unlink(KEMU_UNIT_PROG);
+	KEMU_UNIT_CHECK(kemuProg_unitSave(code, ram) == KEMU_SUCCESS, "program image save failed");
+
+	KemuSys sys;
+	kemuProg_unitBoot(&sys, engine);
+	size_t devCount = kaelTree_length(&sys.dev);
+	for(uint8_t load=0; load<2; load++){
+		KEMU_UNIT_CHECK(kemuSys_loadProgram(&sys, KEMU_UNIT_PROG) == KEMU_SUCCESS, "engine %u load %u failed", engine, load);
+		KEMU_UNIT_CHECK(sys.progDevCount == 2 && kaelTree_length(&sys.dev) == devCount + 2, "engine %u load %u pushed %u section devices, expected 2",
+			engine, load, sys.progDevCount);
+		KemuDev_CPU *cpu = kemuUnit_cpu(&sys);
+		KEMU_UNIT_CHECK(cpu->pc == KEMU_UNIT_PROG_ENTRY, "engine %u load %u started at %04X, expected %04X", engine, load, cpu->pc, KEMU_UNIT_PROG_ENTRY);
+
+		uint16_t vas[KEMU_PAGE_SIZE];
+		kemuSys_readVAS(&sys, BOOT_ADDR, vas, KEMU_PAGE_SIZE);
+		KEMU_UNIT_CHECK(memcmp(vas, code, sizeof(vas)) == 0, "engine %u load %u: code section differs in VAS", engine, load);
+		kemuSys_readVAS(&sys, KEMU_UNIT_PROG_RAM << KEMU_PAGE_SHIFT, vas, KEMU_PAGE_SIZE);
+		KEMU_UNIT_CHECK(memcmp(vas, ram, sizeof(vas)) == 0, "engine %u load %u: RAM section differs in VAS", engine, load);
+
+		kemuUnit_run(&sys, 1000, 100000);
+		uint16_t word[2];
+		kemuSys_readVAS(&sys, KEMU_UNIT_PROG_RAM << KEMU_PAGE_SHIFT, word, 2);
+		KEMU_UNIT_CHECK(sys.quitFlag && word[0] == ram[0] && word[1] == 0x1234, "engine %u load %u: RAM section holds %04X %04X after the run, expected %04X 1234",
+			engine, load, word[0], word[1], ram[0]);
+		kemuSys_readVAS(&sys, 0x4080, word, 1);
+		KEMU_UNIT_CHECK(word[0] == code[0x80], "engine %u load %u: guest store reached the ROM section", engine, load);
+
+		kemuSys_unloadProgram(&sys);
+		KEMU_UNIT_CHECK(sys.progDevCount == 0 && sys.progBase == NULL && kaelTree_length(&sys.dev) == devCount, "engine %u load %u: unload left section devices", engine, load);
+		sys.quitFlag = 0;
+	}
+
+	//Guest stores went to private copies
+	uint16_t onDisk[KEMU_PAGE_SIZE];
+	int fd = open(KEMU_UNIT_PROG, O_RDONLY);
+	KemuProg_head head;
+	KemuProg_section section[2];
+	uint8_t got = fd >= 0 && pread(fd, &head, sizeof(head), 0) == sizeof(head) && pread(fd, section, sizeof(section), sizeof(head)) == sizeof(section);
+	got = got && pread(fd, onDisk, sizeof(onDisk), section[1].dataOffset) == sizeof(onDisk);
+	if(fd >= 0){
+		close(fd);
+	}
+	KEMU_UNIT_CHECK(got && memcmp(onDisk, ram, sizeof(onDisk)) == 0, "engine %u: guest stores reached the program image", engine);
+	kemuSys_free(&sys);
+	unlink(KEMU_UNIT_PROG);
+}
+
+/**
+ * @brief Images with one header field made invalid are refused, and leave devices, rows and pc as they were
+ */
+void kemuProg_unitCrafted(){
+	#include "kemugon/sys/instr.h"
+	uint16_t code[KEMU_PAGE_SIZE];
+	uint16_t ram[KEMU_PAGE_SIZE];
+	unlink(KEMU_UNIT_PROG);
+	KEMU_UNIT_CHECK(kemuProg_unitSave(code, ram) == KEMU_SUCCESS, "program image save failed");
+	int fd = open(KEMU_UNIT_PROG, O_RDONLY);
+	off_t size = fd >= 0 ? lseek(fd, 0, SEEK_END) : 0;
+	uint8_t *image = malloc(size);
+	uint8_t *bad = malloc(size);
+	KEMU_UNIT_CHECK(size > 0 && image && bad && pread(fd, image, size, 0) == size, "program image re-read failed");
+	if(fd >= 0){
+		close(fd);
+	}
+
+	KemuSys sys;
+	kemuProg_unitBoot(&sys, INTERP_ENGINE);
+	size_t devCount = kaelTree_length(&sys.dev);
+	KemuSys_pageEntry row[KEMU_PAGE_ROWS];
+	memcpy(row, sys.pageTable, sizeof(row));
+	uint64_t hostPage = sysconf(_SC_PAGESIZE);
+	for(uint8_t c=0; image && bad && c<15; c++){
+		memcpy(bad, image, size);
+		KemuProg_head *head = (void *)bad;
+		KemuProg_section *rom = &head->section[0];
+		KemuProg_section *data = &head->section[1];
+		size_t badSize = size;
+		switch(c){
+			case 0: head->magic[0] ^= 1; break;
+			case 1: head->version++; break;
+			case 2: head->pageShift++; break;
+			case 3: head->fileSize += hostPage; break;
+			case 4: head->sectionCount = KEMU_DEV_MAX; break;
+			case 5: badSize = sizeof(KemuProg_head) - 1; break;
+			case 6: rom->type = CPU_DEV; break;
+			case 7: data->bankSize = KEMU_PAGE_SIZE + 1; break;
+			case 8: data->bankSize = 0; break;
+			case 9: rom->map.lastBank = rom->bankCount; break;
+			case 10: rom->map.firstBank = 1; break;
+			case 11: rom->row = KEMU_PAGE_ROWS; break;
+			case 12: data->dataOffset += 2; break;
+			case 13: data->dataOffset = size; break;
+			case 14: data->bankCount = size; break;
+		}
+		unlink(KEMU_UNIT_PROG_BAD);
+		fd = open(KEMU_UNIT_PROG_BAD, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+		KEMU_UNIT_CHECK(fd >= 0 && pwrite(fd, bad, badSize, 0) == (ssize_t)badSize, "case %u: crafted image write failed", c);
+		if(fd >= 0){
+			close(fd);
+		}
+
+		KEMU_UNIT_CHECK(kemuSys_loadProgram(&sys, KEMU_UNIT_PROG_BAD) == KEMU_FAIL, "case %u: crafted image loaded", c);
+		KEMU_UNIT_CHECK(kaelTree_length(&sys.dev) == devCount && sys.progDevCount == 0 && sys.progBase == NULL, "case %u: refused image left devices", c);
+		KEMU_UNIT_CHECK(memcmp(row, sys.pageTable, sizeof(row)) == 0 && kemuUnit_cpu(&sys)->pc == BOOT_ADDR, "case %u: refused image changed rows or pc", c);
+		if(sys.progDevCount){
+			kemuSys_unloadProgram(&sys);
+		}
+	}
+	KEMU_UNIT_CHECK(kemuSys_loadProgram(&sys, KEMU_UNIT_PROG) == KEMU_SUCCESS, "untouched image failed to load after the refused ones");
+	kemuSys_free(&sys);
+	free(image);
+	free(bad);
+	unlink(KEMU_UNIT_PROG);
+	unlink(KEMU_UNIT_PROG_BAD);
+}
+
+void kemuProg_unit(){
+	#include "kemugon/sys/instr.h"
+	kemuProg_unitRoundTrip(INTERP_ENGINE);
+	kemuProg_unitRoundTrip(JIT_ENGINE);
+	kemuProg_unitCrafted();
+
+	printf("kemuProg_unit Done\n");
+}
@@ -0,0 +1,172 @@
+/**
+ * @file kemuSnapUnit.h
+ *
+ * @brief Restored and rewound machines continue exactly like one that never left
+ */
+
+#pragma once
+
+#include <unistd.h>
+
+#include "./kemuUnit.h"
+#include "kemugon/sys/sysSnap.h"
+#include "kemugon/sys/sysRewind.h"
+#include "kemugon/sys/sysImage.h"
+
+#define KEMU_UNIT_STREAM "kemuUnitStream.img"
+
+/**
+ * @brief Endless loop storing over 0x0200..0x1FFF and into the immediate of its own ADD
+ * The stride is added from page 0x41, which the loop never stores to
+ */
+void kemuSnap_storeProg(uint16_t *prog, size_t *words){
+	#include "kemugon/sys/instr.h"
+	uint16_t code[0x104] = {
+		KEMU_ASM_EXT(LD, R2, 0x0200),			//4000
+		KEMU_ASM_EXT(LD, R3, 0x1FFF),			//4002
+		KEMU_ASM_EXT(LD, R4, 0x0200),			//4004
+		KEMU_ASM_EXT(LD, R6, 0x4011),			//4006
+		//loop
+		KEMU_ASM_EXT(ADD, R1, 0x0101),		//4008
+		KEMU_ASM(ST, R2, R1),					//400A
+		KEMU_ASM_EXT(JMP, 0, 0x4100),			//400B
+		KEMU_ASM(AND, R2, R3),					//400D
+		KEMU_ASM(OR, R2, R4),					//400E
+		KEMU_ASM(ST, R6, R1),					//400F
+		KEMU_ASM_EXT(ADD, R5, 0),				//4010, immediate rewritten above
+		KEMU_ASM_EXT(JMP, 0, 0x4008),			//4012
+		[0x100] = KEMU_ASM_EXT(ADD, R2, 0x0011),	//4100
+		KEMU_ASM_EXT(JMP, 0, 0x400D),			//4102
+	};
+	memcpy(prog, code, sizeof(code));
+	*words = sizeof(code)/sizeof(code[0]);
+}
+
+/**
+ * @brief Restore after patching code and running past an incremental snapshot, then continue next to a machine that ran straight
+ */
+void kemuSnap_unitRestore(const uint8_t engine){
+	uint16_t prog[0x104];
+	size_t words;
+	kemuSnap_storeProg(prog, &words);
+
+	KemuSys sys, ref;
+	kemuUnit_boot(&sys, engine, prog, words);
+	kemuUnit_boot(&ref, engine, prog, words);
+
+	KemuSnap snap = {0};
+	kemuUnit_run(&sys, 1000, 5000);
+	KEMU_UNIT_CHECK(kemuSys_snapshot(&sys, &snap) == KEMU_SUCCESS, "full snapshot failed");
+	kemuUnit_run(&sys, 1000, 3000);
+	KEMU_UNIT_CHECK(kemuSys_snapshot(&sys, &snap) == KEMU_SUCCESS, "incremental snapshot failed");
+	//Patched code is decoded, the restore has to drop it again
+	uint16_t stride = 0x0013;
+	kemuSys_writeVAS(&sys, 0x4101, &stride, 1);
+	kemuUnit_run(&sys, 1000, 7000);
+	KEMU_UNIT_CHECK(kemuSys_restore(&sys, &snap) == KEMU_SUCCESS, "restore failed");
+
+	kemuUnit_run(&ref, 1000, 8000);
+	KEMU_UNIT_CHECK(kemuUnit_cpu(&ref)->rw[5] != 0, "store loop did not modify itself");
+	KEMU_UNIT_CHECK(kemuUnit_sameState(&ref, &sys, "restored"), "restored state differs, engine %u", engine);
+	kemuUnit_run(&sys, 1000, 4000);
+	kemuUnit_run(&ref, 1000, 4000);
+	KEMU_UNIT_CHECK(kemuUnit_sameState(&ref, &sys, "after restore"), "run after restore differs, engine %u", engine);
+
+	kemuSnap_free(&snap);
+	kemuSys_free(&ref);
+	kemuSys_free(&sys);
+}
+
+/**
+ * @brief Rewind 2ms over 1000 cycle frames, land on the newest frame not after the target and continue from it
+ */
+void kemuSnap_unitRewind(const uint8_t engine){
+	uint16_t prog[0x104];
+	size_t words;
+	kemuSnap_storeProg(prog, &words);
+
+	KemuSys sys, ref;
+	kemuUnit_boot(&sys, engine, prog, words);
+	kemuUnit_boot(&ref, engine, prog, words);
+	sys.rewindBudget = 1 << 20;
+	sys.rewindCycles = 1000;
+
+	uint64_t frameCycle[21];
+	for(uint8_t i=0; i<21; i++){
+		if(i){
+			kemuDev_run(&sys, 1000);
+		}
+		frameCycle[i] = sys.emuCycle;
+		KEMU_UNIT_CHECK(kemuSys_capture(&sys) == KEMU_SUCCESS, "capture %u failed", i);
+	}
+	//Writes past the newest frame, code included, are undone as well
+	uint16_t stride = 0x0013;
+	kemuSys_writeVAS(&sys, 0x4101, &stride, 1);
+	kemuDev_run(&sys, 500);
+
+	uint64_t target = sys.emuCycle - 2 * sys.emuClockSpeed / 1000;
+	KEMU_UNIT_CHECK(kemuSys_rewind(&sys, 2) == KEMU_SUCCESS, "rewind failed");
+	uint8_t frame = 0;
+	while(frame < 20 && frameCycle[frame + 1] <= target){
+		frame++;
+	}
+	KEMU_UNIT_CHECK(sys.emuCycle == frameCycle[frame], "rewound to cycle %lu, frame %u is at %lu", sys.emuCycle, frame, frameCycle[frame]);
+
+	for(uint8_t i=0; i<frame; i++){
+		kemuDev_run(&ref, 1000);
+	}
+	KEMU_UNIT_CHECK(kemuUnit_sameState(&ref, &sys, "rewound"), "rewound state differs, engine %u", engine);
+	kemuUnit_run(&sys, 1000, 4000);
+	kemuUnit_run(&ref, 1000, 4000);
+	KEMU_UNIT_CHECK(kemuUnit_sameState(&ref, &sys, "after rewind"), "run after rewind differs, engine %u", engine);
+
+	kemuSys_free(&ref);
+	kemuSys_free(&sys);
+}
+
+/**
+ * @brief A streamed device is refused by snapshot, restore, capture, rewind and saveImage, its banks are left as they are
+ * The streamed device replaces a DATA_DEV under the same devID after a snapshot was taken
+ */
+void kemuSnap_unitStreamed(){
+	KemuSys sys;
+	kemuUnit_boot(&sys, INTERP_ENGINE, NULL, 0);
+	KemuDev data = { .fd = -1, .head = { .bankSize = 4*1024, .bankCount = 1, .type = DATA_DEV } };
+	kemuSys_pushDev(&sys, &data);
+	uint8_t dataID = kemuDev_devByType(&sys, DATA_DEV, 0)->devID;
+	KemuSnap snap = {0};
+	KEMU_UNIT_CHECK(kemuSys_snapshot(&sys, &snap) == KEMU_SUCCESS, "snapshot failed");
+	sys.rewindBudget = 1 << 20;
+	KEMU_UNIT_CHECK(kemuSys_capture(&sys) == KEMU_SUCCESS, "capture failed");
+
+	kemuSys_popDev(&sys);
+	KemuDev stream = { .fd = -1, .path = KEMU_UNIT_STREAM, .cache = { .slotCount = 1 }, .head = { .bankSize = 4*1024, .bankCount = 2, .type = DATA_DEV } };
+	kemuSys_pushDev(&sys, &stream);
+	KemuDev *dev = kemuDev_devByType(&sys, DATA_DEV, 0);
+	KEMU_UNIT_CHECK(dev->store == STREAM_STORE && dev->devID == dataID, "stream device store %u devID %u, expected %u and %u", dev->store, dev->devID, STREAM_STORE, dataID);
+	uint16_t *bank = kemuSys_streamBank(&sys, dev, 1);
+	bank[0] = 0x1234;
+
+	KemuSnap streamSnap = {0};
+	KEMU_UNIT_CHECK(kemuSys_snapshot(&sys, &streamSnap) == KEMU_FAIL, "snapshot of a streamed device succeeded");
+	KEMU_UNIT_CHECK(kemuSys_restore(&sys, &snap) == KEMU_FAIL, "restore over a streamed device succeeded");
+	KEMU_UNIT_CHECK(kemuSys_capture(&sys) == KEMU_FAIL, "capture of a streamed device succeeded");
+	KEMU_UNIT_CHECK(kemuSys_rewind(&sys, 0) == KEMU_FAIL, "rewind over a streamed device succeeded");
+	KEMU_UNIT_CHECK(bank[0] == 0x1234, "refused restore or rewind modified the streamed bank");
+	KEMU_UNIT_CHECK(kemuSys_saveImage(&sys, KEMU_UNIT_STREAM ".image") == KEMU_FAIL, "machine image of a streamed device written");
+
+	kemuSnap_free(&streamSnap);
+	kemuSnap_free(&snap);
+	kemuSys_free(&sys);
+	unlink(KEMU_UNIT_STREAM);
+}
+
+void kemuSnap_unit(){
+	kemuSnap_unitRestore(INTERP_ENGINE);
+	kemuSnap_unitRestore(JIT_ENGINE);
+	kemuSnap_unitRewind(INTERP_ENGINE);
+	kemuSnap_unitRewind(JIT_ENGINE);
+	kemuSnap_unitStreamed();
+
+	printf("kemuSnap_unit Done\n");
+}
@@ -0,0 +1,432 @@
+/**
+ * @file kemuStoreUnit.h
+ *
+ * @brief Device stores keep their contents where they belong: in memory, in their file or in the delta over a shared base
+ */
+
+#pragma once
+
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "./kemuUnit.h"
+#include "kemugon/sys/sysSnap.h"
+
+#define KEMU_UNIT_FILE "kemuUnitFile.img"
+#define KEMU_UNIT_BASE "kemuUnitBase.img"
+#define KEMU_UNIT_DELTA "kemuUnitDelta.img"
+#define KEMU_UNIT_CACHED "kemuUnitCached.img"
+#define KEMU_UNIT_STORE_PAGE 0x80
+
+/**
+ * @brief Unit machine with dev as a DATA_DEV mapped from KEMU_UNIT_STORE_PAGE, RAM stays under it on row 1
+ */
+KemuDev *kemuStore_unitBoot(KemuSys *sys, const uint8_t engine, KemuDev *dev, const uint16_t *prog, const size_t words){
+	kemuUnit_boot(sys, engine, prog, words);
+	kemuSys_pushDev(sys, dev);
+	KemuDev *data = kemuDev_devByType(sys, DATA_DEV, 0);
+	KemuSys_pageEntry ram = { .devID = kemuDev_devByType(sys, RAM_DEV, 0)->devID, .pageIndex = 0, .firstBank = 0, .lastBank = 3 };
+	KemuSys_pageEntry row = { .devID = data->devID, .pageIndex = KEMU_UNIT_STORE_PAGE, .firstBank = 0, .lastBank = data->head.bankCount - 1 };
+	kemuSys_setRow(sys, 1, ram);
+	kemuSys_setRow(sys, 0, row);
+	return data;
+}
+
+/**
+ * @brief Words of the file at path from byte offset, read through a descriptor of its own
+ */
+uint8_t kemuStore_unitRead(const char *path, const off_t offset, uint16_t *dst, const size_t words){
+	int fd = open(path, O_RDONLY);
+	if(fd < 0){
+		return KEMU_FAIL;
+	}
+	ssize_t got = pread(fd, dst, words * sizeof(uint16_t), offset);
+	close(fd);
+	return got == (ssize_t)(words * sizeof(uint16_t)) ? KEMU_SUCCESS : KEMU_FAIL;
+}
+
+/**
+ * @brief Chunks of dev still waiting for write-back
+ */
+size_t kemuStore_unitUnflushed(const KemuDev *dev){
+	size_t count = 0;
+	for(size_t c=0; c < dev->head.bankSize * dev->head.bankCount >> KEMU_PAGE_SHIFT; c++){
+		count += (__atomic_load_n(&dev->dirty[c], __ATOMIC_RELAXED) & FLUSH_DIRTY) != 0;
+	}
+	return count;
+}
+
+/**
+ * @brief Host stores to a FILE_STORE device are in its file after kemuSys_flush, and after the background flusher while stores go on
+ */
+void kemuStore_unitFlush(){
+	unlink(KEMU_UNIT_FILE);
+	KemuSys sys;
+	KemuDev file = { .fd = -1, .path = KEMU_UNIT_FILE, .head = { .bankSize = 4*1024, .bankCount = 2, .type = DATA_DEV } };
+	KemuDev *dev = kemuStore_unitBoot(&sys, INTERP_ENGINE, &file, NULL, 0);
+	KEMU_UNIT_CHECK(dev->store == FILE_STORE, "device store %u, expected %u", dev->store, FILE_STORE);
+	const uint16_t base = KEMU_UNIT_STORE_PAGE << KEMU_PAGE_SHIFT;
+	const size_t words = dev->head.bankSize * dev->head.bankCount;
+
+	uint16_t pattern[KEMU_PAGE_SIZE * 3];
+	for(size_t i=0; i<sizeof(pattern)/sizeof(pattern[0]); i++){
+		pattern[i] = 0xA000 + i;
+	}
+	kemuSys_writeVAS(&sys, base + 0x0180, pattern, sizeof(pattern)/sizeof(pattern[0]));
+	kemuSys_fillVAS(&sys, base + 0x1800, 0x5A5A, 0x20);
+	kemuSys_storeVAS(&sys, base + words - 1, 0x7777);
+	KEMU_UNIT_CHECK(kemuStore_unitUnflushed(dev) == 6, "%zu chunks wait for write-back, expected 6", kemuStore_unitUnflushed(dev));
+	KEMU_UNIT_CHECK(kemuSys_flush(&sys) == KEMU_SUCCESS, "flush failed");
+	KEMU_UNIT_CHECK(kemuStore_unitUnflushed(dev) == 0, "%zu chunks still wait for write-back after flush", kemuStore_unitUnflushed(dev));
+
+	uint16_t *onDisk = malloc(words * sizeof(uint16_t));
+	KEMU_UNIT_CHECK(kemuStore_unitRead(KEMU_UNIT_FILE, 0, onDisk, words) == KEMU_SUCCESS, "file re-read failed");
+	KEMU_UNIT_CHECK(memcmp(onDisk, dev->data, words * sizeof(uint16_t)) == 0 && onDisk[0x0180] == 0xA000 && onDisk[0x1800] == 0x5A5A && onDisk[words - 1] == 0x7777,
+		"file differs from the flushed device");
+
+	//Background flusher syncs while the host keeps storing
+	sys.flushMs = 1;
+	kemuSys_startFlusher(&sys);
+	struct timespec pause = { .tv_sec = 0, .tv_nsec = 100000 };
+	for(uint16_t round=0; round<200; round++){
+		for(size_t i=0; i<sizeof(pattern)/sizeof(pattern[0]); i++){
+			pattern[i] = round * 0x0100 + i;
+		}
+		kemuSys_writeVAS(&sys, base + (round * 0x0111) % (words - sizeof(pattern)/sizeof(pattern[0])), pattern, sizeof(pattern)/sizeof(pattern[0]));
+		nanosleep(&pause, NULL);
+	}
+	uint16_t waited = 0;
+	while(kemuStore_unitUnflushed(dev) && waited++ < 1000){
+		nanosleep(&pause, NULL);
+	}
+	KEMU_UNIT_CHECK(kemuStore_unitUnflushed(dev) == 0, "background flusher left %zu chunks", kemuStore_unitUnflushed(dev));
+	KEMU_UNIT_CHECK(kemuSys_flush(&sys) == KEMU_SUCCESS, "flush beside the flusher failed");
+	kemuStore_unitRead(KEMU_UNIT_FILE, 0, onDisk, words);
+	KEMU_UNIT_CHECK(memcmp(onDisk, dev->data, words * sizeof(uint16_t)) == 0, "file differs from the device after background flushes");
+
+	//Reopened device reads back what was flushed
+	memcpy(onDisk, dev->data, words * sizeof(uint16_t));
+	kemuSys_free(&sys);
+	KemuDev reopen = { .fd = -1, .path = KEMU_UNIT_FILE, .head = { .bankSize = 4*1024, .bankCount = 2, .type = DATA_DEV } };
+	dev = kemuStore_unitBoot(&sys, INTERP_ENGINE, &reopen, NULL, 0);
+	KEMU_UNIT_CHECK(memcmp(onDisk, dev->data, words * sizeof(uint16_t)) == 0, "reopened device differs");
+	free(onDisk);
+	kemuSys_free(&sys);
+	unlink(KEMU_UNIT_FILE);
+}
+
+/**
+ * @brief Guest and host stores to an OVERLAY_STORE device reach its delta, never the base, and survive a reopen
+ * A second delta over the same base starts from the base alone
+ */
+void kemuStore_unitOverlay(const uint8_t engine){
+	#include "kemugon/sys/instr.h"
+	const uint16_t base = KEMU_UNIT_STORE_PAGE << KEMU_PAGE_SHIFT;
+	const size_t bankSize = 4*1024;
+	const size_t bankCount = 4;
+	const size_t words = bankSize * bankCount;
+	uint16_t *image = malloc(words * sizeof(uint16_t));
+	uint16_t *onDisk = malloc(words * sizeof(uint16_t));
+	for(size_t i=0; i<words; i++){
+		image[i] = i * 7;
+	}
+	FILE *out = fopen(KEMU_UNIT_BASE, "wb");
+	fwrite(image, sizeof(uint16_t), words, out);
+	fclose(out);
+	unlink(KEMU_UNIT_DELTA);
+
+	uint16_t prog[] = {
+		KEMU_ASM_EXT(LD, R1, base + bankSize + 5),	//4000 bank 1
+		KEMU_ASM_EXT(LD, R2, 0xBEEF),					//4002
+		KEMU_ASM(ST, R1, R2),								//4004
+		KEMU_ASM(TRM, 0, 0),								//4005
+	};
+	KemuSys sys;
+	KemuDev overlay = { .fd = -1, .basePath = KEMU_UNIT_BASE, .path = KEMU_UNIT_DELTA, .head = { .bankSize = bankSize, .bankCount = bankCount, .type = DATA_DEV } };
+	KemuDev *dev = kemuStore_unitBoot(&sys, engine, &overlay, prog, sizeof(prog)/sizeof(prog[0]));
+	KEMU_UNIT_CHECK(dev->store == OVERLAY_STORE && memcmp(dev->data, image, words * sizeof(uint16_t)) == 0, "overlay store %u does not start from the base", dev->store);
+	kemuUnit_run(&sys, 1000, 1000);
+	uint16_t value = 0x1234;
+	kemuSys_writeVAS(&sys, base + 2 * bankSize + 0x0300, &value, 1);
+	KEMU_UNIT_CHECK(sys.quitFlag && dev->data[bankSize + 5] == 0xBEEF && dev->data[2 * bankSize + 0x0300] == 0x1234, "engine %u: stores missed the overlay", engine);
+	KEMU_UNIT_CHECK(kemuSys_flush(&sys) == KEMU_SUCCESS, "overlay flush failed");
+
+	KEMU_UNIT_CHECK(kemuStore_unitRead(KEMU_UNIT_BASE, 0, onDisk, words) == KEMU_SUCCESS && memcmp(onDisk, image, words * sizeof(uint16_t)) == 0, "engine %u: base was written", engine);
+	uint8_t held[4];
+	int deltaFd = open(KEMU_UNIT_DELTA, O_RDONLY);
+	KEMU_UNIT_CHECK(deltaFd >= 0 && pread(deltaFd, held, bankCount, words * sizeof(uint16_t)) == (ssize_t)bankCount, "delta map unreadable");
+	close(deltaFd);
+	KEMU_UNIT_CHECK(!held[0] && held[1] && held[2] && !held[3], "delta holds banks %u%u%u%u, expected 0110", held[0], held[1], held[2], held[3]);
+	kemuStore_unitRead(KEMU_UNIT_DELTA, bankSize * sizeof(uint16_t), onDisk, 2 * bankSize);
+	KEMU_UNIT_CHECK(memcmp(onDisk, &dev->data[bankSize], 2 * bankSize * sizeof(uint16_t)) == 0, "engine %u: delta banks differ from the device", engine);
+
+	//Reopened over the same delta
+	memcpy(image, dev->data, words * sizeof(uint16_t));
+	kemuSys_free(&sys);
+	KemuDev reopen = { .fd = -1, .basePath = KEMU_UNIT_BASE, .path = KEMU_UNIT_DELTA, .head = { .bankSize = bankSize, .bankCount = bankCount, .type = DATA_DEV } };
+	dev = kemuStore_unitBoot(&sys, engine, &reopen, NULL, 0);
+	KEMU_UNIT_CHECK(memcmp(dev->data, image, words * sizeof(uint16_t)) == 0, "engine %u: reopened overlay differs", engine);
+	kemuSys_free(&sys);
+
+	//Fresh delta over the same base
+	unlink(KEMU_UNIT_DELTA);
+	KemuDev fresh = { .fd = -1, .basePath = KEMU_UNIT_BASE, .path = KEMU_UNIT_DELTA, .head = { .bankSize = bankSize, .bankCount = bankCount, .type = DATA_DEV } };
+	dev = kemuStore_unitBoot(&sys, engine, &fresh, NULL, 0);
+	KEMU_UNIT_CHECK(dev->data[bankSize + 5] == (uint16_t)((bankSize + 5) * 7) && dev->data[2 * bankSize + 0x0300] == (uint16_t)((2 * bankSize + 0x0300) * 7),
+		"engine %u: fresh delta sees writes of another instance", engine);
+	kemuSys_free(&sys);
+
+	free(onDisk);
+	free(image);
+	unlink(KEMU_UNIT_DELTA);
+	unlink(KEMU_UNIT_BASE);
+}
+
+/**
+ * @brief Guest and host stores to ROM frames are dropped, in memory and from a read-only FILE_STORE image
+ * Only in-memory ROM can be flashed, the image file is never written
+ */
+void kemuStore_unitRom(const uint8_t engine){
+	#include "kemugon/sys/instr.h"
+	const uint16_t base = KEMU_UNIT_STORE_PAGE << KEMU_PAGE_SHIFT;
+	const size_t words = 4*1024;
+	uint16_t *image = malloc(words * sizeof(uint16_t));
+	for(size_t i=0; i<words; i++){
+		image[i] = i ^ 0x5555;
+	}
+	FILE *out = fopen(KEMU_UNIT_FILE, "wb");
+	fwrite(image, sizeof(uint16_t), words, out);
+	fclose(out);
+
+	uint16_t prog[] = {
+		KEMU_ASM_EXT(LD, R1, base + 3),			//4000 ROM
+		KEMU_ASM_EXT(LD, R2, 0xDEAD),				//4002
+		KEMU_ASM(ST, R1, R2),						//4004
+		KEMU_ASM_EXT(LD, R1, 0x0200),				//4005 RAM
+		KEMU_ASM(ST, R1, R2),						//4007
+		KEMU_ASM(TRM, 0, 0),						//4008
+	};
+	const char *path[] = { NULL, KEMU_UNIT_FILE };
+	const uint8_t store[] = { KEMU_FLAT_VAS ? MEMFD_STORE : ANON_STORE, FILE_STORE };
+	for(uint8_t r=0; r<2; r++){
+		KemuSys sys;
+		KemuDev rom = { .fd = -1, .path = path[r], .head = { .bankSize = words, .bankCount = 1, .isROM = 1, .type = DATA_DEV } };
+		KemuDev *dev = kemuStore_unitBoot(&sys, engine, &rom, prog, sizeof(prog)/sizeof(prog[0]));
+		KEMU_UNIT_CHECK(dev->store == store[r], "ROM store %u, expected %u", dev->store, store[r]);
+		uint8_t flashed = kemuDev_flash(dev, 0, image, words);
+		KEMU_UNIT_CHECK(flashed == (path[r] ? KEMU_FAIL : KEMU_SUCCESS), "ROM store %u flash returned %u", dev->store, flashed);
+		KEMU_UNIT_CHECK(kemuDev_flash(kemuDev_devByType(&sys, RAM_DEV, 0), 0, image, 1) == KEMU_FAIL, "RAM was flashed");
+		KEMU_UNIT_CHECK(memcmp(dev->data, image, words * sizeof(uint16_t)) == 0, "ROM store %u does not hold the image", dev->store);
+
+		kemuUnit_run(&sys, 1000, 1000);
+		kemuSys_storeVAS(&sys, base + 5, 0xBEEF);
+		uint16_t run[] = { 1, 2, 3 };
+		kemuSys_writeVAS(&sys, base + 0x0100, run, 3);
+		kemuSys_fillVAS(&sys, base + 0x0200, 0xFFFF, 0x0180);
+		KEMU_UNIT_CHECK(sys.quitFlag && kemuSys_vasRead(&sys, 0x0200) == 0xDEAD, "engine %u: program did not run", engine);
+		KEMU_UNIT_CHECK(memcmp(dev->data, image, words * sizeof(uint16_t)) == 0, "engine %u: ROM store %u took a store", engine, dev->store);
+		kemuSys_free(&sys);
+	}
+	uint16_t *onDisk = malloc(words * sizeof(uint16_t));
+	KEMU_UNIT_CHECK(kemuStore_unitRead(KEMU_UNIT_FILE, 0, onDisk, words) == KEMU_SUCCESS && memcmp(onDisk, image, words * sizeof(uint16_t)) == 0, "ROM image file was written");
+	free(onDisk);
+	free(image);
+	unlink(KEMU_UNIT_FILE);
+}
+
+/**
+ * @brief Host pages of words from start that are resident
+ */
+size_t kemuStore_unitResident(const uint16_t *start, const size_t words){
+	const size_t hostPage = sysconf(_SC_PAGESIZE);
+	size_t pageCount = words * sizeof(uint16_t) / hostPage;
+	unsigned char vec[64] = {0};
+	if(pageCount > sizeof(vec) || mincore((void *)start, pageCount * hostPage, vec) != 0){
+		return SIZE_MAX;
+	}
+	size_t count = 0;
+	for(size_t i=0; i<pageCount; i++){
+		count += vec[i] & 1;
+	}
+	return count;
+}
+
+/**
+ * @brief resetBanks zeroes the banks, returns their host pages, marks them dirty and drops code decoded from them
+ */
+void kemuStore_unitReset(const uint8_t engine){
+	#include "kemugon/sys/instr.h"
+	const uint16_t base = KEMU_UNIT_STORE_PAGE << KEMU_PAGE_SHIFT;
+	const size_t bankSize = 4*1024;
+	const uint16_t codeAddr = base + bankSize;
+	uint16_t code[] = {
+		KEMU_ASM_EXT(LD, R1, 0x0300),			//9000
+		KEMU_ASM_EXT(LD, R2, 0x1111),			//9002
+		KEMU_ASM(ST, R1, R2),						//9004
+		KEMU_ASM_EXT(JMP, 0, 0x9005),			//9005 spin, the CPU keeps running
+	};
+	KemuSys sys;
+	KemuDev mem = { .fd = -1, .head = { .bankSize = bankSize, .bankCount = 4, .type = DATA_DEV } };
+	KemuDev *dev = kemuStore_unitBoot(&sys, engine, &mem, NULL, 0);
+	KEMU_UNIT_CHECK(dev->store == (KEMU_FLAT_VAS ? MEMFD_STORE : ANON_STORE), "device store %u", dev->store);
+	kemuSys_fillVAS(&sys, base, 0xFFFF, 4 * bankSize);
+	kemuSys_writeVAS(&sys, codeAddr, code, sizeof(code)/sizeof(code[0]));
+	kemuUnit_cpu(&sys)->pc = codeAddr;
+	kemuUnit_run(&sys, 1000, 1000);
+	KEMU_UNIT_CHECK(kemuSys_vasRead(&sys, 0x0300) == 0x1111 && kemuUnit_cpu(&sys)->pc == 0x9005, "engine %u: code in bank 1 did not run", engine);
+	KEMU_UNIT_CHECK(kemuStore_unitResident(dev->bank[1], 2 * bankSize) == 2 * bankSize * sizeof(uint16_t) / sysconf(_SC_PAGESIZE), "filled banks not resident");
+
+	KemuSnap snap = {0};
+	kemuSys_snapshot(&sys, &snap);
+	KEMU_UNIT_CHECK(kemuSys_resetBanks(&sys, dev, 1, 2) == KEMU_SUCCESS, "resetBanks failed");
+	//Before anything reads them back in
+	KEMU_UNIT_CHECK(kemuStore_unitResident(dev->bank[1], 2 * bankSize) == 0, "reset banks still hold %zu host pages", kemuStore_unitResident(dev->bank[1], 2 * bankSize));
+	size_t nonZero = 0;
+	for(size_t i=bankSize; i<3 * bankSize; i++){
+		nonZero += dev->data[i] != 0;
+	}
+	KEMU_UNIT_CHECK(nonZero == 0 && dev->data[0] == 0xFFFF && dev->data[3 * bankSize] == 0xFFFF, "%zu words of the reset banks are not zero, or a neighbour was", nonZero);
+	size_t clean = 0;
+	for(size_t c=bankSize >> KEMU_PAGE_SHIFT; c<3 * bankSize >> KEMU_PAGE_SHIFT; c++){
+		clean += (dev->dirty[c] & SNAP_DIRTY) == 0;
+	}
+	KEMU_UNIT_CHECK(clean == 0, "%zu reset chunks not marked dirty", clean);
+
+	//Zero words are NOPs, stale decoded code would store again
+	kemuSys_storeVAS(&sys, 0x0300, 0);
+	kemuUnit_cpu(&sys)->pc = codeAddr;
+	uint64_t retired = sys.insRetired;
+	kemuUnit_run(&sys, 1000, 1000);
+	KEMU_UNIT_CHECK(sys.insRetired > retired && kemuSys_vasRead(&sys, 0x0300) == 0, "engine %u: code decoded before the reset ran", engine);
+
+	//Restore brings the banks back
+	KEMU_UNIT_CHECK(kemuSys_restore(&sys, &snap) == KEMU_SUCCESS && dev->data[bankSize] == code[0] && dev->data[2 * bankSize] == 0xFFFF, "restore over reset banks differs");
+	kemuSnap_free(&snap);
+	kemuSys_free(&sys);
+}
+
+/**
+ * @brief Guest remaps row 0 at KEMU_UNIT_STORE_PAGE to one bank after another through the MBC and stores into each
+ * Revisited banks must come back from the image with the earlier stores
+ */
+void kemuStore_lruProg(uint16_t *prog, size_t *words){
+	#include "kemugon/sys/instr.h"
+	const uint8_t visit[] = { 0, 1, 2, 3, 0, 2, 1, 3, 0 };
+	const uint16_t base = KEMU_UNIT_STORE_PAGE << KEMU_PAGE_SHIFT;
+	size_t n = 0;
+	for(uint8_t i=0; i<sizeof(visit)/sizeof(visit[0]); i++){
+		uint16_t step[] = {
+			KEMU_ASM(LD, R1, PAGE_TABLE_ADDR + 1),					//Bank range of row 0
+			KEMU_ASM_EXT(LD, R0, visit[i] << 8 | visit[i]),
+			KEMU_ASM(ST, R1, R0),
+			KEMU_ASM(LD, R1, MBC_FLAG_ADDR),
+			KEMU_ASM(LD, R0, ADD_MBC),
+			KEMU_ASM(ST, R1, R0),
+			KEMU_ASM_EXT(LD, R1, base + (i * 0x0111) % 0x0F00),
+			KEMU_ASM_EXT(LD, R0, i * 0x1010 + 1),
+			KEMU_ASM(ST, R1, R0),
+			KEMU_ASM_EXT(LD, R1, base + 0x0F00 + i),
+			KEMU_ASM(ST, R1, R0),
+		};
+		memcpy(&prog[n], step, sizeof(step));
+		n += sizeof(step)/sizeof(step[0]);
+	}
+	prog[n++] = KEMU_ASM(TRM, 0, 0);
+	*words = n;
+}
+
+/**
+ * @brief Unit machine with dev mapped one bank at a time on row 0 at KEMU_UNIT_STORE_PAGE, rows mirrored to VAS for the MBC
+ */
+KemuDev *kemuStore_unitWindow(KemuSys *sys, const uint8_t engine, KemuDev *dev, const uint16_t *prog, const size_t words){
+	kemuUnit_boot(sys, engine, prog, words);
+	kemuSys_pushDev(sys, dev);
+	KemuDev *data = kemuDev_devByType(sys, DATA_DEV, 0);
+	KemuSys_pageEntry ram = { .devID = kemuDev_devByType(sys, RAM_DEV, 0)->devID, .pageIndex = 0, .firstBank = 0, .lastBank = 3 };
+	KemuSys_pageEntry row = { .devID = data->devID, .pageIndex = KEMU_UNIT_STORE_PAGE, .firstBank = 0, .lastBank = 0 };
+	kemuSys_setRow(sys, 1, ram);
+	kemuSys_writeRow(sys, 1, ram);
+	kemuSys_setRow(sys, 0, row);
+	kemuSys_writeRow(sys, 0, row);
+	return data;
+}
+
+/**
+ * @brief A STREAM_STORE device with 2 resident banks runs as the same image mapped whole by FILE_STORE
+ * Evicted banks are written back to the image before the flush, the flushed images are equal
+ */
+void kemuStore_unitStream(const uint8_t engine){
+	const size_t bankSize = 4*1024;
+	const size_t bankCount = 4;
+	const size_t words = bankSize * bankCount;
+	uint16_t *image = malloc(words * sizeof(uint16_t));
+	for(size_t i=0; i<words; i++){
+		image[i] = i * 3 + 1;
+	}
+	const char *path[] = { KEMU_UNIT_CACHED, KEMU_UNIT_FILE };
+	for(uint8_t i=0; i<2; i++){
+		FILE *out = fopen(path[i], "wb");
+		fwrite(image, sizeof(uint16_t), words, out);
+		fclose(out);
+	}
+
+	uint16_t prog[256];
+	size_t progWords;
+	kemuStore_lruProg(prog, &progWords);
+	KemuSys ref, sys;
+	KemuDev file = { .fd = -1, .path = KEMU_UNIT_FILE, .head = { .bankSize = bankSize, .bankCount = bankCount, .type = DATA_DEV } };
+	KemuDev stream = { .fd = -1, .path = KEMU_UNIT_CACHED, .cache = { .slotCount = 2 }, .head = { .bankSize = bankSize, .bankCount = bankCount, .type = DATA_DEV } };
+	KemuDev *refDev = kemuStore_unitWindow(&ref, engine, &file, prog, progWords);
+	KemuDev *dev = kemuStore_unitWindow(&sys, engine, &stream, prog, progWords);
+	KEMU_UNIT_CHECK(refDev->store == FILE_STORE && dev->store == STREAM_STORE, "stores %u and %u, expected %u and %u", refDev->store, dev->store, FILE_STORE, STREAM_STORE);
+
+	uint8_t same = 1;
+	while(same && !sys.quitFlag && sys.emuCycle < 100000){
+		kemuDev_run(&ref, 7);
+		kemuDev_run(&sys, 7);
+		same = kemuUnit_sameState(&ref, &sys, "stream");
+	}
+	KEMU_UNIT_CHECK(same && sys.quitFlag, "engine %u: streamed run differs from the mapped one at cycle %lu", engine, sys.emuCycle);
+
+	//Banks no longer resident were written back on eviction
+	uint16_t *onDisk = malloc(words * sizeof(uint16_t));
+	uint8_t evicted = 0;
+	for(size_t b=0; b<bankCount; b++){
+		if(dev->bank[b]){
+			continue;
+		}
+		evicted++;
+		kemuStore_unitRead(KEMU_UNIT_CACHED, b * bankSize * sizeof(uint16_t), onDisk, bankSize);
+		KEMU_UNIT_CHECK(memcmp(onDisk, &refDev->data[b * bankSize], bankSize * sizeof(uint16_t)) == 0, "engine %u: evicted bank %zu not written back", engine, b);
+	}
+	KEMU_UNIT_CHECK(evicted == bankCount - 2, "%u banks evicted, expected %zu", evicted, bankCount - 2);
+
+	KEMU_UNIT_CHECK(kemuSys_flush(&sys) == KEMU_SUCCESS && kemuSys_flush(&ref) == KEMU_SUCCESS, "flush failed");
+	kemuStore_unitRead(KEMU_UNIT_CACHED, 0, onDisk, words);
+	kemuStore_unitRead(KEMU_UNIT_FILE, 0, image, words);
+	KEMU_UNIT_CHECK(memcmp(onDisk, image, words * sizeof(uint16_t)) == 0, "engine %u: flushed stream image differs from the mapped one", engine);
+	KEMU_UNIT_CHECK(image[3 * bankSize + 7 * 0x0111] == 7 * 0x1010 + 1 && image[3 * bankSize + 0x0F00 + 7] == 7 * 0x1010 + 1, "engine %u: stores missed the images", engine);
+
+	free(onDisk);
+	free(image);
+	kemuSys_free(&sys);
+	kemuSys_free(&ref);
+	unlink(KEMU_UNIT_CACHED);
+	unlink(KEMU_UNIT_FILE);
+}
+
+void kemuStore_unit(){
+	kemuStore_unitFlush();
+	kemuStore_unitOverlay(INTERP_ENGINE);
+	kemuStore_unitOverlay(JIT_ENGINE);
+	kemuStore_unitRom(INTERP_ENGINE);
+	kemuStore_unitRom(JIT_ENGINE);
+	kemuStore_unitReset(INTERP_ENGINE);
+	kemuStore_unitReset(JIT_ENGINE);
+	kemuStore_unitStream(INTERP_ENGINE);
+	kemuStore_unitStream(JIT_ENGINE);
+
+	printf("kemuStore_unit Done\n");
+}
@@ -0,0 +1,178 @@
+/**
+ * @file kemuSysUnit.h
+ *
+ * @brief System loop, boot loader and page table
+ */
+
+#pragma once
+
+#include "./kemuUnit.h"
+
+/**
+ * @brief kemuSys_loop runs past one emulated second in TURBO_RUN and stops at cycleLimit or TRM
+ */
+void kemuSys_unitLoop(){
+	#include "kemugon/sys/instr.h"
+	uint16_t spin[] = {
+		KEMU_ASM(ADD, R0, 1),					//4000
+		KEMU_ASM_EXT(JMP, 0, 0x4000),			//4001
+	};
+	KemuSys sys;
+	kemuUnit_boot(&sys, INTERP_ENGINE, spin, sizeof(spin)/sizeof(spin[0]));
+	sys.runMode = TURBO_RUN;
+	sys.cycleLimit = 3 * sys.emuClockSpeed;
+	kemuSys_loop(&sys);
+	KEMU_UNIT_CHECK(sys.emuCycle >= sys.cycleLimit && sys.emuCycle < sys.cycleLimit + sys.quantumCycles + 8,
+		"loop stopped at cycle %lu, limit %lu", sys.emuCycle, sys.cycleLimit);
+	kemuSys_free(&sys);
+
+	uint16_t stop[] = {
+		KEMU_ASM(LD, R0, 7),						//4000
+		KEMU_ASM(TRM, 0, 0),						//4001
+	};
+	kemuUnit_boot(&sys, INTERP_ENGINE, stop, sizeof(stop)/sizeof(stop[0]));
+	sys.runMode = TURBO_RUN;
+	kemuSys_loop(&sys);
+	KEMU_UNIT_CHECK(sys.insRetired == 2 && kemuUnit_cpu(&sys)->reg[R0] == 7, "unlimited loop retired %lu before TRM", sys.insRetired);
+	kemuSys_free(&sys);
+}
+
+/**
+ * @brief Built-in loader maps the second data device at page 128 through page table row 2
+ */
+void kemuSys_unitBoot(){
+	KemuSys sys = {
+		.emuClockSpeed  = 4194304U,
+		.hostClockSpeed = 3700003502U,
+		.pageSize = KEMU_PAGE_SIZE,
+	};
+	kemuSys_alloc(&sys);
+	KemuDev cpu = { .fd = -1, .head = { .bankSize = sizeof(KemuDev_CPU), .bankCount = 1, .type = CPU_DEV } };
+	KemuDev ram = { .fd = -1, .head = { .bankSize = 16*1024, .bankCount = 4, .type = RAM_DEV } };
+	KemuDev rom = { .fd = -1, .head = { .bankSize = 4*1024, .bankCount = 1, .isROM = 1, .type = DATA_DEV } };
+	KemuDev data = { .fd = -1, .head = { .bankSize = 16*1024, .bankCount = 2, .type = DATA_DEV } };
+	kemuSys_pushDev(&sys, &cpu);
+	kemuSys_pushDev(&sys, &rom);
+	kemuSys_pushDev(&sys, &ram);
+	kemuSys_pushDev(&sys, &data);
+	KEMU_UNIT_CHECK(kemuSys_boot(&sys) == KEMU_SUCCESS, "boot failed");
+	kemuUnit_run(&sys, 1000, UINT64_MAX);
+
+	KemuDev *dataDev = kemuDev_devByType(&sys, DATA_DEV, 1);
+	KemuSys_pageEntry dataEntry = { .devID = dataDev->devID, .pageIndex = 128, .firstBank = 0, .lastBank = 1 };
+	KemuSys_pageEntry dataRow = kemuSys_readRow(&sys, 2);
+	KEMU_UNIT_CHECK(memcmp(&dataEntry, &dataRow, sizeof(KemuSys_pageEntry)) == 0, "row 2 in VAS differs from the loader row");
+	KEMU_UNIT_CHECK(memcmp(&dataEntry, &sys.pageTable[2], sizeof(KemuSys_pageEntry)) == 0, "MBC did not apply row 2");
+	KEMU_UNIT_CHECK(sys.frameTable[128] == dataDev->bank[0], "page 128 not mapped to the data device");
+	kemuSys_free(&sys);
+}
+
+/**
+ * @brief Lowest covering row wins, and incremental remapping agrees with resolving every page
+ */
+void kemuSys_unitRows(){
+	KemuSys sys;
+	kemuUnit_boot(&sys, INTERP_ENGINE, NULL, 0);
+	KemuDev data = { .fd = -1, .head = { .bankSize = 4*1024, .bankCount = 8, .type = DATA_DEV } };
+	kemuSys_pushDev(&sys, &data);
+	KemuDev *ramDev = kemuDev_devByType(&sys, RAM_DEV, 0);
+	KemuDev *dataDev = kemuDev_devByType(&sys, DATA_DEV, 0);
+
+	//RAM in row 0 covers all of VAS
+	KemuSys_pageEntry dataEntry = { .devID = dataDev->devID, .pageIndex = 128, .firstBank = 0, .lastBank = 0 };
+	kemuSys_setRow(&sys, 3, dataEntry);
+	KEMU_UNIT_CHECK(sys.frameTable[128] == ramDev->data + 128 * KEMU_PAGE_SIZE, "later row won over row 0");
+	kemuSys_setRow(&sys, 0, (KemuSys_pageEntry){0});
+	KEMU_UNIT_CHECK(sys.frameTable[128] == dataDev->data && sys.pageRow[128] == 3, "emptied row 0 did not uncover row 3");
+	KEMU_UNIT_CHECK(sys.pageRow[0] == KEMU_PAGE_ROWS, "page 0 still mapped");
+
+	uint32_t seed = 2141;
+	uint32_t mismatch = 0;
+	for(uint16_t step=0; step<2000; step++){
+		seed = seed * 1103515245U + 12345U;
+		uint16_t row = (seed >> 8) % 6;
+		uint8_t firstBank = (seed >> 12) % 8;
+		KemuSys_pageEntry entry = {
+			.devID		= (seed >> 16) % 3 ? dataDev->devID : ((seed >> 18) % 2 ? ramDev->devID : 0),
+			.pageIndex	= (seed >> 20) % 256,
+			.firstBank	= firstBank,
+			.lastBank	= firstBank + (seed >> 28) % 3,
+		};
+		kemuSys_setRow(&sys, row, entry);
+		for(uint16_t page=0; page<sys.mapPageCount; page++){
+			mismatch += sys.frameTable[page] != kemuSys_resolvePage(&sys, page, NULL);
+		}
+	}
+	KEMU_UNIT_CHECK(mismatch == 0, "incremental remap differed from a full resolve %u times", mismatch);
+	kemuSys_free(&sys);
+}
+
+/**
+ * @brief A row off window slice boundaries reads and stores the same under KEMU_FLAT_VAS as through frameTable
+ * Both test builds check the same values, so flat and non-flat agree. Realigning the row returns to the window
+ */
+void kemuSys_unitMisaligned(){
+	#include "kemugon/sys/instr.h"
+	uint16_t prog[] = {
+		KEMU_ASM_EXT(LD, R0, 0x12F0),			//4000
+		KEMU_ASM_EXT(LD, R7, 0xEFE0),			//4002 0x1020 stores, to 0x230F
+		//loop
+		KEMU_ASM(LD, R1, 0),						//4004
+		KEMU_ASM(OR, R1, R0),						//4005
+		KEMU_ASM_EXT(ADD, R1, 0x5A5A),		//4006
+		KEMU_ASM(ST, R0, R1),						//4008
+		KEMU_ASM(ADD, R0, 1),						//4009
+		KEMU_ASM(ADD, R7, 1),						//400A
+		KEMU_ASM_EXT(JC, 0, 0x400F),			//400B
+		KEMU_ASM_EXT(JMP, 0, 0x4004),			//400D
+		KEMU_ASM(TRM, 0, 0),						//400F
+	};
+	KemuSys sys;
+	kemuUnit_boot(&sys, INTERP_ENGINE, prog, sizeof(prog)/sizeof(prog[0]));
+	KemuDev data = { .fd = -1, .head = { .bankSize = 4*1024, .bankCount = 1, .type = DATA_DEV } };
+	kemuSys_pushDev(&sys, &data);
+	KemuDev *ramDev = kemuDev_devByType(&sys, RAM_DEV, 0);
+	KemuDev *dataDev = kemuDev_devByType(&sys, DATA_DEV, 0);
+
+	//RAM moves behind a data row starting mid slice at page 0x13
+	KemuSys_pageEntry ramEntry = sys.pageTable[0];
+	kemuSys_setRow(&sys, 5, ramEntry);
+	kemuSys_setRow(&sys, 0, (KemuSys_pageEntry){0});
+	kemuSys_setRow(&sys, 1, (KemuSys_pageEntry){ .devID = dataDev->devID, .pageIndex = 0x13, .firstBank = 0, .lastBank = 0 });
+	#if KEMU_FLAT_VAS
+		KEMU_UNIT_CHECK(sys.sliceMiss > 0, "misaligned row left the window in use");
+	#endif
+	kemuUnit_run(&sys, 1000, 200000);
+	KEMU_UNIT_CHECK(sys.quitFlag, "store loop did not finish");
+
+	uint32_t wrong = 0;
+	for(uint32_t addr=0x12F0; addr<0x2310; addr++){
+		uint16_t value = addr + 0x5A5A;
+		wrong += kemuSys_vasRead(&sys, addr) != value;
+		if(addr >= 0x1300 && addr < 0x2300){
+			wrong += dataDev->data[addr - 0x1300] != value || ramDev->data[addr] != 0;
+		}else{
+			wrong += ramDev->data[addr] != value;
+		}
+	}
+	KEMU_UNIT_CHECK(wrong == 0, "%u words around the misaligned row differ", wrong);
+
+	kemuSys_setRow(&sys, 1, (KemuSys_pageEntry){ .devID = dataDev->devID, .pageIndex = 0x10, .firstBank = 0, .lastBank = 0 });
+	KEMU_UNIT_CHECK(sys.sliceMiss == 0, "aligned row still misses %u slices", sys.sliceMiss);
+	kemuSys_storeVAS(&sys, 0x1000, 0xBEEF);
+	wrong = 0;
+	for(uint32_t i=0; i<4*1024; i++){
+		wrong += kemuSys_vasRead(&sys, 0x1000 + i) != dataDev->data[i];
+	}
+	KEMU_UNIT_CHECK(wrong == 0 && dataDev->data[0] == 0xBEEF, "aligned row reads %u words off its device", wrong);
+	kemuSys_free(&sys);
+}
+
+void kemuSys_unit(){
+	kemuSys_unitLoop();
+	kemuSys_unitBoot();
+	kemuSys_unitRows();
+	kemuSys_unitMisaligned();
+
+	printf("kemuSys_unit Done\n");
+}
@@ -0,0 +1,109 @@
+/**
+ * @file kemuUnit.h
+ *
+ * @brief Shared machine of the emulator unit tests
+ * Devices are anonymous, so tests never touch the tracked disk images
+ */
+
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "kemugon/sys/sys.h"
+#include "kemugon/dev/dev.h"
+#include "kemugon/sys/sysDev.h"
+
+static uint32_t kemuUnit_failCount = 0;
+
+#define KEMU_UNIT_CHECK(cond, ...) do{ \
+	if(!(cond)){ \
+		printf("FAIL %s:%d ", __FILE__, __LINE__); \
+		printf(__VA_ARGS__); \
+		printf("\n"); \
+		kemuUnit_failCount++; \
+	} \
+}while(0)
+
+/**
+ * @brief CPU and one RAM device covering the whole VAS, prog is stored at BOOT_ADDR and pc points to it
+ * VAS is writable everywhere, so guest stores reach every page. workerCount threads run GPU_DEV and AUDIO_DEV
+ */
+void kemuUnit_bootWorkers(KemuSys *sys, const uint8_t engine, const uint8_t workerCount, const uint16_t *prog, const size_t words){
+	*sys = (KemuSys){
+		.emuClockSpeed  = 4194304U,
+		.hostClockSpeed = 3700003502U,
+		.quantumCycles = 4194U,
+		.pageSize = KEMU_PAGE_SIZE,
+		.engine = engine,
+		.workerCount = workerCount,
+	};
+	kemuSys_alloc(sys);
+
+	KemuDev cpu = { .fd = -1, .head = { .bankSize = sizeof(KemuDev_CPU), .bankCount = 1, .type = CPU_DEV } };
+	KemuDev ram = { .fd = -1, .head = { .bankSize = 16*1024, .bankCount = 4, .type = RAM_DEV } };
+	kemuSys_pushDev(sys, &cpu);
+	kemuSys_pushDev(sys, &ram);
+
+	KemuSys_pageEntry row = { .devID = kemuDev_devByType(sys, RAM_DEV, 0)->devID, .pageIndex = 0, .firstBank = 0, .lastBank = 3 };
+	kemuSys_setRow(sys, 0, row);
+	kemuSys_writeRow(sys, 0, row);
+	kemuSys_writeVAS(sys, BOOT_ADDR, prog, words);
+
+	KemuDev_CPU *cpuReg = (void *)kemuDev_devByType(sys, CPU_DEV, 0)->bank[0];
+	cpuReg->pc = BOOT_ADDR;
+}
+
+void kemuUnit_boot(KemuSys *sys, const uint8_t engine, const uint16_t *prog, const size_t words){
+	kemuUnit_bootWorkers(sys, engine, 0, prog, words);
+}
+
+KemuDev_CPU *kemuUnit_cpu(const KemuSys *sys){
+	return (void *)kemuDev_devByType(sys, CPU_DEV, 0)->bank[0];
+}
+
+/**
+ * @brief Run quanta of quantumCycles until TRM or cycleLimit, returns spent cycles
+ */
+uint64_t kemuUnit_run(KemuSys *sys, const uint64_t quantumCycles, const uint64_t cycleLimit){
+	uint64_t spent = 0;
+	while(!sys->quitFlag && spent < cycleLimit){
+		spent += kemuDev_run(sys, quantumCycles);
+	}
+	return spent;
+}
+
+/**
+ * @brief Compare architectural state of two machines, registers, settled flags, counters and the whole VAS
+ * Returns 1 if equal, differences are printed under label
+ */
+uint8_t kemuUnit_sameState(const KemuSys *a, const KemuSys *b, const char *label){
+	KemuDev_CPU *cpuA = kemuUnit_cpu(a);
+	KemuDev_CPU *cpuB = kemuUnit_cpu(b);
+	kemuSys_settleFlags(a);
+	kemuSys_settleFlags(b);
+
+	uint8_t same = 1;
+	for(uint16_t i=0; i<sizeof(cpuA->reg)/sizeof(cpuA->reg[0]); i++){
+		if(cpuA->reg[i] != cpuB->reg[i]){
+			printf("%s: reg %u %04X != %04X\n", label, i, cpuA->reg[i], cpuB->reg[i]);
+			same = 0;
+		}
+	}
+	if(cpuA->flags != cpuB->flags){
+		printf("%s: flags %u != %u\n", label, cpuA->flags, cpuB->flags);
+		same = 0;
+	}
+	if(a->insRetired != b->insRetired || a->emuCycle != b->emuCycle){
+		printf("%s: retired %lu cycle %lu != retired %lu cycle %lu\n", label, a->insRetired, a->emuCycle, b->insRetired, b->emuCycle);
+		same = 0;
+	}
+	static uint16_t vas[UINT16_MAX+1];
+	kemuSys_readVAS(a, 0, vas, UINT16_MAX+1);
+	if(kemuSys_compareVAS(b, 0, vas, UINT16_MAX+1) != 0){
+		printf("%s: VAS differs\n", label);
+		same = 0;
+	}
+	return same;
+}
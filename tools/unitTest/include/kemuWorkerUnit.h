@@ -0,0 +1,190 @@
+/**
+ * @file kemuWorkerUnit.h
+ *
+ * @brief Devices on worker threads see the same messages at every quantum end as on the main thread
+ */
+
+#pragma once
+
+#include <pthread.h>
+
+#include "./kemuUnit.h"
+#include "./kemuDevUnit.h"
+#include "kemugon/sys/sysSnap.h"
+
+/**
+ * @brief Unit machine with a DMA_DEV at KEMU_UNIT_IO_PAGE, a GPU_DEV and a DATA_DEV
+ * With workerCount threads the GPU_DEV is worker owned, the other devices stay on the main thread
+ */
+void kemuWorker_unitBoot(KemuSys *sys, const uint8_t workerCount, const uint16_t *prog, const size_t words){
+	kemuUnit_bootWorkers(sys, INTERP_ENGINE, workerCount, prog, words);
+	size_t ioWords = KEMU_PAGE_SIZE;
+	#if KEMU_FLAT_VAS
+		ioWords *= sys->slicePages;
+	#endif
+	KemuDev dma = { .fd = -1, .head = { .bankSize = ioWords, .bankCount = 1, .type = DMA_DEV } };
+	KemuDev gpu = { .fd = -1, .head = { .bankSize = KEMU_PAGE_SIZE, .bankCount = 1, .type = GPU_DEV } };
+	KemuDev data = { .fd = -1, .head = { .bankSize = 4*1024, .bankCount = 1, .type = DATA_DEV } };
+	kemuSys_pushDev(sys, &dma);
+	kemuSys_pushDev(sys, &gpu);
+	kemuSys_pushDev(sys, &data);
+
+	KemuSys_pageEntry ram = { .devID = kemuDev_devByType(sys, RAM_DEV, 0)->devID, .pageIndex = 0, .firstBank = 0, .lastBank = 3 };
+	KemuSys_pageEntry ioRow = { .devID = kemuDev_devByType(sys, DMA_DEV, 0)->devID, .pageIndex = KEMU_UNIT_IO_PAGE, .firstBank = 0, .lastBank = 0 };
+	kemuSys_setRow(sys, 1, ram);
+	kemuSys_setRow(sys, 0, ioRow);
+}
+
+/**
+ * @brief 64 DMA fills, each sending its final status to word i of the GPU_DEV through irqDev
+ */
+void kemuWorker_irqProg(uint16_t *prog, size_t *words, const uint16_t gpuID){
+	#include "kemugon/sys/instr.h"
+	const uint16_t reg = KEMU_UNIT_IO_PAGE << KEMU_PAGE_SHIFT;
+	uint16_t code[] = {
+		KEMU_ASM_EXT(LD, R1, reg + 2),			//4000 irqDev
+		KEMU_ASM_EXT(LD, R2, gpuID),				//4002
+		KEMU_ASM(ST, R1, R2),						//4004
+		KEMU_ASM_EXT(LD, R1, reg + 5),			//4005 dst
+		KEMU_ASM_EXT(LD, R2, 0x0800),				//4007
+		KEMU_ASM(ST, R1, R2),						//4009
+		KEMU_ASM_EXT(LD, R1, reg + 6),			//400A length
+		KEMU_ASM(LD, R2, 0x20),						//400C
+		KEMU_ASM(ST, R1, R2),						//400D
+		KEMU_ASM(LD, R3, 0),							//400E irqAddr
+		KEMU_ASM_EXT(LD, R7, 0xFFC0),				//400F 64 fills
+		//fill
+		KEMU_ASM_EXT(LD, R1, reg + 3),			//4011
+		KEMU_ASM(ST, R1, R3),						//4013
+		KEMU_ASM_EXT(LD, R1, reg),					//4014 command
+		KEMU_ASM(LD, R2, FILL_DMA),				//4016
+		KEMU_ASM(ST, R1, R2),						//4017
+		KEMU_ASM(ADD, R3, 1),						//4018
+		KEMU_ASM_EXT(LD, R6, 0xFFF0),				//4019 outlasts the fill
+		//delay
+		KEMU_ASM(ADD, R6, 1),						//401B
+		KEMU_ASM_EXT(JC, 0, 0x4020),				//401C
+		KEMU_ASM_EXT(JMP, 0, 0x401B),				//401E
+		KEMU_ASM(ADD, R7, 1),						//4020
+		KEMU_ASM_EXT(JC, 0, 0x4025),				//4021
+		KEMU_ASM_EXT(JMP, 0, 0x4011),				//4023
+		KEMU_ASM(TRM, 0, 0),						//4025
+	};
+	memcpy(prog, code, sizeof(code));
+	*words = sizeof(code)/sizeof(code[0]);
+}
+
+/**
+ * @brief GPU_DEV data and machine state of a worker run match the run with workerCount 0 at every quantum end
+ * A snapshot restored mid-run with workers continues as the uninterrupted run
+ */
+void kemuWorker_unitIrq(){
+	#include "kemugon/sys/instr.h"
+	uint16_t prog[64];
+	size_t words;
+	KemuSys ref, sys;
+	kemuWorker_unitBoot(&ref, 0, NULL, 0);
+	kemuWorker_irqProg(prog, &words, kemuDev_devByType(&ref, GPU_DEV, 0)->devID);
+	kemuSys_free(&ref);
+
+	kemuWorker_unitBoot(&ref, 0, prog, words);
+	kemuWorker_unitBoot(&sys, 1, prog, words);
+	KemuDev *refGpu = kemuDev_devByType(&ref, GPU_DEV, 0);
+	KemuDev *gpu = kemuDev_devByType(&sys, GPU_DEV, 0);
+	KEMU_UNIT_CHECK(refGpu->worker == 0 && gpu->worker == 1, "GPU_DEV owners %u and %u, expected main thread and worker 1", refGpu->worker, gpu->worker);
+
+	KemuSnap snap = {0};
+	KemuSnap refSnap = {0};
+	uint8_t same = 1;
+	for(uint16_t i=0; same && !ref.quitFlag && i<1000; i++){
+		if(i == 20){
+			KEMU_UNIT_CHECK(kemuSys_snapshot(&sys, &snap) == KEMU_SUCCESS, "snapshot with workers failed");
+			kemuSys_snapshot(&ref, &refSnap);
+		}
+		if(i == 30){
+			KEMU_UNIT_CHECK(kemuSys_restore(&sys, &snap) == KEMU_SUCCESS, "restore with workers failed");
+			kemuSys_restore(&ref, &refSnap);
+		}
+		kemuDev_run(&ref, 50);
+		kemuDev_run(&sys, 50);
+		same = kemuUnit_sameState(&ref, &sys, "worker irq") && memcmp(refGpu->data, gpu->data, KEMU_PAGE_SIZE * sizeof(uint16_t)) == 0;
+	}
+	KEMU_UNIT_CHECK(same && sys.quitFlag, "worker run differs from the main thread run at cycle %lu", sys.emuCycle);
+	uint32_t missed = 0;
+	for(uint16_t i=0; i<64; i++){
+		missed += gpu->data[i] != DONE_STATUS;
+	}
+	KEMU_UNIT_CHECK(missed == 0, "%u of 64 completions did not reach the worker device", missed);
+	kemuSnap_free(&snap);
+	kemuSnap_free(&refSnap);
+	kemuSys_free(&sys);
+	kemuSys_free(&ref);
+}
+
+typedef struct{
+	KemuSys *sys;
+	uint16_t count;
+	_Atomic uint8_t done;
+}KemuWorker_unitPoster;
+
+/**
+ * @brief Posts count messages as the worker owned GPU_DEV would, to words of the DATA_DEV
+ */
+static void *kemuWorker_unitPost(void *arg){
+	KemuWorker_unitPoster *poster = arg;
+	KemuDev *gpu = kemuDev_devByType(poster->sys, GPU_DEV, 0);
+	uint8_t dataID = kemuDev_devByType(poster->sys, DATA_DEV, 0)->devID;
+	for(uint16_t i=0; i<poster->count; i++){
+		kemuDev_post(poster->sys, gpu, (KemuQueue_msg){ .devID = dataID, .addr = i, .value = i + 1 });
+	}
+	atomic_store(&poster->done, 1);
+	return NULL;
+}
+
+/**
+ * @brief Messages past a full queue wait instead of being dropped, both from a worker and to one
+ */
+void kemuWorker_unitBackpressure(){
+	KemuSys sys;
+	kemuWorker_unitBoot(&sys, 1, NULL, 0);
+	KemuDev *dma = kemuDev_devByType(&sys, DMA_DEV, 0);
+	KemuDev *gpu = kemuDev_devByType(&sys, GPU_DEV, 0);
+	KemuDev *data = kemuDev_devByType(&sys, DATA_DEV, 0);
+	const uint16_t count = 3 * KEMU_QUEUE_SIZE;
+
+	//Worker outbox fills up, the barrier drains it
+	KemuWorker_unitPoster poster = { .sys = &sys, .count = count, .done = 0 };
+	pthread_t thread;
+	pthread_create(&thread, NULL, kemuWorker_unitPost, &poster);
+	while(!atomic_load(&poster.done)){
+		kemuDev_run(&sys, 100);
+	}
+	pthread_join(thread, NULL);
+	kemuDev_run(&sys, 100);
+	uint32_t missed = 0;
+	for(uint16_t i=0; i<count; i++){
+		missed += data->data[i] != i + 1;
+	}
+	KEMU_UNIT_CHECK(missed == 0, "%u of %u worker messages were lost", missed, count);
+
+	//Main thread messages to the worker wait until the quantum ends
+	for(uint16_t i=0; i<count; i++){
+		KEMU_UNIT_CHECK(kemuDev_post(&sys, dma, (KemuQueue_msg){ .devID = gpu->devID, .addr = i % KEMU_PAGE_SIZE, .value = i }) == KEMU_SUCCESS,
+			"post %u to the worker failed", i);
+	}
+	KEMU_UNIT_CHECK(gpu->data[0] == 0, "worker device written before the quantum ended");
+	kemuDev_run(&sys, 100);
+	missed = 0;
+	for(uint16_t i=0; i<KEMU_PAGE_SIZE; i++){
+		missed += gpu->data[i] != count - KEMU_PAGE_SIZE + i;
+	}
+	KEMU_UNIT_CHECK(missed == 0, "%u worker device words missed the last of %u messages", missed, count);
+	kemuSys_free(&sys);
+}
+
+void kemuWorker_unit(){
+	kemuWorker_unitIrq();
+	kemuWorker_unitBackpressure();
+
+	printf("kemuWorker_unit Done\n");
+}
@@ -0,0 +1,59 @@
+/**
+ * @file runKemuTests.c
+ *
+ * @brief Run all emulator unit tests, exits with failure if any check failed
+ * Kept apart from runUnitTests.c, whose libkael tests need modules that are not part of this tree
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "libkael/debug/kaelMacros.h"
+
+#include "./include/kemuUnit.h"
+#include "./include/kemuJitUnit.h"
+#include "./include/kemuSysUnit.h"
+#include "./include/kemuSnapUnit.h"
+#include "./include/kemuImageUnit.h"
+#include "./include/kemuDevUnit.h"
+#include "./include/kemuAsmUnit.h"
+#include "./include/kemuFuseUnit.h"
+#include "./include/kemuFlagUnit.h"
+#include "./include/kemuWorkerUnit.h"
+#include "./include/kemuStoreUnit.h"
+#include "./include/kemuProgUnit.h"
+
+
+
+void unitTest_runTests(){
+	void(*unitTest_func[])() = {
+		kemuJit_unit		,
+		kemuSys_unit		,
+		kemuSnap_unit		,
+		kemuImage_unit		,
+		kemuDev_unit		,
+		kemuAsm_unit		,
+		kemuFuse_unit		,
+		kemuFlag_unit		,
+		kemuWorker_unit	,
+		kemuStore_unit		,
+		kemuProg_unit		,
+	};
+	uint16_t unitTestCount = sizeof(unitTest_func)/sizeof(unitTest_func[0]);
+
+	for(uint16_t i=0; i<unitTestCount; i++){
+		unitTest_func[i]();
+	}
+}
+
+
+int main(){
+	unitTest_runTests();
+
+	if(kemuUnit_failCount){
+		printf("%u checks failed\n", kemuUnit_failCount);
+		return EXIT_FAILURE;
+	}
+   return 0;
+}